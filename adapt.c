@@ -0,0 +1,162 @@
+/**
+ * adapt.c
+ * 動画再生で出力の速さに追従する (--adaptive)
+ * フレームごとに出力したバイト数と出力にかかった時間 (出力先が詰まって write で待たされた時間を含む) から
+ * 出力の速さ (受け取ってもらえたバイト/秒) を測り、1フレームの時間 (1 / fps) に出力が収まるように
+ * 横幅と色モード (フルカラー → 256色 → 8色) を決め直す。
+ * 候補は色モードと横幅 (端末の横幅の 1/ADAPT_STEPS 刻み) の組で、見た目の点数で比べる。
+ * 時間を超えたら、測った速さで収まると見積もれる一番点数の高い候補まで一気に下げる。
+ * 書き出しが詰まっていなければ出力先の本当の速さは分からないので、余裕のあるフレームがしばらく続いたら
+ * 出力バイト数が今の ADAPT_PROBE 倍までの候補に上げて試す。試した直後に下げることになったら
+ * その点数を上限として覚え、上限以上を次に試すまでの間を倍にする (行ったり来たりを減らす)。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "cbmpviewer.h"
+
+// fps の指定がない (0) ときの目標のフレームレート
+#define ADAPT_FPS 30.0
+// 横幅の刻み数
+#define ADAPT_STEPS 16
+// 横幅の下限 (文字数)
+#define ADAPT_MINCOLS 16
+// 1フレームの時間のこの割合に収まると見積もれる候補を選ぶ
+#define ADAPT_MARGIN 0.8
+// 出力にかかった時間の割合 (load) がこれを超えたら下げ、これ未満が続いたら上げる
+#define ADAPT_OVER 0.9
+#define ADAPT_UNDER 0.5
+// 上げるまでに余裕が続く時間 (秒) と、試して失敗したときに延ばす上限の倍率
+#define ADAPT_CALM 1.0
+#define ADAPT_MAXBACKOFF 8
+// 上げるときの1フレームの出力バイト数の増え方の上限
+#define ADAPT_PROBE 1.5
+// 変えた後で測り直すまで変えないフレーム数
+#define ADAPT_HOLD 3
+// 指数移動平均の重み
+#define ADAPT_ALPHA 0.25
+
+// 色モードごとの見た目の点数 (横幅に掛ける)
+// フルカラーと256色の差は小さく、8色まで落とすなら横幅を半分近くにしたほうがよいとみなす
+static const double quality[3] = {0.5, 0.9, 1.0};
+// 色モードごとの1文字あたりのバイト数の比 (まだ測っていない色モードの見積もりに使う)
+// make bench の 80 文字での 8色 2.6、256色 6.2、フルカラー 21 バイトから
+static const double weight[3] = {1.0, 2.4, 8.0};
+
+// 指数移動平均 (まだ値が無ければ x そのもの)
+static double average(double avg, double x) {
+    return avg > 0 ? avg + ADAPT_ALPHA * (x - avg) : x;
+}
+
+// 出力の速さへの追従の初期化
+// 横幅は cols、色モードは maxlevel (端末の色数) から始める
+void initadapt(adapt_t *ad, uint32_t cols, int maxlevel, double fps) {
+    memset(ad, 0, sizeof(*ad));
+    ad->maxcols = ad->cols = MAX(cols, 1);
+    ad->mincols = MIN(ADAPT_MINCOLS, ad->maxcols);
+    ad->maxlevel = ad->level = maxlevel;
+    ad->budget = 1.0 / (fps > 0 ? fps : ADAPT_FPS);
+    ad->backoff = 1;
+    ad->decision = "keep";
+}
+
+// 1フレームの出力バイト数の見積もりが limit 以下の候補から一番点数の高いものを選ぶ (無ければ 0 を返す)
+// up なら今より点数の高いものだけから選ぶ
+// 見積もりは今の横幅での文字数 cells から横幅の2乗に比例するとして求める
+static int pick(const adapt_t *ad, double cells, double limit, int up, int *level, uint32_t *cols) {
+    double best = up ? quality[ad->level] * ad->cols : -1, b, q, r;
+    uint32_t k, c;
+    int l, found = 0;
+
+    for (l = ad->maxlevel; l >= 0; l--) {
+        b = ad->bpc[l] > 0 ? ad->bpc[l] : ad->bpc[ad->level] * weight[l] / weight[ad->level];
+        for (k = ADAPT_STEPS; k >= 1; k--) {
+            c = MAX(ad->maxcols * k / ADAPT_STEPS, ad->mincols);
+            r = (double)c / ad->cols;
+            q = quality[l] * c;
+            if (b * cells * r * r > limit || q <= best)
+                continue;
+            best = q;
+            *level = l;
+            *cols = c;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+// 1フレームの出力を測って横幅・色モードを決め直す (変えたら 1 を返す)
+// bytes は出力したバイト数、cells は描いたフレームの文字数、out は縮小から書き出し終わるまでの時間 (秒)
+// 出力の速さは bytes / max(out, 1フレームの時間) で、1フレームの時間を超えていれば (書き出しが詰まっていれば)
+// 出力先が受け取れる速さ、超えていなければ少なくともこれだけは受け取れるという下限になる
+int adaptframe(adapt_t *ad, uint64_t bytes, uint64_t cells, double out) {
+    uint32_t calm = MAX((uint32_t)(ADAPT_CALM / ad->budget), ADAPT_HOLD);
+    double score = quality[ad->level] * ad->cols;
+    uint32_t cols = ad->cols;
+    int level = ad->level;
+
+    ad->decision = "keep";
+    if (bytes == 0 || cells == 0 || out <= 0)
+        return 0;
+    ad->rate = average(ad->rate, bytes / MAX(out, ad->budget));
+    ad->bpc[ad->level] = average(ad->bpc[ad->level], (double)bytes / cells);
+    ad->load = average(ad->load, out / ad->budget);
+    if (ad->hold > 0) {
+        ad->hold--;
+        ad->decision = "hold";
+        return 0;
+    }
+
+    if (ad->load > ADAPT_OVER) {
+        // 収まる候補が無ければ一番小さくする
+        ad->calm = 0;
+        if (!pick(ad, cells, ad->rate * ad->budget * ADAPT_MARGIN, 0, &level, &cols)) {
+            level = 0;
+            cols = ad->mincols;
+        }
+    } else if (ad->load < ADAPT_UNDER) {
+        // 前に失敗した点数以上を試すのは余裕が backoff 倍の間続いてから
+        if (++ad->calm < calm || !pick(ad, cells, ad->bpc[ad->level] * cells * ADAPT_PROBE, 1, &level, &cols))
+            return 0;
+        if (ad->ceiling > 0 && quality[level] * cols >= ad->ceiling && ad->calm < calm * ad->backoff)
+            return 0;
+        ad->calm = 0;
+    } else {
+        ad->calm = 0;
+        return 0;
+    }
+    if (level == ad->level && cols == ad->cols)
+        return 0;
+
+    debug("[ADAPT: OK] %u cols level %d -> %u cols level %d (rate=%.0f,load=%.2f)\n",
+          ad->cols, ad->level, cols, level, ad->rate, ad->load);
+    if (quality[level] * cols < score) {
+        if (ad->probing) {
+            // 上げた直後に下げる: 試した点数を上限にして、次に試すまでの間を延ばす
+            ad->backoff = MIN(ad->backoff * 2, ADAPT_MAXBACKOFF);
+            ad->ceiling = score;
+        } else {
+            // 上げていないのに下げる: 出力先の速さが変わったので覚えていた上限は忘れる
+            ad->backoff = 1;
+            ad->ceiling = 0;
+        }
+        ad->probing = 0;
+        ad->decision = "down";
+    } else {
+        // 上限以上で続けて上げられたら上限は忘れる
+        if (ad->probing && ad->ceiling > 0 && score >= ad->ceiling) {
+            ad->backoff = 1;
+            ad->ceiling = 0;
+        }
+        ad->probing = 1;
+        ad->decision = "up";
+    }
+    ad->level = level;
+    ad->cols = cols;
+    ad->hold = ADAPT_HOLD;
+    // load は新しい設定で測り直す (前の設定の値で続けて変えないように)
+    ad->load = 0;
+    return 1;
+}
@@ -0,0 +1,267 @@
+/**
+ * bench.c
+ * 段階ごとのベンチマーク (make bench)
+ * いろいろな大きさ・縦横比の24ビット BMP を生成し、ヘッダ解析・読み込み・縮小・
+ * 近似色探索・エスケープシーケンス生成の時間を 8色・256色・フルカラーそれぞれで測る。
+ * セル1つがちょうど整数の画素数になる大きさでは、積分画像を作らない直接の縮小 (box) の時間も測る。
+ * 表を標準出力に、版ごとに比べられるよう1ケース1行の JSON を結果ファイルに書く。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "cbmpviewer.h"
+
+#ifndef BENCH_VERSION
+#define BENCH_VERSION "unknown"
+#endif
+
+// 各段階を繰り返して最速の時間を取る回数
+#define BENCH_REPS 5
+// コンソールの横幅
+#define BENCH_COLS 80
+
+// 生成する画像の大きさ
+// 幅 1, 2, 3 は行末のパディングが 3, 2, 1 byte、半端な幅・高さや極端な縦横比も含める
+// 160x160, 240x240, 320x320 は 80 文字でセル1つが 2x4, 3x6, 4x8 画素になる
+static const struct {
+    int32_t width, height;
+} sizes[] = {
+    {1, 1}, {2, 7}, {3, 5}, {81, 17}, {640, 480}, {1001, 333},
+    {333, 2000}, {1920, 1080}, {4000, 3000}, {7001, 89},
+    {160, 160}, {240, 240}, {320, 320},
+};
+
+// 色モード
+static const struct {
+    const char *name;
+    int color256, fullcolor;
+} modes[] = {
+    {"8", 0, 0}, {"256", 1, 0}, {"truecolor", 1, 1},
+};
+
+// 単調増加の時計 (秒)
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 2byte・4byte (リトルエンディアン) 書く
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+// 合成画像の BMP を一時ファイルに書く
+// グラデーションに擬似乱数のノイズを重ね、近似色探索が同じ色ばかりにならないようにする
+// パディングには 0 以外を入れておき、読み飛ばしを間違えると色がずれるようにする
+static void writebmp(const char *path, int32_t width, int32_t height) {
+    uint8_t head[54] = {0};
+    size_t stride = bmpstride(width);
+    uint8_t *row;
+    uint32_t seed = 1, x, y;
+    FILE *fp;
+
+    put16(head, 0x4d42);
+    put32(head + 2, 54 + stride * height);
+    put32(head + 10, 54);
+    put32(head + 14, 40);
+    put32(head + 18, width);
+    put32(head + 22, height);
+    put16(head + 26, 1);
+    put16(head + 28, 24);
+    put32(head + 34, stride * height);
+    if ((fp = fopen(path, "wb")) == NULL || (row = (uint8_t *)malloc(stride)) == NULL) {
+        printf("Error: file open\n");
+        exit(EXIT_FAILURE);
+    }
+    fwrite(head, sizeof(head), 1, fp);
+    for (y = 0; y < (uint32_t)height; y++) {
+        memset(row, 0xa5, stride);
+        for (x = 0; x < (uint32_t)width; x++) {
+            seed = seed * 1103515245 + 12345;
+            row[x * 3 + 0] = (x * 255 / width + (seed >> 16) % 32);
+            row[x * 3 + 1] = (y * 255 / height + (seed >> 21) % 32);
+            row[x * 3 + 2] = ((x + y) * 255 / (width + height) + (seed >> 26) % 32);
+        }
+        fwrite(row, stride, 1, fp);
+    }
+    free(row);
+    fclose(fp);
+}
+
+// 近似色探索済みの色 clr から i 行目を出力する (outputrow の色変換を除いた部分)
+static void emitrow(const uint32_t *clr, const consolebmp_t *cbmp, uint32_t i, outbuf_t *ob) {
+    uint32_t j, prev = (uint32_t)-1;
+
+    obreserve(ob, (size_t)cbmp->letter * CELL_MAXBYTES + 16);
+    clr += (size_t)i * cbmp->letter;
+    for (j = 0; j < cbmp->letter; j++) {
+        if (prev != clr[j]) {
+            prev = clr[j];
+            putcolor(ob, clr[j], cbmp);
+        }
+        putglyph(ob, clr[j], cbmp);
+    }
+    obputlit(ob, "\x1b[39m\x1b[49m\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *result = argc > 1 ? argv[1] : "bench_output.txt";
+    char path[] = "/tmp/cbmpbench.XXXXXX";
+    FILE *fp, *out;
+    bmpfileheader_t fh;
+    bmpinfoheader_t ih;
+    bmpformat_t bf;
+    bmpimage_t img;
+    sat_t sat = {NULL, 0, 0};
+    consolebmp_t cbmp;
+    reducer_t rd;
+    outbuf_t ob;
+    pixel_t *cell, *boxcell;
+    boxkernel_t kernel;
+    uint32_t *clr, i, n, acc;
+    size_t s, m;
+    int r, fd;
+    double t, header, load, down, stream, box, match, emit, total;
+
+    if ((out = fopen(result, "w")) == NULL || (fd = mkstemp(path)) < 0) {
+        printf("Error: file open\n");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    initpalette();
+    printf("%-11s %-9s %9s %9s %9s %9s %9s %9s %9s %9s %9s\n", "image", "mode", "header", "load", "downsamp",
+           "stream", "box", "match", "emit", "total", "bytes");
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        writebmp(path, sizes[s].width, sizes[s].height);
+
+        // ヘッダ解析
+        header = load = down = stream = box = 1e9;
+        for (r = 0; r < BENCH_REPS; r++) {
+            t = now();
+            if ((fp = fopen(path, "rb")) == NULL) {
+                printf("Error: file open\n");
+                return EXIT_FAILURE;
+            }
+            getbmpheader(fp, &fh, &ih);
+            checkbmpheader(&fh, &ih);
+            readbmpformat(fp, &fh, &ih, &bf);
+            header = MIN(header, now() - t);
+            fclose(fp);
+        }
+        cbmp.half = 0;
+        cbmp.color256 = cbmp.fullcolor = 0;
+        cbmp.threshold_r = cbmp.threshold_g = cbmp.threshold_b = 128;
+        setscale(&cbmp, ih.width, ih.height, BENCH_COLS);
+        n = cbmp.letter * cbmp.line;
+        if ((cell = (pixel_t *)malloc(sizeof(pixel_t) * n)) == NULL
+            || (boxcell = (pixel_t *)malloc(sizeof(pixel_t) * n)) == NULL
+            || (clr = (uint32_t *)malloc(sizeof(uint32_t) * n)) == NULL) {
+            printf("Error: memory allocate\n");
+            return EXIT_FAILURE;
+        }
+
+        // 読み込み (mmap と積分画像の構築、ピクセルを実際に読むのはここ) と縮小
+        fp = fopen(path, "rb");
+        for (r = 0; r < BENCH_REPS; r++) {
+            t = now();
+            loadbmpimage(fp, &bf, &img);
+            buildsat(&img, &sat);
+            load = MIN(load, now() - t);
+            freebmpimage(&img);
+            t = now();
+            downsample(&sat, &cbmp, 0, cbmp.line, cell);
+            down = MIN(down, now() - t);
+        }
+        // 比較用: 画像全体を載せない1行ずつの読み込みと縮小
+        for (r = 0; r < BENCH_REPS; r++) {
+            fseeko(fp, 54, SEEK_SET);
+            t = now();
+            initreducer(&rd, &cbmp, ih.width, ih.height);
+            streambmp(fp, &bf, &rd, NULL, -1);
+            freereducer(&rd);
+            stream = MIN(stream, now() - t);
+        }
+        // 比較用: 積分画像を作らない直接の縮小 (使える大きさのときだけ、縮小の結果が同じになることも確認する)
+        if ((kernel = boxkernel(&cbmp, ih.width, ih.height)) != NULL) {
+            for (r = 0; r < BENCH_REPS; r++) {
+                t = now();
+                loadbmpimage(fp, &bf, &img);
+                kernel(&img, &cbmp, 0, cbmp.line, boxcell);
+                box = MIN(box, now() - t);
+                freebmpimage(&img);
+            }
+            if (memcmp(cell, boxcell, sizeof(pixel_t) * n) != 0) {
+                printf("Error: box kernel mismatch\n");
+                return EXIT_FAILURE;
+            }
+        }
+        fclose(fp);
+        freesat(&sat);
+
+        for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+            cbmp.color256 = modes[m].color256;
+            cbmp.fullcolor = modes[m].fullcolor;
+            obinit(&ob, (size_t)n * CELL_MAXBYTES + cbmp.line * 16);
+            match = emit = total = 1e9;
+            for (r = 0; r < BENCH_REPS; r++) {
+                // 近似色探索
+                t = now();
+                for (i = 0; i < n; i++)
+                    clr[i] = cellcolor(&cell[i], &cbmp);
+                match = MIN(match, now() - t);
+                // エスケープシーケンス生成
+                ob.len = 0;
+                t = now();
+                for (i = 0; i < cbmp.line; i++)
+                    emitrow(clr, &cbmp, i, &ob);
+                emit = MIN(emit, now() - t);
+                // 実際の出力処理 (近似色探索と生成をまとめて行う) と同じになることの確認
+                acc = ob.len;
+                ob.len = 0;
+                t = now();
+                outputlines(cell, &cbmp, 0, cbmp.line, &ob);
+                total = MIN(total, now() - t);
+                if (ob.len != acc) {
+                    printf("Error: output mismatch\n");
+                    return EXIT_FAILURE;
+                }
+            }
+
+            // 直接の縮小を使えない大きさでは box は -1
+            if (kernel == NULL)
+                box = -1e-6;
+            printf("%5dx%-5d %-9s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9zu\n",
+                   sizes[s].width, sizes[s].height, modes[m].name, header * 1e6, load * 1e6, down * 1e6,
+                   stream * 1e6, box * 1e6, match * 1e6, emit * 1e6, total * 1e6, ob.len);
+            fprintf(out, "{\"version\":\"%s\",\"width\":%d,\"height\":%d,\"cols\":%u,\"lines\":%u,\"mode\":\"%s\","
+                    "\"header_us\":%.1f,\"load_us\":%.1f,\"downsample_us\":%.1f,\"stream_us\":%.1f,\"box_us\":%.1f,"
+                    "\"match_us\":%.1f,\"emit_us\":%.1f,\"output_us\":%.1f,\"bytes\":%zu}\n",
+                    BENCH_VERSION, sizes[s].width, sizes[s].height, cbmp.letter, cbmp.line, modes[m].name,
+                    header * 1e6, load * 1e6, down * 1e6, stream * 1e6, box * 1e6, match * 1e6, emit * 1e6,
+                    total * 1e6, ob.len);
+            obfree(&ob);
+        }
+        free(cell);
+        free(boxcell);
+        free(clr);
+    }
+    printf("(us, best of %d; bytes = output bytes per frame at %d columns)\n", BENCH_REPS, BENCH_COLS);
+    printf("results: %s\n", result);
+
+    unlink(path);
+    fclose(out);
+    return EXIT_SUCCESS;
+}
@@ -5,20 +5,30 @@ use warnings;
 use Carp; 
 
 my $ffmpeg_exe = 'ffmpeg';
+# cbmpviewer --serve のソケット (あればデーモンに描画を頼み、テーブルの構築などを毎回しない)
+my $socket = $ENV{'CIMAGE_SOCKET'};
+$socket = undef unless defined $socket && -S $socket;
 
 sub view
 {
     my $file = shift;
-    my $TMPDIR = '/tmp/';
-    my $tmp = $file;
-    $tmp =~ tr#/#-#;
-    open my $fh,  $ffmpeg_exe . ' -i "' . $file . '" -f image2 ' . $TMPDIR . $tmp . '.bmp  2>&1 |';
-    my @info = <$fh>;
-    close $fh;
-    # print "@info";
-    system( 'cbmpviewer ' .  $TMPDIR . $tmp . '.bmp' );
+    # BMP・JPEG・PNG は cbmpviewer が直接読む (JPEG は縮小しながら、PNG は1行ずつ復号するので ffmpeg より速い)
+    open my $in, '<', $file or croak "$file: $!";
+    binmode $in;
+    read $in, my $magic, 2;
+    close $in;
+    if ( defined $magic && ( $magic eq 'BM' || $magic eq "\xff\xd8" || $magic eq "\x89P" ) ) {
+        if ( defined $socket ) {
+            system( 'cbmpviewer', '--client', $socket, $file );
+            return;
+        }
+        system( 'cbmpviewer', '--cache', $file );
+        return;
+    }
+    # 同じ画像を同じ設定で表示したことがあればキャッシュから出すだけで ffmpeg は起動しない
+    return if system( 'cbmpviewer', '--cache-only', '--cache-as', $file, '-' ) == 0;
+    # BMP をパイプで渡し、元の画像をキーにキャッシュする
+    system( $ffmpeg_exe . ' -v quiet -i "' . $file . '" -f image2pipe -vcodec bmp -pix_fmt bgr24 - | cbmpviewer --cache-as "' . $file . '" -' );
 }
 
 &view($_) foreach(@ARGV);
-
-
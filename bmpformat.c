@@ -0,0 +1,463 @@
+/**
+ * bmpformat.c
+ * BMP のヘッダの読み込みと画素形式ごとの読み込み
+ * 1/4/8bit のパレット画像、16/32bit (ビットフィールド)、RLE8/RLE4 を扱う。
+ * 1行ごとに画素形式に合わせた展開を行い、行ストリーム縮小 (reduce.c) に渡す。
+ * パレット画像は B G R に展開せず、パレット番号のまま渡してセルごとのヒストグラムで平均を求める。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cbmpviewer.h"
+
+// 画像ヘッダ取得
+void getbmpheader(FILE *fp, bmpfileheader_t *fh, bmpinfoheader_t *ih) {
+    // 各値を取得
+    freadwitherror(&fh->type, 2, fp);
+    // タイプに関してはBM(リトルエンディアンで0x4d42)じゃなかったらそこで落とす
+    if (fh->type != 0x4d42)
+        fail(CIMAGE_EFORMAT, "input file is not bitmap");
+    freadwitherror(&fh->size, 4, fp);
+    freadwitherror(&fh->reserved1, 2, fp);
+    freadwitherror(&fh->reserved2, 2, fp);
+    freadwitherror(&fh->offbits, 4, fp);
+
+    freadwitherror(&ih->size, 4, fp);
+    freadwitherror(&ih->width, 4, fp);
+    freadwitherror(&ih->height, 4, fp);
+    freadwitherror(&ih->planes, 2, fp);
+    freadwitherror(&ih->bitcount, 2, fp);
+    freadwitherror(&ih->compression, 4, fp);
+    freadwitherror(&ih->sizeimage, 4, fp);
+    freadwitherror(&ih->xpixpermeter, 4, fp);
+    freadwitherror(&ih->ypixpermeter, 4, fp);
+    freadwitherror(&ih->clrused, 4, fp);
+    freadwitherror(&ih->clrimporant, 4, fp);
+}
+
+// ファイルポインタから指定のバイト取得(エラー処理付き)
+void freadwitherror(void *buf, int byte, FILE *fp) {
+    if (fread(buf, byte, 1, fp) != 1)
+        fail(CIMAGE_EREAD, "file read");
+}
+
+// 画像ヘッダの(このプログラムで対応する)フォーマットチェック
+void checkbmpheader(bmpfileheader_t *fh, bmpinfoheader_t *ih) {
+    // 幅・高さが0の画像ははじく
+    if (ih->width <= 0 || ih->height == 0 || ih->height == INT32_MIN)
+        fail(CIMAGE_EFORMAT, "invalid image size");
+    // OS/2 形式 (情報ヘッダが 40byte 未満) ははじく
+    if (ih->size < 40)
+        fail(CIMAGE_EUNSUPPORTED, "this program currently does not work for OS/2 bmp");
+    // ビットカウント 1, 4, 8, 16, 24, 32 以外ははじく
+    if (ih->bitcount != 1 && ih->bitcount != 4 && ih->bitcount != 8
+        && ih->bitcount != 16 && ih->bitcount != 24 && ih->bitcount != 32)
+        fail(CIMAGE_EUNSUPPORTED, "this program currently does not work for %u-bit bmp", ih->bitcount);
+    // 無圧縮、RLE8 (8bit)、RLE4 (4bit)、ビットフィールド (16/32bit) 以外は弾く
+    if (!(ih->compression == BI_RGB
+          || (ih->compression == BI_RLE8 && ih->bitcount == 8)
+          || (ih->compression == BI_RLE4 && ih->bitcount == 4)
+          || (ih->compression == BI_BITFIELDS && (ih->bitcount == 16 || ih->bitcount == 32))))
+        fail(CIMAGE_EUNSUPPORTED, "this program currently does not work for compressed bmp");
+    // RLE はトップダウンにできない
+    if (ih->height < 0 && ih->compression != BI_RGB && ih->compression != BI_BITFIELDS)
+        fail(CIMAGE_EFORMAT, "invalid top-down bmp");
+}
+
+// 画像ヘッダの表示
+void showbmpheader(bmpfileheader_t *fh, bmpinfoheader_t *ih) {
+    debug("--file header--\n");
+    debug("type: %c%c\n", (char)fh->type, (char)(fh->type >> 8));
+    debug("size: %u\n", fh->size);
+    debug("reserved1: %u\n", fh->reserved1);
+    debug("reserved1: %u\n", fh->reserved2);
+    debug("offbits: %u\n", fh->offbits);
+    debug("--info header--\n");
+    debug("size: %u\n", ih->size);
+    debug("width: %d\n", ih->width);
+    debug("height: %d\n", ih->height);
+    debug("planes: %u\n", ih->planes);
+    debug("bitcount: %u\n", ih->bitcount);
+    debug("compression: %u\n", ih->compression);
+    debug("sizeimage: %u\n", ih->sizeimage);
+    debug("xpixpermeter: %d\n", ih->xpixpermeter);
+    debug("ypixpermeter: %d\n", ih->ypixpermeter);
+    debug("clrused: %u\n", ih->clrused);
+    debug("clrimporant: %u\n", ih->clrimporant);
+}
+
+// 画像データの先頭 data から一番上の行と1行下に進むときのバイト数を決める
+// ボトムアップならファイル上の先頭は一番下の行
+static void setbmprows(bmpimage_t *img, const bmpformat_t *bf, const uint8_t *data) {
+    if (bf->topdown) {
+        img->top = data;
+        img->pitch = (ptrdiff_t)bf->stride;
+    } else {
+        img->top = data + bf->stride * (img->height - 1);
+        img->pitch = -(ptrdiff_t)bf->stride;
+    }
+}
+
+// 画像データの読み込み
+// 無圧縮 24bit の通常ファイルなら丸ごと mmap して offbits から先を直接参照する
+// mmap できない入力 (パイプなど) やその他の画素形式なら 0 を返す (1行ずつ読んで縮小する)
+// データはボトムアップに入っていることに注意する (高さが負数ならトップダウン)
+// 1行は4byteできり(つまり4の倍数)を合わせなきゃいけない
+// w:1 -> 3byte -> padding:1byte
+// w:2 -> 6byte -> padding:2byte
+// w:3 -> 9byte -> padding:3byte
+// w:4 -> 12byte -> padding:0byte
+// くりかえし
+int loadbmpimage(FILE *fp, const bmpformat_t *bf, bmpimage_t *img) {
+    struct stat st;
+    uint64_t datalen = (uint64_t)bf->stride * (uint64_t)bf->height;
+
+    img->width = bf->width;
+    img->height = bf->height;
+    img->map = NULL;
+    img->maplen = 0;
+    img->buf = NULL;
+
+    if (bf->bitcount != 24 || bf->compression != BI_RGB)
+        return 0;
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode))
+        return 0;
+    if ((uint64_t)st.st_size < (uint64_t)bf->offbits + datalen)
+        fail(CIMAGE_EREAD, "file read");
+    img->maplen = st.st_size;
+    img->map = mmap(NULL, img->maplen, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (img->map == MAP_FAILED) {
+        img->map = NULL;
+        return 0;
+    }
+    madvise(img->map, img->maplen, MADV_WILLNEED);
+    setbmprows(img, bf, (uint8_t *)img->map + bf->offbits);
+    return 1;
+}
+
+// メモリ上の BMP ファイル data (len バイト) の画像データを直接参照する (コピーしない)
+// 無圧縮 24bit でなければ 0 を返す (1行ずつ読んで縮小する)
+int viewbmpimage(const uint8_t *data, size_t len, const bmpformat_t *bf, bmpimage_t *img) {
+    img->width = bf->width;
+    img->height = bf->height;
+    img->map = NULL;
+    img->maplen = 0;
+    img->buf = NULL;
+
+    if (bf->bitcount != 24 || bf->compression != BI_RGB)
+        return 0;
+    if ((uint64_t)len < (uint64_t)bf->offbits + bf->stride * (uint64_t)bf->height)
+        fail(CIMAGE_EREAD, "file read");
+    setbmprows(img, bf, data + bf->offbits);
+    return 1;
+}
+
+// 画像データの解放
+void freebmpimage(bmpimage_t *img) {
+    if (img->map != NULL)
+        munmap(img->map, img->maplen);
+    xfree(img->buf);
+    img->map = NULL;
+    img->buf = NULL;
+}
+
+// 画像データの表示
+void showbmpdata(const bmpimage_t *img) {
+    int i, j;
+    const uint8_t *p;
+
+    for (i = 0; i < img->height; i++) {
+        p = bmprow(img, i);
+        for (j = 0; j < img->width; j++, p += 3) {
+            printf("R=%x G=%x B%x\n", p[2], p[1], p[0]);
+        }
+        printf("\n");
+    }
+}
+
+// マスクの最下位ビットの位置とビット数
+static void maskbits(uint32_t mask, uint8_t *shift, uint8_t *bits) {
+    *shift = *bits = 0;
+    if (mask == 0)
+        return;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        (*shift)++;
+    }
+    while (mask & 1) {
+        mask >>= 1;
+        (*bits)++;
+    }
+}
+
+// ヘッダの後ろのビットフィールドとパレットを読む
+// fp は情報ヘッダの最初の 40byte まで読み込み済みであること
+// ビットフィールドのマスクは情報ヘッダの直後 (V4/V5 ヘッダでは情報ヘッダの中) にある
+void readbmpformat(FILE *fp, const bmpfileheader_t *fh, const bmpinfoheader_t *ih, bmpformat_t *bf) {
+    static const uint32_t mask16[3] = {0x7c00, 0x03e0, 0x001f};
+    static const uint32_t mask32[3] = {0xff0000, 0x00ff00, 0x0000ff};
+    uint8_t b[4];
+    uint32_t i, k, npal, max;
+
+    memset(bf, 0, sizeof(bmpformat_t));
+    bf->width = ih->width;
+    bf->topdown = ih->height < 0;
+    bf->height = bf->topdown ? -(int64_t)ih->height : ih->height;
+    bf->bitcount = ih->bitcount;
+    bf->compression = ih->compression;
+    bf->offbits = fh->offbits;
+    bf->stride = (((size_t)bf->width * bf->bitcount + 31) / 32) * 4;
+    bf->pos = 14 + 40;
+
+    // ビットフィールド (指定が無ければ 16bit は 5:5:5、32bit は 8:8:8)
+    if (bf->bitcount == 16 || bf->bitcount == 32) {
+        for (k = 0; k < 3; k++)
+            bf->mask[k] = (bf->bitcount == 16) ? mask16[k] : mask32[k];
+        if (bf->compression == BI_BITFIELDS) {
+            for (k = 0; k < 3; k++) {
+                freadwitherror(b, 4, fp);
+                bf->mask[k] = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+            }
+            bf->pos += 12;
+        }
+        for (k = 0; k < 3; k++) {
+            maskbits(bf->mask[k], &bf->shift[k], &bf->bits[k]);
+            // 8bit 以下なら 0~255 に引き伸ばす表を作る (8bit を超える分は下位を捨てる)
+            max = (1u << MIN(bf->bits[k], 8)) - 1;
+            for (i = 0; i <= max && max > 0; i++)
+                bf->level[k][i] = (i * 255 + max / 2) / max;
+        }
+        bf->plain = bf->bitcount == 32 && bf->mask[0] == mask32[0] && bf->mask[1] == mask32[1] && bf->mask[2] == mask32[2];
+    }
+
+    // パレット (情報ヘッダの後ろ、1色 B G R X の 4byte)
+    if (bf->bitcount <= 8) {
+        for (; bf->pos < 14 + (uint64_t)ih->size; bf->pos++)
+            freadwitherror(b, 1, fp);
+        npal = (ih->clrused != 0) ? MIN(ih->clrused, 1u << bf->bitcount) : 1u << bf->bitcount;
+        for (i = 0; i < npal && bf->pos + 4 <= bf->offbits; i++, bf->pos += 4) {
+            freadwitherror(b, 4, fp);
+            bf->pal[i].blue = b[0];
+            bf->pal[i].green = b[1];
+            bf->pal[i].red = b[2];
+        }
+        debug("[PALETTE: OK] colors=%u\n", i);
+    }
+    if (bf->pos > bf->offbits)
+        fail(CIMAGE_EFORMAT, "invalid bitmap offset");
+}
+
+// fp を画像データの先頭まで読み進める (パイプでも使えるように読み捨てる)
+void skiptobits(FILE *fp, const bmpformat_t *bf) {
+    uint64_t pos;
+
+    for (pos = bf->pos; pos < bf->offbits; pos++) {
+        if (fgetc(fp) == EOF)
+            fail(CIMAGE_EREAD, "file read");
+    }
+}
+
+// 1bit・4bit のパレット番号を 1byte ずつに広げる
+static void unpack1(const uint8_t *raw, uint8_t *idx, uint32_t width) {
+    uint32_t x;
+
+    for (x = 0; x < width; x++)
+        idx[x] = (raw[x >> 3] >> (7 - (x & 7))) & 1;
+}
+
+static void unpack4(const uint8_t *raw, uint8_t *idx, uint32_t width) {
+    uint32_t x;
+
+    for (x = 0; x < width; x++)
+        idx[x] = (x & 1) ? raw[x >> 1] & 0x0f : raw[x >> 1] >> 4;
+}
+
+// マスクした値を 8bit 値にする
+static inline
+uint8_t fieldlevel(const bmpformat_t *bf, uint32_t v, int k) {
+    v = (v & bf->mask[k]) >> bf->shift[k];
+    return (bf->bits[k] > 8) ? v >> (bf->bits[k] - 8) : bf->level[k][v];
+}
+
+// 16bit (ビットフィールド) を B G R に展開する
+static void expand16(const bmpformat_t *bf, const uint8_t *raw, uint8_t *bgr, uint32_t n) {
+    uint32_t x, v;
+
+    for (x = 0; x < n; x++, raw += 2, bgr += 3) {
+        v = raw[0] | (raw[1] << 8);
+        bgr[0] = fieldlevel(bf, v, 2);
+        bgr[1] = fieldlevel(bf, v, 1);
+        bgr[2] = fieldlevel(bf, v, 0);
+    }
+}
+
+// 32bit (ビットフィールド) を B G R に展開する
+static void expand32(const bmpformat_t *bf, const uint8_t *raw, uint8_t *bgr, uint32_t n) {
+    uint32_t x, v;
+
+    for (x = 0; x < n; x++, raw += 4, bgr += 3) {
+        v = raw[0] | (raw[1] << 8) | (raw[2] << 16) | ((uint32_t)raw[3] << 24);
+        bgr[0] = fieldlevel(bf, v, 2);
+        bgr[1] = fieldlevel(bf, v, 1);
+        bgr[2] = fieldlevel(bf, v, 0);
+    }
+}
+
+// 32bit (B G R X の並び) から X を除く
+static void expand32plain(const bmpformat_t *bf, const uint8_t *raw, uint8_t *bgr, uint32_t n) {
+    uint32_t x;
+
+    for (x = 0; x < n; x++, raw += 4, bgr += 3) {
+        bgr[0] = raw[0];
+        bgr[1] = raw[1];
+        bgr[2] = raw[2];
+    }
+}
+
+// ファイル上の行の x0 画素目から n 画素を B G R に展開する (タイルの読み込み用)
+// raw は行の先頭から x0 * bitcount / 8 byte 目 (1bit・4bit は x0 画素目を含むバイト) を指す
+void expandbmppixels(const bmpformat_t *bf, const uint8_t *raw, uint32_t x0, uint32_t n, uint8_t *bgr) {
+    const pixel_t *c;
+    uint32_t x, b;
+
+    switch (bf->bitcount) {
+    case 1:
+    case 4:
+    case 8:
+        for (x = 0; x < n; x++, bgr += 3) {
+            if (bf->bitcount == 1) {
+                b = (x0 & 7) + x;
+                c = &bf->pal[(raw[b >> 3] >> (7 - (b & 7))) & 1];
+            } else if (bf->bitcount == 4) {
+                b = (x0 & 1) + x;
+                c = &bf->pal[(b & 1) ? raw[b >> 1] & 0x0f : raw[b >> 1] >> 4];
+            } else {
+                c = &bf->pal[raw[x]];
+            }
+            bgr[0] = c->blue;
+            bgr[1] = c->green;
+            bgr[2] = c->red;
+        }
+        break;
+    case 16:
+        expand16(bf, raw, bgr, n);
+        break;
+    case 32:
+        if (bf->plain)
+            expand32plain(bf, raw, bgr, n);
+        else
+            expand32(bf, raw, bgr, n);
+        break;
+    default:
+        memcpy(bgr, raw, (size_t)n * 3);
+        break;
+    }
+}
+
+// ファイル上の1行 raw を画素形式に合わせて rd に足し込む
+// パレット画像はパレット番号のまま渡す
+void reducebmprow(reducer_t *rd, const bmpformat_t *bf, uint32_t y, const uint8_t *raw, uint8_t *tmp) {
+    switch (bf->bitcount) {
+    case 1:
+        unpack1(raw, tmp, bf->width);
+        reduceindexrow(rd, y, tmp, bf->pal, 2);
+        break;
+    case 4:
+        unpack4(raw, tmp, bf->width);
+        reduceindexrow(rd, y, tmp, bf->pal, 16);
+        break;
+    case 8:
+        reduceindexrow(rd, y, raw, bf->pal, 256);
+        break;
+    case 16:
+        expand16(bf, raw, tmp, bf->width);
+        reducerow(rd, y, tmp);
+        break;
+    case 32:
+        if (bf->plain)
+            expand32plain(bf, raw, tmp, bf->width);
+        else
+            expand32(bf, raw, tmp, bf->width);
+        reducerow(rd, y, tmp);
+        break;
+    default:
+        reducerow(rd, y, raw);
+        break;
+    }
+}
+
+// RLE で展開中の行を渡して1行上に進む (画像の高さを超えた行は捨てる)
+static void rlenextline(reducer_t *rd, const bmpformat_t *bf, uint8_t *idx, uint32_t npal, uint32_t *line, uint32_t *emitted, outbuf_t *ob, int fd) {
+    if (*line < bf->height) {
+        reduceindexrow(rd, bf->height - 1 - *line, idx, bf->pal, npal);
+        flushready(rd, emitted, ob, fd);
+    }
+    (*line)++;
+    memset(idx, 0, bf->width);
+}
+
+// RLE8/RLE4 を1行ずつ展開して rd に足し込む
+// RLE はボトムアップなので下の行から順に渡す。飛ばされた画素と、途中で終わったときの残りの行はパレット 0 番にする
+// ob が NULL でなければ完成した行から出力する
+void streamrle(FILE *fp, const bmpformat_t *bf, reducer_t *rd, outbuf_t *ob, int fd) {
+    uint8_t *idx;
+    uint32_t x = 0, line = 0, emitted = 0, npal = (bf->compression == BI_RLE8) ? 256 : 16;
+    int n, v, i, c = 0, done = 0;
+
+    idx = (uint8_t *)xcalloc(bf->width, 1);
+    skiptobits(fp, bf);
+
+    while (!done && line < bf->height) {
+        if ((n = getc(fp)) < 0 || (v = getc(fp)) < 0)
+            break;
+        if (n > 0) {
+            // 連続: 同じ値 (RLE4 は2つの値を交互) を n 画素
+            for (i = 0; i < n; i++, x++) {
+                if (x < bf->width)
+                    idx[x] = (bf->compression == BI_RLE8) ? v : (i & 1) ? v & 0x0f : v >> 4;
+            }
+            continue;
+        }
+        switch (v) {
+        case 0: // 行の終わり
+            rlenextline(rd, bf, idx, npal, &line, &emitted, ob, fd);
+            x = 0;
+            break;
+        case 1: // 画像の終わり
+            done = 1;
+            break;
+        case 2: // 右に dx、上に dy 移動
+            if ((n = getc(fp)) < 0 || (v = getc(fp)) < 0) {
+                done = 1;
+                break;
+            }
+            x += n;
+            while (v-- > 0)
+                rlenextline(rd, bf, idx, npal, &line, &emitted, ob, fd);
+            break;
+        default: // 絶対: 続く v 画素をそのまま (2byte 境界に合わせる)
+            for (i = 0; i < v; i++, x++) {
+                if (bf->compression == BI_RLE8 || !(i & 1)) {
+                    if ((c = getc(fp)) < 0)
+                        break;
+                }
+                if (x < bf->width)
+                    idx[x] = (bf->compression == BI_RLE8) ? c : (i & 1) ? c & 0x0f : c >> 4;
+            }
+            n = (bf->compression == BI_RLE8) ? v : (v + 1) / 2;
+            if (n & 1)
+                getc(fp);
+            break;
+        }
+    }
+    // 残りの行 (書きかけの行と、画像の終わりの後は 0 番)
+    while (line < bf->height)
+        rlenextline(rd, bf, idx, npal, &line, &emitted, ob, fd);
+    debug("[RLE: OK]\n");
+
+    xfree(idx);
+}
@@ -0,0 +1,272 @@
+/**
+ * cache.c
+ * 描画結果のキャッシュ
+ * 元画像のパス・サイズ・更新時刻と描画パラメータ (横幅・色数・しきい値) をキーに
+ * 出力したエスケープシーケンスをそのままファイルに保存しておき、
+ * 同じ画像を同じ設定で表示するときは読み込み・縮小・色変換を飛ばして sendfile で送る。
+ * 書き込みは一時ファイルに書いてから rename するので、同時に動く他のプロセスからは
+ * 書きかけのエントリは見えない。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "cbmpviewer.h"
+
+// キャッシュの形式の版 (出力の形式が変わったら上げて古いエントリを使わないようにする)
+#define CACHE_VERSION 1
+// 一時ファイルがこれより古ければ書きかけのまま残ったものとして消す (秒)
+#define CACHE_STALE 3600
+
+// エビクション用のエントリ
+typedef struct TAG_CACHEENT {
+    char name[32];
+    off_t size;
+    time_t mtime;
+    long mtimens;
+} cacheent_t;
+
+// FNV-1a (64bit) でキー文字列からファイル名を作る
+static uint64_t fnv1a(const char *s, size_t n) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// ディレクトリを親から順に作る (既にあれば何もしない)
+static int mkdirs(char *path) {
+    char *p;
+
+    for (p = path + 1; *p != '\0'; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+            *p = '/';
+            return 0;
+        }
+        *p = '/';
+    }
+    return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+// キャッシュの初期化
+// source は元画像のパス (キーにはその実パス・サイズ・更新時刻を使う)
+// キャッシュディレクトリが作れない・元画像が stat できないなどで使えなければ 0 を返す
+int initcache(cache_t *cc, const char *source, uint32_t cols, uint8_t threshold_r, uint8_t threshold_g, uint8_t threshold_b) {
+    char real[PATH_MAX];
+    struct stat st;
+    uint32_t cellw, cellh;
+    char *p;
+    int n;
+
+    cc->dir[0] = '\0';
+    if ((p = getenv("XDG_CACHE_HOME")) != NULL && *p == '/')
+        n = snprintf(cc->dir, sizeof(cc->dir), "%s/cimage-viewer", p);
+    else if ((p = getenv("HOME")) != NULL && *p != '\0')
+        n = snprintf(cc->dir, sizeof(cc->dir), "%s/.cache/cimage-viewer", p);
+    else
+        return 0;
+    if (n < 0 || (size_t)n >= sizeof(cc->dir) || !mkdirs(cc->dir))
+        return 0;
+
+    // キー: 版・元画像・描画パラメータ
+    if (realpath(source, real) == NULL || stat(real, &st) != 0 || !S_ISREG(st.st_mode))
+        return 0;
+    // 画像で出力するときは横幅の画素数が1文字の画素数で変わる
+    cellw = cellh = 0;
+    if (graphics != CIMAGE_TEXT)
+        getcellsize(&cellw, &cellh);
+    n = snprintf(cc->key, sizeof(cc->key), "cimage-viewer %d\n%s\n%lld %lld.%09ld\n%u %d %d %d %u %u %u %d %u %u\n",
+                 CACHE_VERSION, real, (long long)st.st_size, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+                 cols, color256, fullcolor, halfblock, threshold_r, threshold_g, threshold_b, graphics, cellw, cellh);
+    if (n < 0 || (size_t)n >= sizeof(cc->key))
+        return 0;
+    cc->keylen = n;
+    snprintf(cc->path, sizeof(cc->path), "%s/%016llx", cc->dir, (unsigned long long)fnv1a(cc->key, cc->keylen));
+    cc->tmp[0] = '\0';
+    debug("[CACHE: OK] %s\n", cc->path);
+    return 1;
+}
+
+// fd の off バイト目から最後までを out に送る
+// sendfile が使えない出力先なら read / write で送る
+static void sendall(int out, int fd, off_t off, off_t end) {
+    char buf[1 << 16];
+    ssize_t n, w, pos;
+
+    while (off < end) {
+        n = sendfile(out, fd, &off, end - off);
+        if (n > 0)
+            continue;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+            break;
+        if (n < 0 && errno == EPIPE)
+            exit(EXIT_SUCCESS);
+        if (n == 0)
+            return;
+        printf("Error: write\n");
+        exit(EXIT_FAILURE);
+    }
+    while (off < end) {
+        if ((n = pread(fd, buf, MIN((off_t)sizeof(buf), end - off), off)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return;
+        }
+        for (pos = 0; pos < n; pos += w) {
+            if ((w = write(out, buf + pos, n - pos)) < 0) {
+                if (errno == EINTR) {
+                    w = 0;
+                    continue;
+                }
+                if (errno == EPIPE)
+                    exit(EXIT_SUCCESS);
+                printf("Error: write\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        off += n;
+    }
+}
+
+// キャッシュにあれば out に送って 1 を返す
+// エントリの先頭にはキー文字列と '\0' があり、一致しなければ (ハッシュの衝突) 無いものとする
+int cachesend(cache_t *cc, int out) {
+    char head[sizeof(cc->key) + 1];
+    struct stat st;
+    int fd;
+
+    if ((fd = open(cc->path, O_RDONLY)) < 0)
+        return 0;
+    if (fstat(fd, &st) != 0 || st.st_size <= (off_t)cc->keylen
+        || pread(fd, head, cc->keylen + 1, 0) != (ssize_t)cc->keylen + 1
+        || memcmp(head, cc->key, cc->keylen) != 0 || head[cc->keylen] != '\0') {
+        close(fd);
+        return 0;
+    }
+    // 最近使ったものとして更新時刻を進める (エビクションは更新時刻の古い順)
+    futimens(fd, NULL);
+    sendall(out, fd, cc->keylen + 1, st.st_size);
+    stats.bytes += st.st_size - cc->keylen - 1;
+    close(fd);
+    debug("[CACHE: HIT]\n");
+    return 1;
+}
+
+// 新しいエントリの一時ファイルを作ってキーを書き込み、fd を返す
+// 作れなければ -1 を返す (キャッシュせずに表示だけする)
+int cachecreate(cache_t *cc) {
+    int fd;
+
+    snprintf(cc->tmp, sizeof(cc->tmp), "%s.tmp.%ld", cc->path, (long)getpid());
+    if ((fd = open(cc->tmp, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+        cc->tmp[0] = '\0';
+        return -1;
+    }
+    if (write(fd, cc->key, cc->keylen + 1) != (ssize_t)cc->keylen + 1) {
+        close(fd);
+        unlink(cc->tmp);
+        cc->tmp[0] = '\0';
+        return -1;
+    }
+    return fd;
+}
+
+// エントリの更新時刻の古い順
+static int cmpent(const void *a, const void *b) {
+    const cacheent_t *x = (const cacheent_t *)a, *y = (const cacheent_t *)b;
+
+    if (x->mtime != y->mtime)
+        return x->mtime < y->mtime ? -1 : 1;
+    if (x->mtimens != y->mtimens)
+        return x->mtimens < y->mtimens ? -1 : 1;
+    return 0;
+}
+
+// 合計サイズが上限を超えていたら更新時刻の古いエントリから消す
+// 消したエントリを他のプロセスが送っている途中でも、開いている fd からは最後まで読める
+static void evictcache(cache_t *cc, uint64_t limit) {
+    DIR *dir;
+    struct dirent *de;
+    struct stat st;
+    char path[PATH_MAX + 64];
+    cacheent_t *ent = NULL, *p;
+    size_t n = 0, cap = 0, i;
+    uint64_t total = 0;
+    time_t now = time(NULL);
+
+    if ((dir = opendir(cc->dir)) == NULL)
+        return;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(ent->name))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", cc->dir, de->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        // 書きかけのまま残った一時ファイル
+        if (strstr(de->d_name, ".tmp.") != NULL) {
+            if (now - st.st_mtime > CACHE_STALE)
+                unlink(path);
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            if ((p = (cacheent_t *)realloc(ent, sizeof(cacheent_t) * cap)) == NULL)
+                break;
+            ent = p;
+        }
+        strcpy(ent[n].name, de->d_name);
+        ent[n].size = st.st_size;
+        ent[n].mtime = st.st_mtim.tv_sec;
+        ent[n].mtimens = st.st_mtim.tv_nsec;
+        total += st.st_size;
+        n++;
+    }
+    closedir(dir);
+
+    if (total > limit) {
+        qsort(ent, n, sizeof(cacheent_t), cmpent);
+        for (i = 0; i < n && total > limit; i++) {
+            snprintf(path, sizeof(path), "%s/%s", cc->dir, ent[i].name);
+            if (unlink(path) == 0)
+                total -= ent[i].size;
+        }
+        debug("[CACHE: EVICT] %zu entries\n", i);
+    }
+    free(ent);
+}
+
+// 書き終えた一時ファイルを rename でエントリにする
+// rename は同じディレクトリ内なので不可分で、読む側には古いか新しいエントリのどちらかしか見えない
+void cachecommit(cache_t *cc, int fd, uint64_t limit) {
+    close(fd);
+    if (rename(cc->tmp, cc->path) != 0)
+        unlink(cc->tmp);
+    cc->tmp[0] = '\0';
+    evictcache(cc, limit);
+}
+
+// 書きかけの一時ファイルを閉じて消す
+void cacheabort(cache_t *cc, int fd) {
+    close(fd);
+    if (cc->tmp[0] != '\0')
+        unlink(cc->tmp);
+    cc->tmp[0] = '\0';
+}
@@ -1,6 +1,8 @@
 /**
  * CBmpViewer
  * コンソール上でBMP画像を表示するプログラム
+ * 読み込み・縮小・色変換は libcimage (cimage.h) で行い、ここではオプションの解析と
+ * キャッシュ・動画再生・一覧表示を扱う
  */
 
 #include <stdio.h>
@@ -8,35 +10,199 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/ioctl.h>
-#include <math.h>
 #include "cbmpviewer.h"
 
-#define MAX(a,b) (((a) > (b)) ? (a) : (b))
-#define MIN(a,b) (((a) < (b)) ? (a) : (b))
-
-#if DEBUG
-#define debug(...) printf(__VA_ARGS__)
-#else /* DEBUG */
-#define debug(...)
-#endif /* DEBUG */
-
 int color256 = 0;
 int fullcolor = 0;
+uint32_t nthreads = 0; // 描画スレッド数 (0 ならオンラインのコア数)
+int halfblock = 0;     // 半ブロック(▀)で1文字に縦2ピクセルを描く
+uint64_t memlimit = (uint64_t)512 << 20; // 積分画像に使うメモリの上限 (これを超える画像は1行ずつ読む)
+int graphics = CIMAGE_TEXT; // 出力形式 (sixel・kitty なら画素単位の画像で出力する)
+stats_t stats = {0};        // 計測 (--stats)
+int usecache = 0;           // 描画結果をキャッシュする
+int cacheonly = 0;          // キャッシュに無ければ画像を読まずに失敗で終わる
+char *cacheas = NULL;       // キャッシュのキーに使う元画像 (NULL なら入力ファイル)
+uint64_t cachelimit = (uint64_t)64 << 20; // キャッシュの合計サイズの上限
+
+// オプション
+static const struct option longopts[] = {
+    {"threads", required_argument, NULL, 't'},
+    {"stream",  required_argument, NULL, 's'},
+    {"pix-fmt", required_argument, NULL, 'p'},
+    {"fps",     required_argument, NULL, 'f'},
+    {"delta",   optional_argument, NULL, 'd'},
+    {"keyframe", required_argument, NULL, 'k'},
+    {"adaptive", no_argument,      NULL, 'a'},
+    {"half",    no_argument,       NULL, 'H'},
+    {"mem-limit", required_argument, NULL, 'm'},
+    {"cache",   no_argument,       NULL, 'c'},
+    {"cache-as", required_argument, NULL, 'C'},
+    {"cache-only", no_argument,    NULL, 'O'},
+    {"cache-size", required_argument, NULL, 'S'},
+    {"grid",    optional_argument, NULL, 'g'},
+    {"stats",   no_argument,       NULL, 'T'},
+    {"serve",   required_argument, NULL, 'D'},
+    {"client",  required_argument, NULL, 'R'},
+    {"interactive", no_argument,   NULL, 'i'},
+    {"crop",    required_argument, NULL, 'x'},
+    {"graphics", required_argument, NULL, 'G'},
+    {"help",    no_argument,       NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
 
 // メイン関数
 int main(int argc, char *argv[]) {
+    int c, nargs, stream = 0, grid = 0, interactive = 0;
+    char *serve = NULL, *client = NULL;
+    streamopt_t sopt = {0, 0, 0, 0, 0, 0, 0, 0};
+    croprect_t crop, *cropp = NULL;
+
+    // オプション解析
+    while ((c = getopt_long(argc, argv, "t:s:p:f:d::k:aHm:cC:OS:g::TD:R:ix:G:h", longopts, NULL)) != -1) {
+        switch (c) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 's':
+            stream = 1;
+            parsestreamsize(optarg, &sopt);
+            break;
+        case 'p':
+            if (strcmp(optarg, "rgb24") == 0) {
+                sopt.bgr = 0;
+            } else if (strcmp(optarg, "bgr24") == 0) {
+                sopt.bgr = 1;
+            } else {
+                printf("Error: unsupported pix-fmt `%s` (rgb24 or bgr24)\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'f':
+            sopt.fps = atof(optarg);
+            break;
+        case 'd':
+            sopt.delta = 1;
+            if (optarg != NULL)
+                sopt.tolerance = atoi(optarg);
+            break;
+        case 'k':
+            sopt.keyframe = atoi(optarg);
+            break;
+        case 'a':
+            sopt.adaptive = 1;
+            break;
+        case 'H':
+            halfblock = 1;
+            break;
+        case 'm':
+            memlimit = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'c':
+            usecache = 1;
+            break;
+        case 'C':
+            usecache = 1;
+            cacheas = optarg;
+            break;
+        case 'O':
+            usecache = 1;
+            cacheonly = 1;
+            break;
+        case 'S':
+            cachelimit = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'T':
+            stats.enabled = 1;
+            break;
+        case 'D':
+            serve = optarg;
+            break;
+        case 'R':
+            client = optarg;
+            break;
+        case 'i':
+            interactive = 1;
+            break;
+        case 'x':
+            parsecrop(optarg, &crop);
+            cropp = &crop;
+            break;
+        case 'G':
+            if (strcmp(optarg, "text") == 0) {
+                graphics = CIMAGE_TEXT;
+            } else if (strcmp(optarg, "sixel") == 0) {
+                graphics = CIMAGE_SIXEL;
+            } else if (strcmp(optarg, "kitty") == 0) {
+                graphics = CIMAGE_KITTY;
+            } else if (strcmp(optarg, "kitty-file") == 0) {
+                graphics = CIMAGE_KITTYFILE;
+            } else if (strcmp(optarg, "kitty-shm") == 0) {
+                graphics = CIMAGE_KITTYSHM;
+            } else {
+                printf("Error: unsupported graphics `%s` (text, sixel, kitty, kitty-file or kitty-shm)\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'g':
+            grid = 16;
+            if (optarg != NULL)
+                grid = MAX(atoi(optarg), 1);
+            break;
+        default:
+            usage();
+            return EXIT_SUCCESS;
+        }
+    }
+    if (nthreads == 0)
+        nthreads = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+
     // 引数チェック
-    if (argc < 2 || 5 < argc) {
+    nargs = argc - optind;
+    argv += optind;
+    if (serve != NULL && nargs == 0) {
+        // 描画デーモンのプロシージャへ
+        serveproc(serve);
+    } else if (grid && nargs > 0) {
+        // 一覧表示プロシージャへ (引数はすべて画像ファイル)
+        gridproc(argv, nargs, grid, 128, 128, 128);
+    } else if (nargs != 1 && nargs != 4) {
         usage();
         return EXIT_SUCCESS;
-    } else if (argc == 2) {
+    } else if (stream) {
+        // ストリーム再生プロシージャへ
+        if (nargs == 1)
+            streamproc(argv[0], &sopt, 128, 128, 128);
+        else
+            streamproc(argv[0], &sopt, (uint8_t)atoi(argv[1]), (uint8_t)atoi(argv[2]), (uint8_t)atoi(argv[3]));
+    } else if (interactive) {
+        // 対話モードのプロシージャへ
+        if (nargs == 1)
+            interactproc(argv[0], cropp, 128, 128, 128);
+        else
+            interactproc(argv[0], cropp, (uint8_t)atoi(argv[1]), (uint8_t)atoi(argv[2]), (uint8_t)atoi(argv[3]));
+    } else if (cropp != NULL) {
+        // 範囲表示のプロシージャへ (範囲にかかるタイルだけを読む)
+        if (nargs == 1)
+            cropproc(argv[0], cropp, 128, 128, 128);
+        else
+            cropproc(argv[0], cropp, (uint8_t)atoi(argv[1]), (uint8_t)atoi(argv[2]), (uint8_t)atoi(argv[3]));
+    } else if (client != NULL) {
+        // クライアントのプロシージャへ (描画はデーモンに頼む)
+        if (nargs == 1)
+            clientproc(client, argv[0], 128, 128, 128);
+        else
+            clientproc(client, argv[0], (uint8_t)atoi(argv[1]), (uint8_t)atoi(argv[2]), (uint8_t)atoi(argv[3]));
+    } else if (nargs == 1) {
         // Viewプロシージャへ
         // しきい値はデフォルト値
-        viewproc(argv[1], 128, 128, 128);
+        viewproc(argv[0], 128, 128, 128);
     } else {
         // しきい値のチェックしてないけど8bitに収まってればとりあえずおかしくはならないからこのままいく
-        viewproc(argv[1], (uint8_t)atoi(argv[2]), (uint8_t)atoi(argv[3]), (uint8_t)atoi(argv[4]));
+        viewproc(argv[0], (uint8_t)atoi(argv[1]), (uint8_t)atoi(argv[2]), (uint8_t)atoi(argv[3]));
     }
 
     // 画面クリア
@@ -48,18 +214,146 @@ int main(int argc, char *argv[]) {
 // Usage
 void usage(void) {
     printf("** CBmpViewer **\n");
-    printf("Usage: `cbmpviewer <input.bmp> [threshold_r=128 threshold_g=128 threshold_b=128]`\n");
+    printf("Usage: `cbmpviewer [options] <input.bmp> [threshold_r=128 threshold_g=128 threshold_b=128]`\n");
+    printf("       `cbmpviewer --grid[=N] [options] <input>...`\n");
+    printf("       `cbmpviewer --serve SOCK [options]`\n");
+    printf("       `cbmpviewer --client SOCK [options] <input.bmp> [threshold_r threshold_g threshold_b]`\n");
+    printf("       input.bmp に - を指定すると標準入力から読み込む\n");
+    printf("Options:\n");
+    printf("  -t, --threads N    描画スレッド数 (デフォルトはオンラインのコア数)\n");
+    printf("  -H, --half         半ブロック(▀)の前景と背景で1文字に縦2ピクセルを描く\n");
+    printf("  -m, --mem-limit MB 積分画像に使うメモリの上限 (デフォルト 512)\n");
+    printf("                     超える画像は1行ずつ読んで縮小する (0 なら常に1行ずつ)\n");
+    printf("  -c, --cache        描画結果を $XDG_CACHE_HOME/cimage-viewer にキャッシュする\n");
+    printf("  -C, --cache-as SRC キャッシュのキーに入力の代わりに元画像 SRC を使う (--cache を含む)\n");
+    printf("  -O, --cache-only   キャッシュに無ければ入力を読まずに失敗で終わる (--cache を含む)\n");
+    printf("  -S, --cache-size MB キャッシュの合計サイズの上限 (デフォルト 64)\n");
+    printf("  -g, --grid[=N]     複数の画像を横 N 文字 (デフォルト 16) のタイルにして一覧表示する\n");
+    printf("  -T, --stats        段階ごとの時間と出力の量を画像 (動画はフレーム) ごとに1行の JSON で標準エラー出力に書く\n");
+    printf("  -i, --interactive  端末の大きさの変化 (SIGWINCH) とキー (+ - 0 矢印 hjkl q) に合わせて拡大・縮小・移動して描き直す\n");
+    printf("                     (画像は最初に1回だけ復号し、縮小した画像ピラミッドから描き直す。\n");
+    printf("                     --mem-limit を超える無圧縮の BMP は表示する範囲のタイルだけを読む)\n");
+    printf("  -x, --crop WxH+X+Y 無圧縮の BMP の範囲 WxH+X+Y だけを読んで表示する (--interactive なら最初に表示する範囲)\n");
+    printf("  -G, --graphics MODE 文字の代わりに画像で出力する (横幅は文字数 x 1文字の画素数、--stream にも使える)\n");
+    printf("                     sixel: 色モードのパレットの sixel、kitty: kitty graphics protocol (base64 で直接送る)\n");
+    printf("                     kitty-file / kitty-shm: 画素は一時ファイル / 共有メモリで渡す (端末と同じマシンのみ)\n");
+    printf("  -D, --serve SOCK   Unix ドメインソケット SOCK で描画の要求を待つデーモンになる\n");
+    printf("                     (--threads 個のワーカーで描画、SIGINT・SIGTERM で終わる)\n");
+    printf("  -R, --client SOCK  描画を --serve のデーモンに頼み、結果を表示する\n");
+    printf("  -s, --stream WxH   入力を WxH の rawvideo フレームの連続として動画再生する\n");
+    printf("                     (bmp を指定すると連結した BMP を読む)\n");
+    printf("  -p, --pix-fmt FMT  rawvideo の画素形式 rgb24 (デフォルト) または bgr24\n");
+    printf("  -f, --fps N        再生フレームレート (遅れたフレームは捨てる。0 なら全フレーム描画)\n");
+    printf("  -d, --delta[=TOL]  動画で前のフレームから色が変わったセルだけを描き直す\n");
+    printf("                     (TOL: 変化なしとみなす色の差、デフォルト 0)\n");
+    printf("  -k, --keyframe N   --delta のとき N フレームごとに全体を描き直す (デフォルト 0: 最初だけ)\n");
+    printf("  -a, --adaptive     動画で出力の速さ (write で待たされた時間を含む) を測り、--fps (0 なら 30) を保てるように\n");
+    printf("                     横幅 (端末の横幅以下) と色モード (フルカラー → 256色 → 8色) を下げ、余裕があれば上げる\n");
+    printf("                     (判断は --stats の JSON の adapt・cols・color・rate_Bps に出る)\n");
 }
 
 // Viewプロシージャ
+// 読み込み・縮小・色変換は libcimage (cimage.c) で行い、ここではキャッシュと計測だけを扱う
 void viewproc(char *filename, uint8_t threshold_r, uint8_t threshold_g, uint8_t threshold_b) {
-    FILE *fp;
-    bmpfileheader_t fh;
-    bmpinfoheader_t ih;
-    pixel_t **pix;
+    cimage_t *ci;
+    cache_t cc;
+    int fd, err, caching = 0, tee = -1;
+    uint32_t cellw, cellh;
+
+    // 色数の決定
+    statsstart(&stats);
+    getcolormode();
+    statslap(&stats, STATS_SETUP);
+
+    // キャッシュにあれば読み込み・縮小・色変換をせずにそのまま送る
+    // キーは元画像 (--cache-as) か入力ファイルのパス・サイズ・更新時刻と描画パラメータ
+    // 一時ファイル・共有メモリで渡す kitty の出力は端末が読むと消えるのでキャッシュしない
+    if (usecache && graphics != CIMAGE_KITTYFILE && graphics != CIMAGE_KITTYSHM && (cacheas != NULL || strcmp(filename, "-") != 0)
+        && initcache(&cc, cacheas != NULL ? cacheas : filename, getconsolecols(), threshold_r, threshold_g, threshold_b)) {
+        stats.cache = cachesend(&cc, STDOUT_FILENO);
+        statslap(&stats, STATS_CACHE);
+        if (stats.cache) {
+            statsprint(&stats, filename, -1);
+            return;
+        }
+        caching = 1;
+    }
+    if (cacheonly) {
+        statsprint(&stats, filename, -1);
+        exit(EXIT_FAILURE);
+    }
+
+    // 描画の設定と近似色探索テーブルの構築
+    if ((ci = cimagecreate()) == NULL) {
+        printf("Error: memory allocate\n");
+        exit(EXIT_FAILURE);
+    }
+    if (cimagesetcolor(ci, !color256 ? CIMAGE_COLOR8 : fullcolor ? CIMAGE_TRUECOLOR : CIMAGE_COLOR256) != CIMAGE_OK) {
+        printf("Error: %s\n", cimageerror(ci));
+        exit(EXIT_FAILURE);
+    }
+    cimagesetthreshold(ci, threshold_r, threshold_g, threshold_b);
+    cimagesetsize(ci, getconsolecols(), 0);
+    cimagesethalf(ci, halfblock);
+    cimagesetthreads(ci, nthreads);
+    cimagesetmemlimit(ci, memlimit);
+    cimagesetgraphics(ci, graphics);
+    getcellsize(&cellw, &cellh);
+    cimagesetcellsize(ci, cellw, cellh);
+    cimagesetstats(ci, &stats);
+    statslap(&stats, STATS_SETUP);
+
+    // 画像ファイルオープン ("-" は標準入力)
+    if (strcmp(filename, "-") == 0) {
+        fd = STDIN_FILENO;
+    } else if ((fd = open(filename, O_RDONLY)) < 0) {
+        printf("Error: file open\n");
+        exit(EXIT_FAILURE);
+    }
+    debug("[FILEOPEN: OK]\n");
+    statslap(&stats, STATS_OPEN);
+
+    // キャッシュに無ければ表示しながら同じ内容を一時ファイルにも書き出し、最後にエントリにする
+    // 出力先が閉じられたときも一時ファイルを消せるよう、SIGPIPE で終わらずに EPIPE を受け取る
+    if (caching && (tee = cachecreate(&cc)) >= 0) {
+        cimagesettee(ci, tee);
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    // 描画 (完成した行から書き出す)
+    // デバッグ出力と順番が入れ替わらないよう stdio 側を先に出してから書き出す
+    fflush(stdout);
+    if ((err = cimagerenderfd(ci, fd, STDOUT_FILENO)) != CIMAGE_OK) {
+        // 書きかけの一時ファイルは残さない
+        if (tee >= 0)
+            cacheabort(&cc, tee);
+        // 出力先が閉じられた (パイプの先の head など) ときは黙って終わる
+        if (err == CIMAGE_EPIPE)
+            exit(EXIT_SUCCESS);
+        printf("Error: %s\n", cimageerror(ci));
+        exit(EXIT_FAILURE);
+    }
+    if (tee >= 0 && cimageteefailed(ci))
+        cacheabort(&cc, tee);
+    else if (tee >= 0)
+        cachecommit(&cc, tee, cachelimit);
+    statslap(&stats, STATS_OUTPUT);
+
+    // ファイルクローズ
+    if (fd != STDIN_FILENO)
+        close(fd);
+    debug("[FILECLOSE: OK]\n");
+
+    // メモリ解放
+    cimagedestroy(ci);
+    debug("[MEMORYFREE: OK]\n");
+    statsprint(&stats, filename, -1);
+}
+
+// 色数の決定
+// 環境変数 TERM と t_Co を見て color256 / fullcolor を設定する
+void getcolormode(void) {
     uint32_t i;
-    struct winsize win; // コンソールサイズ
-    consolebmp_t cbmp;
     char *p;
 
     //TERM=xterm の場合は 256色 (xterm-256color xterm-3gp xterm-r6 ...
@@ -73,48 +367,17 @@ void viewproc(char *filename, uint8_t threshold_r, uint8_t threshold_g, uint8_t
         else if(i == 256) color256 = 1;
         else if(i == 16777216) fullcolor =1;
     }
+}
 
-    // 画像ファイルオープン
-    if ((fp = fopen(filename, "rb")) == NULL) {
-        printf("Error: file open\n");
-        exit(EXIT_FAILURE);
-    }
-    debug("[FILEOPEN: OK]\n");
-
-    // 画像ヘッダ取得
-    getbmpheader(fp, &fh, &ih);
-    showbmpheader(&fh, &ih);
-    // 画像ヘッダの(このプログラムで対応する)フォーマットチェック
-    checkbmpheader(&fh, &ih);
-    debug("[FORMAT: OK]\n");
-
-    // ピクセル分の配列を動的に確保
-    if ((pix = (pixel_t **)malloc(sizeof(pixel_t *) * ih.height)) == NULL) {
-        printf("Error: memory allocate\n");
-        exit(EXIT_FAILURE);
-    }
-    for (i = 0; i < ih.height; i++) {
-        if ((pix[i] = (pixel_t *)malloc(sizeof(pixel_t *) * ih.width)) == NULL) {
-            printf("Error: memory allocate\n");
-            exit(EXIT_FAILURE);
-        }
-    }
-    debug("[MEMORYALLOC: OK]\n");
-
-    // 画像データをメモリに読み込む
-    readbmpdata(fp, pix, ih.width, ih.height);
-    debug("[READDATA: OK]\n");
-    //showbmpdata(pix, ih.width, ih.height);
-
-    // ファイルクローズ
-    fclose(fp);
-    debug("[FILECLOSE: OK]\n");
-
+// コンソールの横幅(文字数)を取得
+// COLUMNS が指定されていなければ、コンソールサイズを取得
+// パイプの場合はデフォルト80またはCOLUMNS
+uint32_t getconsolecols(void) {
+    struct winsize win; // コンソールサイズ
+    char *p;
 
-   // コンソールサイズ取得
-   // COLUMNS が指定されていなければ、コンソールサイズを取得
-   // パイプの場合はデフォルト80またはCOLUMNS
     win.ws_col = 80;
+    win.ws_row = 0;
     if ((p = getenv("COLUMNS")) != NULL && *p != '\0')
         win.ws_col = atoi(p);
     else {
@@ -127,201 +390,22 @@ void viewproc(char *filename, uint8_t threshold_r, uint8_t threshold_g, uint8_t
         }
     }
 
-    // コンソール文字とピクセル比率の決定
-    // ピクセル比率とはbmpでの何ピクセルがコンソールでの1文字になるか
-    // 符号無し整数値で最小値は1
-    // コンソールでの文字は縦横比が2:1になることも注意
-    // 参照: pixel_letter.example
-    cbmp.bpl_c = MAX(ih.width / win.ws_col, 1);
-    for(;;)
-    {
-        cbmp.bpl_r = cbmp.bpl_c * 2;
-        cbmp.letter = ih.width / cbmp.bpl_c;
-        cbmp.line = ih.height / cbmp.bpl_r;
-        debug("[BMP/LETTER: ..] bpl_c=%u,bpl_r=%u,letter=%u,line=%u\n", cbmp.bpl_c, cbmp.bpl_r, cbmp.letter, cbmp.line);
-        if(cbmp.letter > win.ws_col)
-        {
-            cbmp.bpl_c++;
-        } else break;
-    }
-    debug("[BMP/LETTER: OK] bpl_c=%u,bpl_r=%u,letter=%u,line=%u\n", cbmp.bpl_c, cbmp.bpl_r, cbmp.letter, cbmp.line);
-
-    // 色変換と出力
-    cbmp.threshold_r = threshold_r;
-    cbmp.threshold_g = threshold_g;
-    cbmp.threshold_b = threshold_b;
-    outputbmp(pix, &cbmp);
-
-    // メモリ解放
-    for (i = 0; i < ih.height; i++) {
-        free(pix[i]);
-    }
-    free(pix);
-    debug("[MEMORYFREE: OK]\n");
-}
-
-// 画像ヘッダ取得
-void getbmpheader(FILE *fp, bmpfileheader_t *fh, bmpinfoheader_t *ih) {
-    // 各値を取得
-    freadwitherror(&fh->type, 2, fp);
-    // タイプに関してはBM(リトルエンディアンで0x4d42)じゃなかったらそこで落とす
-    if (fh->type != 0x4d42) {
-        printf("Error: input file is not bitmap\n");
-        exit(EXIT_FAILURE);
-    }
-    freadwitherror(&fh->size, 4, fp);
-    freadwitherror(&fh->reserved1, 2, fp);
-    freadwitherror(&fh->reserved2, 2, fp);
-    freadwitherror(&fh->offbits, 4, fp);
-
-    freadwitherror(&ih->size, 4, fp);
-    freadwitherror(&ih->width, 4, fp);
-    freadwitherror(&ih->height, 4, fp);
-    freadwitherror(&ih->planes, 2, fp);
-    freadwitherror(&ih->bitcount, 2, fp);
-    freadwitherror(&ih->compression, 4, fp);
-    freadwitherror(&ih->sizeimage, 4, fp);
-    freadwitherror(&ih->xpixpermeter, 4, fp);
-    freadwitherror(&ih->ypixpermeter, 4, fp);
-    freadwitherror(&ih->clrused, 4, fp);
-    freadwitherror(&ih->clrimporant, 4, fp);
+    if (win.ws_col == 0)
+        win.ws_col = 80;
+    return win.ws_col;
 }
 
-// ファイルポインタから指定のバイト取得(エラー処理付き)
-void freadwitherror(void *buf, int byte, FILE *fp) {
-    if (fread(buf, byte, 1, fp) != 1) {
-        printf("Error: file read\n");
-        exit(EXIT_FAILURE);
+// 1文字の画素数を取得
+// 端末が画素数を返さない (パイプ・対応していない端末) ときは 10x20
+void getcellsize(uint32_t *width, uint32_t *height) {
+    struct winsize win;
+
+    *width = 10;
+    *height = 20;
+    if (isatty(STDOUT_FILENO) && ioctl(STDOUT_FILENO, TIOCGWINSZ, &win) == 0
+        && win.ws_col > 0 && win.ws_row > 0 && win.ws_xpixel >= win.ws_col && win.ws_ypixel >= win.ws_row) {
+        *width = win.ws_xpixel / win.ws_col;
+        *height = win.ws_ypixel / win.ws_row;
     }
+    debug("[CELLSIZE: OK] %ux%u\n", *width, *height);
 }
-
-// 画像ヘッダの(このプログラムで対応する)フォーマットチェック
-void checkbmpheader(bmpfileheader_t *fh, bmpinfoheader_t *ih) {
-    // 高さが負数だったらはじく
-    if (ih->height < 0) {
-        printf("Error: this program currently does not work for top-down bmp\n");
-        exit(EXIT_SUCCESS);
-    }
-    // ビットカウント24以外ははじく
-    if (ih->bitcount != 24) {
-        printf("Error: this program currently does not work for %u-bit bmp\n", ih->bitcount);
-        exit(EXIT_SUCCESS);
-    }
-    // 無圧縮以外は弾く
-    if (ih->compression != 0) {
-        printf("Error: this program currently does not work for compressed bmp\n");
-        exit(EXIT_SUCCESS);
-    }
-}
-
-// 画像ヘッダの表示
-void showbmpheader(bmpfileheader_t *fh, bmpinfoheader_t *ih) {
-    debug("--file header--\n");
-    debug("type: %c%c\n", (char)fh->type, (char)(fh->type >> 8));
-    debug("size: %u\n", fh->size);
-    debug("reserved1: %u\n", fh->reserved1);
-    debug("reserved1: %u\n", fh->reserved2);
-    debug("offbits: %u\n", fh->offbits);
-    debug("--info header--\n");
-    debug("size: %u\n", ih->size);
-    debug("width: %d\n", ih->width);
-    debug("height: %d\n", ih->height);
-    debug("planes: %u\n", ih->planes);
-    debug("bitcount: %u\n", ih->bitcount);
-    debug("compression: %u\n", ih->compression);
-    debug("sizeimage: %u\n", ih->sizeimage);
-    debug("xpixpermeter: %d\n", ih->xpixpermeter);
-    debug("ypixpermeter: %d\n", ih->ypixpermeter);
-    debug("clrused: %u\n", ih->clrused);
-    debug("clrimporant: %u\n", ih->clrimporant);
-}
-
-// 画像データをメモリに読み込む
-// データはボトムアップに入っていることに注意する
-void readbmpdata(FILE *fp, pixel_t **pix, int32_t w, int32_t h) {
-    int i, j;
-
-    for (i = h - 1; i >= 0; i--) {
-        for (j = 0; j < w; j++) {
-            // B G R の順
-            freadwitherror(&pix[i][j].blue, 1, fp);
-            freadwitherror(&pix[i][j].green, 1, fp);
-            freadwitherror(&pix[i][j].red, 1, fp);
-        }
-        // 1行は4byteできり(つまり4の倍数)を合わせなきゃいけない
-        // w:1 -> 3byte -> padding:1byte
-        // w:2 -> 6byte -> padding:2byte
-        // w:3 -> 9byte -> padding:3byte
-        // w:4 -> 12byte -> padding:0byte
-        // くりかえし
-        fseek(fp, w % 4, SEEK_CUR);
-    }
-}
-
-// 画像データの表示
-void showbmpdata(pixel_t **pix, int32_t w, int32_t h) {
-    int i, j;
-
-    for (i = 0; i < h; i++) {
-        for (j = 0; j < w; j++) {
-            printf("R=%x G=%x B%x\n", pix[i][j].red, pix[i][j].green, pix[i][j].blue);
-        }
-        printf("\n");
-    }
-}
-
-// 色変換と出力
-void outputbmp(pixel_t **pix, consolebmp_t *cbmp) {
-    // カラーコード rgb = 000:black 001:blue 010:green 011:cyan 100:red 101:magenta 110:yellow 111:white
-    char clrcode[8] = {'0', '4', '2', '6', '1', '5', '3', '7'};
-    uint32_t i, j, m, n;
-
-    // BUG: ここのforループはbmpのpixelがletterの倍数になっていることを前提としちゃってるから
-    //      そうじゃないときにメモリのおかしなところ参照しちゃってセグフォル
-    for (i = 0; i < cbmp->line; i++) {
-        for (j = 0; j < cbmp->letter; j++) {
-            uint32_t r, g, b, s;
-            uint8_t clr;
-
-            // 1文字で表される文のピクセルのRGB値の平均を求める
-            // まずはsum
-            r = g = b = 0;
-            for (m = 0; m < cbmp->bpl_r; m++) {
-                for (n = 0; n < cbmp->bpl_c; n++) {
-                    r += pix[i * cbmp->bpl_r + m][j * cbmp->bpl_c + n].red;
-                    g += pix[i * cbmp->bpl_r + m][j * cbmp->bpl_c + n].green;
-                    b += pix[i * cbmp->bpl_r + m][j * cbmp->bpl_c + n].blue;
-                }
-            }
-            // 平均
-            s = cbmp->bpl_r * cbmp->bpl_c;
-            r = r / s;
-            g = g / s;
-            b = b / s;
-            if(color256)
-            {
-                if(fullcolor) {
-                    // 拡張 2
-                    printf("\x1b[0;48;2;%2u:%2u:%2um ", r,g,b);
-                }
-                else {
-                    // 拡張 5;
-                    clr = near(r,g,b);
-                    printf("\x1b[0;48;5;%um ", clr);
-                }
-            }
-            else
-            {
-                // RGB各値を2bit化して、RGBを3bit(8通り)で表す
-                r = (r < cbmp->threshold_r) ? 0 : 1;
-                g = (g < cbmp->threshold_g) ? 0 : 1;
-                b = (b < cbmp->threshold_b) ? 0 : 1;
-                clr = (r << 2) + (g << 1) + b;
-                printf("\x1b[3%cm\x1b[4%cm%u", clrcode[clr], clrcode[clr], clr);
-            }
-        }
-        printf("\x1b[39m\x1b[49m"); // デフォルトに戻す
-        printf("\n");
-    }
-}
-
@@ -6,6 +6,24 @@
 #define __CBMPVIEWER_H__
 
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include "cimage.h"
+
+#define MAX(a,b) (((a) > (b)) ? (a) : (b))
+#define MIN(a,b) (((a) < (b)) ? (a) : (b))
+
+#if DEBUG
+#define debug(...) printf(__VA_ARGS__)
+// ライブラリの中で fd に書き出す前にデバッグ出力 (stdio) を先に出す
+// (通常のビルドではライブラリは stdout を触らず、呼び出し元が描画の前に出しておく)
+#define debugflush() fflush(stdout)
+#else /* DEBUG */
+#define debug(...)
+#define debugflush()
+#endif /* DEBUG */
 
 // 構造体定義
 // ファイルヘッダ
@@ -32,6 +50,12 @@ typedef struct TAG_BITMAPINFOHEADER {
     uint32_t clrimporant;  // 重要なパレットのインデックス
 } bmpinfoheader_t;
 
+// 圧縮形式
+#define BI_RGB       0 // 無圧縮
+#define BI_RLE8      1 // 8bit ランレングス
+#define BI_RLE4      2 // 4bit ランレングス
+#define BI_BITFIELDS 3 // ビットフィールド (16/32bit)
+
 // Pixel構造体
 typedef struct TAG_PIXEL {
     uint8_t red;
@@ -39,22 +63,375 @@ typedef struct TAG_PIXEL {
     uint8_t blue;
 } pixel_t;
 
+// 画像データ構造体
+// ピクセルはファイル上の並び(B G R、行は4byte境界)のまま参照する
+// 4GB を超えるファイルも扱えるようにサイズ・オフセットは size_t / 64bit で計算する
+typedef struct TAG_BMPIMAGE {
+    const uint8_t *top; // 画像の一番上の行の先頭
+    ptrdiff_t pitch;    // 1行下に進むときのバイト数 (ボトムアップなので負数)
+    int32_t width;      // 画像の幅
+    int32_t height;     // 画像の高さ
+    void *map;          // mmap した領域 (mmap できなかったときは NULL)
+    size_t maplen;      // mmap した領域のサイズ
+    uint8_t *buf;       // メモリ上のフレームのバッファ (動画再生用)
+} bmpimage_t;
+
+// 画素形式構造体 (bmpformat.c)
+// ヘッダの後ろのビットフィールドとパレットまで読んだ結果
+typedef struct TAG_BMPFORMAT {
+    uint32_t width;         // 画像の幅
+    uint32_t height;        // 画像の高さ (トップダウンでも正の値)
+    int topdown;            // 1 ならトップダウン (ヘッダの高さが負数)
+    uint16_t bitcount;      // 1pixelあたりのデータサイズ(bit)
+    uint32_t compression;   // 圧縮形式
+    uint32_t offbits;       // ファイル先頭から画像データまでのオフセット(byte)
+    size_t stride;          // 1行のバイト数 (4byte境界)
+    uint64_t pos;           // ヘッダ・パレットとして読み込み済みのバイト数
+    pixel_t pal[256];       // パレット (1/4/8bit、無い分は黒)
+    uint32_t mask[3];       // ビットフィールドの R G B のマスク (16/32bit)
+    uint8_t shift[3];       // マスクの最下位ビットの位置
+    uint8_t bits[3];        // マスクのビット数
+    uint8_t level[3][256];  // マスクした値から 8bit 値への変換表 (8bit 以下のとき)
+    int plain;              // 32bit で B G R X の並びならそのまま読める
+} bmpformat_t;
+
+// 積分画像構造体 (scale.c)
+typedef struct TAG_SAT {
+    uint32_t *s;     // (width + 1) x (height + 1) 個の RGB 累積和
+    uint32_t width;  // 画像の幅
+    uint32_t height; // 画像の高さ
+} sat_t;
+
 // ConsoleBMP構造体
 typedef struct TAG_CONSOLEBMP {
-    uint32_t bpl_c;  // コンソール文字に対するbmpのピクセル比率 col
-    uint32_t bpl_r;  // コンソール文字に対するbmpのピクセル比率 row
+    double bpl_c;    // コンソール文字に対するbmpのピクセル比率 col (整数とは限らない)
+    double bpl_r;    // コンソール文字に対するbmpのピクセル比率 row (半ブロックのときは半文字分)
     uint32_t letter; // コンソール出力の1行の文字数
     uint32_t line;   // コンソール出力の1行の行数
     uint8_t threshold_r; // しきい値
     uint8_t threshold_g;
     uint8_t threshold_b;
+    int half;        // 1 なら上半分ブロック(▀)の前景と背景で1文字に縦2ピクセルを描く
+    int color256;    // 1 なら 256色 (fullcolor も 1 ならフルカラー)、0 なら 8色
+    int fullcolor;
 } consolebmp_t;
 
+// 整数比の縮小カーネル (scale.c)
+// 画像 img から line0 行目から line1 - 1 行目までのセルの平均色を求める (downsample と同じ値になる)
+typedef void (*boxkernel_t)(const bmpimage_t *img, const consolebmp_t *cbmp, uint32_t line0, uint32_t line1, pixel_t *cell);
+
+// 出力バッファ構造体
+// 1フレーム分の出力をここにためて write 1回で書き出す (output.c)
+typedef struct TAG_OUTBUF {
+    char *buf;  // バッファ
+    size_t len; // 書き込み済みのバイト数
+    size_t cap; // 確保済みのバイト数
+    int keep;   // 1 なら書き出さずにためておく (メモリへの描画)
+    int tee;    // 0 以上なら書き出す内容を同じくこの fd にも書き出す (書き込めなくなったら -1 にする)
+    struct TAG_STATS *stats; // NULL でなければ書き出した量と write で待った時間を数える
+} outbuf_t;
+
+// 行ストリーム縮小構造体 (reduce.c)
+typedef struct TAG_REDUCER {
+    const consolebmp_t *cbmp;
+    uint32_t width;     // 元画像の幅
+    uint32_t height;    // 元画像の高さ
+    uint32_t rows;      // セルの行数 (半ブロックなら line の2倍)
+    uint32_t *cx;       // 元画像の列ごとの最初にかかるセル
+    double *wx;         // 元画像の列ごとの最初のセルにかかる割合
+    double *wn;         // 元画像の列ごとの次のセルにかかる割合 (右端の列は合わせて 1 未満のことがある)
+    double xend;        // セルが覆う元画像の右端・下端 (縮小して復号したときは端のピクセルの途中)
+    double yend;
+    double *hsum;       // 1行分のセルごとの横方向の総和
+    double *acc;        // セルごとの RGB の重み付き総和
+    uint32_t *pending;  // セル行ごとのまだ足し込んでいない元画像の行数
+    pixel_t *cell;      // 完成したセルの平均色
+    outbuf_t *ob;       // NULL でなければ acc・pending はセル行2つ分、cell はコンソール1行分の輪で、完成した行から ob に追加する
+    uint32_t ready;     // 上から続けて完成したコンソールの行数
+    const pixel_t *pal; // パレット画像のパレット
+    uint32_t npal;      // ヒストグラムの色数
+    double *hist;       // セル行2つ分のセルごとのパレット番号のヒストグラム (NULL なら使わない)
+    uint8_t *bgr;       // パレットを展開した1行 (ヒストグラムを使わないとき)
+} reducer_t;
+
+// 並列描画構造体 (render.c)
+typedef struct TAG_RENDERER {
+    uint32_t nthreads;    // ワーカースレッド数
+    pthread_t *th;        // ワーカースレッド (シングルスレッドのときは NULL)
+    pthread_mutex_t lock;
+    pthread_cond_t wake;  // 新しいフレームの通知
+    pthread_cond_t done;  // バンド完了の通知
+    const sat_t *sat;     // 描画中のフレーム
+    const bmpimage_t *img; // 描画中のフレーム (整数比のカーネルで縮小するとき)
+    boxkernel_t box;      // 整数比のカーネル (NULL なら積分画像から縮小する)
+    consolebmp_t *cbmp;
+    pixel_t *cell;
+    uint32_t bandlines;   // 1バンドあたりの行数
+    uint32_t nband;       // バンド数
+    uint32_t next;        // 次に処理するバンド
+    uint32_t gen;         // フレーム番号
+    int quit;             // 終了要求
+    outbuf_t *band;       // バンドごとの出力バッファ
+    uint8_t *bdone;       // バンドごとの完了フラグ
+    uint32_t nbandbuf;    // 確保済みのバンド数
+} renderer_t;
+
+// ストリーム再生のオプション (stream.c)
+typedef struct TAG_STREAMOPT {
+    uint32_t width;  // rawvideo のフレームの幅 (0 なら連結した BMP)
+    uint32_t height; // rawvideo のフレームの高さ
+    int bgr;         // rawvideo が bgr24 なら 1、rgb24 なら 0
+    double fps;      // 再生するフレームレート (0 なら待たずに全フレーム描画)
+    int delta;          // 1 なら変化したセルだけを描き直す
+    uint32_t tolerance; // 差分描画で変化なしとみなす色の差
+    uint32_t keyframe;  // 差分描画で全体を描き直す間隔 (フレーム数、0 なら最初だけ)
+    int adaptive;       // 1 なら出力の速さに合わせて横幅と色モードを変える
+} streamopt_t;
+
+// 出力の速さへの追従の状態 (adapt.c)
+// 色モードは 0: 8色 1: 256色 2: フルカラー
+typedef struct TAG_ADAPT {
+    uint32_t maxcols;     // 横幅の上限 (端末の横幅)
+    uint32_t mincols;     // 横幅の下限
+    int maxlevel;         // 色モードの上限 (端末の色数)
+    uint32_t cols;        // 今の横幅
+    int level;            // 今の色モード
+    double budget;        // 1フレームの出力に使える時間 (秒)
+    double rate;          // 出力の速さ (バイト/秒、指数移動平均)
+    double bpc[3];        // 色モードごとの1文字あたりの出力バイト数 (指数移動平均、0 なら未測定)
+    double load;          // 出力にかかった時間 / budget (指数移動平均)
+    uint32_t calm;        // 余裕のあるフレームが続いている数
+    uint32_t hold;        // 設定を変えてから様子を見る残りのフレーム数
+    uint32_t backoff;     // 上限以上に上げるまでに余裕が続く時間の倍率 (上げてすぐ下げるたびに倍にする)
+    double ceiling;       // 上げてすぐ下げることになった点数 (0 なら無し)
+    int probing;          // 最後の変更が上げる方だったか
+    const char *decision; // 直前のフレームの判断 ("keep" "hold" "down" "up")
+} adapt_t;
+
+// 差分描画の状態 (delta.c)
+typedef struct TAG_DELTA {
+    uint32_t *clr;   // セルごとの最後に出力した色 (半ブロックなら上下それぞれ)
+    pixel_t *rgb;    // セルごとの最後に出力したときの平均色
+    uint32_t letter; // 覚えているセルの文字数
+    uint32_t line;   // 覚えているセルの行数
+    int half;        // 覚えているセルが半ブロックか
+    uint32_t frame;  // 最後に全体を描いてからのフレーム数
+} delta_t;
+
+// JPEG デコーダ (jpeg.c)
+typedef struct TAG_JPEG jpeg_t;
+// PNG デコーダ (png.c)
+typedef struct TAG_PNG png_t;
+
+// 入力画像
+#define IMAGE_BMP  0
+#define IMAGE_JPEG 1
+#define IMAGE_PNG  2
+typedef struct TAG_IMAGE {
+    FILE *fp;
+    int format;             // IMAGE_BMP / IMAGE_JPEG / IMAGE_PNG
+    bmpfileheader_t fh;     // BMP のヘッダ
+    bmpinfoheader_t ih;
+    bmpformat_t bf;         // BMP の画素形式
+    jpeg_t *jd;             // JPEG のデコーダ
+    png_t *pd;              // PNG のデコーダ
+    uint32_t width;         // 元画像の大きさ
+    uint32_t height;
+    uint32_t scale;         // JPEG を縮小して復号する率
+} image_t;
+
+// 画像ピラミッド (pyramid.c)
+// 段 k は一番下の段を縦横 1/2^k に箱フィルタで縮小したもの
+#define PYRAMID_MAXLEVEL 32
+// 一番下の段を復号するときの1画素あたりのメモリ (RGB の総和の double 3つと平均色)
+#define PYRAMID_DECODEBYTES (3 * sizeof(double) + sizeof(pixel_t))
+// 一番下の段の画素数の下限 (メモリの上限が小さくても (-m 0 でも) 拡大して見られる細かさは残す)
+#define PYRAMID_MINBASE (2048 * 2048)
+typedef struct TAG_PYRLEVEL {
+    uint8_t *bgr;       // B G R の並び (行の詰め物なし、NULL ならまだ作っていない)
+    uint32_t width;
+    uint32_t height;
+} pyrlevel_t;
+typedef struct TAG_PYRAMID {
+    pyrlevel_t level[PYRAMID_MAXLEVEL];
+    uint32_t nlevel;    // 段の数 (上の段は 1x1 まで)
+    uint64_t bytes;     // 作った段の合計バイト数
+} pyramid_t;
+
+// 巨大な BMP の一部分だけを読むタイルキャッシュ (tile.c)
+#define TILE_SIZE 256
+typedef struct TAG_BMPTILE {
+    uint32_t tx, ty;        // タイルの位置 (タイル単位)
+    uint32_t width;         // タイルの画素数 (右端・下端は TILE_SIZE より小さい)
+    uint32_t height;
+    uint8_t *bgr;           // B G R の並び (行の詰め物なし)
+    int loading;            // 読み込み中 (読んでいるスレッドのもの)
+    uint32_t pin;           // 描画中に使っている数 (追い出さない)
+    struct TAG_BMPTILE *hnext;          // ハッシュの同じ場所の次のタイル
+    struct TAG_BMPTILE *prev, *next;    // LRU リスト (先頭が最近使ったもの)
+} bmptile_t;
+typedef struct TAG_TILECACHE {
+    int fd;
+    bmpformat_t bf;
+    uint32_t ntx, nty;      // 横・縦のタイルの数
+    bmptile_t **hash;
+    uint32_t nhash;
+    bmptile_t lru;          // LRU リストの番兵
+    uint32_t count;         // キャッシュにあるタイルの数
+    uint32_t cap;           // タイルの数の上限
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;  // タイルの読み込みの完了の通知
+    pthread_cond_t wake;    // 先読みの要求の通知
+    pthread_t th;           // 先読みのスレッド (最初に先読みするときに作る)
+    int started, quit;
+    uint32_t *want;         // 先読みするタイル (ty * ntx + tx)
+    uint32_t nwant, wantcap;
+    uint64_t hits, misses, prefetched;
+} tilecache_t;
+
+// 表示する範囲 (--crop WxH+X+Y)
+typedef struct TAG_CROPRECT {
+    uint32_t x, y;
+    uint32_t width, height;
+} croprect_t;
+
+// 描画結果のキャッシュ構造体 (cache.c)
+typedef struct TAG_CACHE {
+    char dir[PATH_MAX];        // キャッシュディレクトリ
+    char path[PATH_MAX + 32];  // エントリのパス (キーのハッシュ)
+    char tmp[PATH_MAX + 64];   // 書き込み中の一時ファイルのパス
+    char key[PATH_MAX + 128];  // キー (元画像と描画パラメータ)
+    size_t keylen;
+} cache_t;
+
+// 実行時の計測 (stats.c)
+// 段階 (STATS_*) ごとの時間と出力の量を画像・フレームごとに数える
+#define STATS_SETUP   0 // 色数の判定・近似色探索テーブルの構築
+#define STATS_CACHE   1 // キャッシュの検索
+#define STATS_OPEN    2 // ファイルオープン
+#define STATS_HEADER  3 // ヘッダ取得・チェック
+#define STATS_SCALE   4 // ピクセル比率の決定
+#define STATS_LOAD    5 // 読み込み・積分画像の構築 (1行ずつ読むときは縮小・出力も含む)
+#define STATS_WAIT    6 // 動画の表示時刻までの待ち
+#define STATS_OUTPUT  7 // 縮小・色変換・出力
+#define STATS_NSTAGE  8
+typedef struct TAG_STATS {
+    int enabled;            // --stats (--adaptive でも数える)
+    int quiet;              // 1 なら数えるだけで JSON は書かない (--stats なしの --adaptive)
+    double t0;              // 計測開始の時刻
+    double last;            // 直前の区切りの時刻
+    double stage[STATS_NSTAGE];
+    uint64_t bytes;         // 出力バイト数
+    uint64_t escapes;       // エスケープシーケンス数
+    uint64_t cells;         // 描いた文字数
+    uint64_t lookups;       // 近似色探索の回数
+    double blocked;         // 出力の write で待たされた時間 (秒)
+    int cache;              // キャッシュに当たったら 1、外れたら 0 (使っていなければ -1)
+    const adapt_t *adapt;   // 出力の速さへの追従の状態 (使っていなければ NULL)
+} stats_t;
+
+// 色数・描画スレッド数などのコマンドラインの設定 (cbmpviewer.c)
+// ライブラリ (libcimage) からは参照せず、描画ごとに consolebmp_t やコンテキストに渡す
+extern int color256;
+extern int fullcolor;
+extern uint32_t nthreads;
+extern int halfblock;
+extern uint64_t memlimit;
+extern int graphics;
+extern stats_t stats; // 計測 (--stats) の状態。ライブラリには cimagesetstats・outbuf_t で渡す
+
 // 関数プロトタイプ宣言
+// メモリ確保 (cimage.c) 確保できなければ fail() する
+// 描画中に確保したメモリは、途中で失敗したときにまとめて解放する
+void *xmalloc(size_t n);
+void *xcalloc(size_t n, size_t size);
+void *xrealloc(void *p, size_t n);
+void xfree(void *p);
+// エラー (cimage.c)
+// ライブラリの描画中なら呼び出し元にエラーコード err を返し、そうでなければメッセージを表示して終了する
+void fail(int err, const char *fmt, ...) __attribute__((noreturn, format(printf, 2, 3)));
+// fn(arg) を描画の入口の中で呼ぶ (コマンドラインのワーカースレッドで画像ごとに失敗を受け止める)
+// 失敗したら fn の中で確保したメモリを解放し、fp が NULL でなければ閉じてエラーコードを返す
+int tryframe(void (*fn)(void *arg), void *arg, FILE *fp);
 // Usage
 void usage(void);
 // Viewプロシージャ ファイル名としきい値を受け取る
 void viewproc(char *filename, uint8_t threshold_r, uint8_t threshold_g, uint8_t threshold_b);
+// キャッシュの初期化 (使えなければ 0 を返す)
+int initcache(cache_t *cc, const char *source, uint32_t cols, uint8_t threshold_r, uint8_t threshold_g, uint8_t threshold_b);
+// キャッシュにあれば out に送って 1 を返す
+int cachesend(cache_t *cc, int out);
+// 新しいエントリの一時ファイルを作る (作れなければ -1)
+int cachecreate(cache_t *cc);
+// 書き終えた一時ファイルをエントリにして、上限 limit バイトを超えた分を古い順に消す
+void cachecommit(cache_t *cc, int fd, uint64_t limit);
+// 書きかけの一時ファイルを閉じて消す (描画に失敗したとき)
+void cacheabort(cache_t *cc, int fd);
+// 差分描画の初期化・終了
+void initdelta(delta_t *dt);
+void freedelta(delta_t *dt);
+// 1フレームの差分描画
+void renderdelta(delta_t *dt, const sat_t *sat, const consolebmp_t *cbmp, pixel_t *cell, outbuf_t *ob, const streamopt_t *opt, int fd);
+// 出力の速さへの追従の初期化 (横幅 cols・色モード maxlevel から始める)
+void initadapt(adapt_t *ad, uint32_t cols, int maxlevel, double fps);
+// 1フレームの出力 (bytes バイト、文字数 cells、出力にかかった時間 out 秒) を測って
+// 横幅・色モードを決め直す (変えたら 1 を返す)
+int adaptframe(adapt_t *ad, uint64_t bytes, uint64_t cells, double out);
+// ストリーム再生プロシージャ
+void streamproc(char *filename, const streamopt_t *opt, uint8_t threshold_r, uint8_t threshold_g, uint8_t threshold_b);
+// "WxH" 形式のフレームサイズを解析する
+void parsestreamsize(const char *s, streamopt_t *opt);
+// 一覧表示プロシージャ 複数の画像を横 width 文字のタイルにして並べる
+void gridproc(char **files, uint32_t nfiles, uint32_t width, uint8_t threshold_r, uint8_t threshold_g, uint8_t threshold_b);
+// 描画デーモンのプロシージャ ソケット path で要求を待つ
+void serveproc(const char *path);
+// クライアントのプロシージャ 描画をデーモン (ソケット path) に頼む
+void clientproc(const char *path, char *filename, uint8_t threshold_r, uint8_t threshold_g, uint8_t threshold_b);
+// 対話モードのプロシージャ 端末の大きさの変化とズーム・移動のキーに合わせて描き直す
+// crop が NULL でなければその範囲から始める (巨大な BMP はタイルで表示する範囲だけを読む)
+void interactproc(char *filename, const croprect_t *crop, uint8_t threshold_r, uint8_t threshold_g, uint8_t threshold_b);
+// 範囲表示のプロシージャ 無圧縮の BMP の crop の範囲だけを読んで表示する
+void cropproc(char *filename, const croprect_t *crop, uint8_t threshold_r, uint8_t threshold_g, uint8_t threshold_b);
+// "WxH+X+Y" 形式の範囲を解析する
+void parsecrop(const char *s, croprect_t *crop);
+// 色数の決定
+void getcolormode(void);
+// コンソールの横幅(文字数)を取得
+uint32_t getconsolecols(void);
+// 1文字の画素数を取得
+void getcellsize(uint32_t *width, uint32_t *height);
+// コンソール文字とピクセル比率の決定
+void setscale(consolebmp_t *cbmp, double width, double height, uint32_t cols);
+// 画像形式の判定とヘッダ取得
+void openimage(FILE *fp, image_t *im);
+// 横 cols 文字 (と maxline 行) に収まるようにピクセル比率を決める
+void scaleimage(image_t *im, consolebmp_t *cbmp, uint32_t cols, uint32_t maxline);
+// 横 cols 文字 (と maxline 行) に収まるようにピクセル比率を決める (使った横幅を返す)
+uint32_t fitscale(consolebmp_t *cbmp, uint32_t width, uint32_t height, uint32_t cols, uint32_t maxline);
+// 横 maxw 画素 (と縦 maxh 画素) 以下に縮小するようにピクセル比率を決める (1画素をセル1つとする)
+void setpixelscale(consolebmp_t *cbmp, uint32_t width, uint32_t height, uint32_t maxw, uint32_t maxh);
+// 画像で出力するときのピクセル比率を決める
+void scalepixels(image_t *im, consolebmp_t *cbmp, uint32_t maxw, uint32_t maxh);
+// 画像を1行ずつ復号して rd に足し込む (ob が NULL でなければ出力もする)
+void decodeimage(image_t *im, const consolebmp_t *cbmp, reducer_t *rd, outbuf_t *ob, int fd);
+// 画像を1回だけ復号してピラミッドの一番下の段を作る (復号中も limit バイトに収まる大きさにする)
+void initpyramid(pyramid_t *py, image_t *im, uint64_t limit);
+void freepyramid(pyramid_t *py);
+// k 段目 (まだ作っていなければここで作る)
+const pyrlevel_t *pyramidlevel(pyramid_t *py, uint32_t k);
+// ピラミッドの近い段から zoom 倍・中心 (cx, cy) の範囲を縮小して rd->cell に入れる (使った段を返す)
+uint32_t renderpyramid(pyramid_t *py, consolebmp_t *cbmp, double zoom, double cx, double cy,
+                       uint32_t cols, uint32_t maxline, reducer_t *rd);
+// タイルキャッシュの初期化・解放 (fp は無圧縮の BMP で、ヘッダ・パレットまで読み込み済みのこと)
+void inittilecache(tilecache_t *tc, FILE *fp, const bmpformat_t *bf, uint64_t limit);
+void freetilecache(tilecache_t *tc);
+// 元画像の範囲 (x0, y0) から w x h にかかるタイルだけを読んで縮小し、rd->cell に入れる
+void rendertiles(tilecache_t *tc, consolebmp_t *cbmp, uint32_t x0, uint32_t y0, uint32_t w, uint32_t h,
+                 uint32_t cols, uint32_t maxline, reducer_t *rd);
+// 範囲の周りのタイルを別のスレッドで先読みする
+void prefetchtiles(tilecache_t *tc, uint32_t x0, uint32_t y0, uint32_t w, uint32_t h);
+// ファイル上の行の x0 画素目から n 画素を B G R に展開する
+void expandbmppixels(const bmpformat_t *bf, const uint8_t *raw, uint32_t x0, uint32_t n, uint8_t *bgr);
 // 画像ヘッダ取得
 void getbmpheader(FILE *fp, bmpfileheader_t *fh, bmpinfoheader_t *ih);
 // ファイルポインタから指定のバイト取得(エラー処理付き)
@@ -63,112 +440,275 @@ void freadwitherror(void *buf, int byte, FILE *fp);
 void checkbmpheader(bmpfileheader_t *fh, bmpinfoheader_t *ih);
 // 画像ヘッダの表示
 void showbmpheader(bmpfileheader_t *fh, bmpinfoheader_t *ih);
-// 画像データをメモリに読み込む
-void readbmpdata(FILE *fp, pixel_t **pix, int32_t width, int32_t height);
+// 画像データの読み込み (mmap できなければ 0 を返す)
+int loadbmpimage(FILE *fp, const bmpformat_t *bf, bmpimage_t *img);
+// メモリ上の BMP ファイル data の画像データを直接参照する (24bit 無圧縮でなければ 0 を返す)
+int viewbmpimage(const uint8_t *data, size_t len, const bmpformat_t *bf, bmpimage_t *img);
+// ヘッダの後ろのビットフィールドとパレットを読む
+void readbmpformat(FILE *fp, const bmpfileheader_t *fh, const bmpinfoheader_t *ih, bmpformat_t *bf);
+// fp を画像データの先頭まで読み進める (ヘッダ・パレットは読み込み済みのこと)
+void skiptobits(FILE *fp, const bmpformat_t *bf);
+// ファイル上の1行 raw を画素形式に合わせて rd に足し込む (tmp は幅 x 3 byte の作業領域)
+void reducebmprow(reducer_t *rd, const bmpformat_t *bf, uint32_t y, const uint8_t *raw, uint8_t *tmp);
+// RLE8/RLE4 を1行ずつ展開して rd に足し込む
+void streamrle(FILE *fp, const bmpformat_t *bf, reducer_t *rd, outbuf_t *ob, int fd);
+// 積分画像を使えるか (limit は積分画像に使うメモリの上限)
+int satfits(const consolebmp_t *cbmp, int32_t width, int32_t height, uint64_t limit);
+// 行ストリーム縮小の初期化・終了
+void initreducer(reducer_t *rd, const consolebmp_t *cbmp, uint32_t width, uint32_t height);
+// 行を上から順に渡すときの初期化 (セル行2つ分の輪で、完成した行から ob に追加する)
+void initringreducer(reducer_t *rd, const consolebmp_t *cbmp, uint32_t width, uint32_t height, outbuf_t *ob);
+void freereducer(reducer_t *rd);
+// 上から y 行目の1行 (B G R の並び) を足し込む
+void reducerow(reducer_t *rd, uint32_t y, const uint8_t *p);
+// 上から y 行目の1行 (パレット番号の並び) を足し込む
+void reduceindexrow(reducer_t *rd, uint32_t y, const uint8_t *idx, const pixel_t *pal, uint32_t npal);
+// 完成した行 (emitted 行目から) を書き出す
+void flushready(reducer_t *rd, uint32_t *emitted, outbuf_t *ob, int fd);
+// streambmp が行を上から順に足し込むか
+int bmpinorder(FILE *fp, const bmpformat_t *bf);
+// 画像全体をメモリに載せずに rd に足し込む (ob が NULL でなければ出力もする)
+void streambmp(FILE *fp, const bmpformat_t *bf, reducer_t *rd, outbuf_t *ob, int fd);
+// JPEG のヘッダを SOF まで読む
+jpeg_t *openjpeg(FILE *fp, uint32_t *width, uint32_t *height);
+// JPEG を復号する縮小率 (1, 2, 4, 8)
+uint32_t jpegscale(const consolebmp_t *cbmp, uint32_t width, uint32_t height);
+// JPEG を 1/scale で復号して rd に足し込み、デコーダを解放する
+void decodejpeg(jpeg_t *jd, uint32_t scale, reducer_t *rd, outbuf_t *ob, int fd);
+// PNG のヘッダを最初の IDAT まで読む
+png_t *openpng(FILE *fp, uint32_t *width, uint32_t *height);
+// PNG を1行ずつ復号して rd に足し込み、デコーダを解放する
+void decodepng(png_t *pd, reducer_t *rd, outbuf_t *ob, int fd);
+// 画像データの解放
+void freebmpimage(bmpimage_t *img);
 // 画像データの表示
-void showbmpdata(pixel_t **pix, int32_t width, int32_t height);
-// 色変換と出力
-void outputbmp(pixel_t **pix, consolebmp_t *cbmp);
-
-// 拡張パレット - RBGの変換テーブル
-pixel_t pal2rgb[256] = {
-    {0,0,0},      {192,0,0},    {0,192,0},    {192,192,0},  
-    {64,64,192},  {192,0,192},  {0,192,192},  {192,192,192},
-    {64,64,64},   {255,0,0},    {0,255,0},    {255,255,0},  
-    {128,128,255},{255,0,255},  {0,255,255},  {255,255,255},
-    {0,0,0},      {0,0,95},     {0,0,135},    {0,0,175},    
-    {0,0,215},    {0,0,255},    {0,95,0},     {0,95,95},    
-    {0,95,135},   {0,95,175},   {0,95,215},   {0,95,255},   
-    {0,135,0},    {0,135,95},   {0,135,135},  {0,135,175},  
-    {0,135,215},  {0,135,255},  {0,175,0},    {0,175,95},   
-    {0,175,135},  {0,175,175},  {0,175,215},  {0,175,255},  
-    {0,215,0},    {0,215,95},   {0,215,135},  {0,215,175},  
-    {0,215,215},  {0,215,255},  {0,255,0},    {0,255,95},   
-    {0,255,135},  {0,255,175},  {0,255,215},  {0,255,255},  
-    {95,0,0},     {95,0,95},    {95,0,135},   {95,0,175},   
-    {95,0,215},   {95,0,255},   {95,95,0},    {95,95,95},   
-    {95,95,135},  {95,95,175},  {95,95,215},  {95,95,255},  
-    {95,135,0},   {95,135,95},  {95,135,135}, {95,135,175}, 
-    {95,135,215}, {95,135,255}, {95,175,0},   {95,175,95},  
-    {95,175,135}, {95,175,175}, {95,175,215}, {95,175,255}, 
-    {95,215,0},   {95,215,95},  {95,215,135}, {95,215,175}, 
-    {95,215,215}, {95,215,255}, {95,255,0},   {95,255,95},  
-    {95,255,135}, {95,255,175}, {95,255,215}, {95,255,255}, 
-    {135,0,0},    {135,0,95},   {135,0,135},  {135,0,175},  
-    {135,0,215},  {135,0,255},  {135,95,0},   {135,95,95},  
-    {135,95,135}, {135,95,175}, {135,95,215}, {135,95,255}, 
-    {135,135,0},  {135,135,95}, {135,135,135},{135,135,175},
-    {135,135,215},{135,135,255},{135,175,0},  {135,175,95}, 
-    {135,175,135},{135,175,175},{135,175,215},{135,175,255},
-    {135,215,0},  {135,215,95}, {135,215,135},{135,215,175},
-    {135,215,215},{135,215,255},{135,255,0},  {135,255,95}, 
-    {135,255,135},{135,255,175},{135,255,215},{135,255,255},
-    {175,0,0},    {175,0,95},   {175,0,135},  {175,0,175},  
-    {175,0,215},  {175,0,255},  {175,95,0},   {175,95,95},  
-    {175,95,135}, {175,95,175}, {175,95,215}, {175,95,255}, 
-    {175,135,0},  {175,135,95}, {175,135,135},{175,135,175},
-    {175,135,215},{175,135,255},{175,175,0},  {175,175,95}, 
-    {175,175,135},{175,175,175},{175,175,215},{175,175,255},
-    {175,215,0},  {175,215,95}, {175,215,135},{175,215,175},
-    {175,215,215},{175,215,255},{175,255,0},  {175,255,95}, 
-    {175,255,135},{175,255,175},{175,255,215},{175,255,255},
-    {215,0,0},    {215,0,95},   {215,0,135},  {215,0,175},  
-    {215,0,215},  {215,0,255},  {215,95,0},   {215,95,95},  
-    {215,95,135}, {215,95,175}, {215,95,215}, {215,95,255}, 
-    {215,135,0},  {215,135,95}, {215,135,135},{215,135,175},
-    {215,135,215},{215,135,255},{215,175,0},  {215,175,95}, 
-    {215,175,135},{215,175,175},{215,175,215},{215,175,255},
-    {215,215,0},  {215,215,95}, {215,215,135},{215,215,175},
-    {215,215,215},{215,215,255},{215,255,0},  {215,255,95}, 
-    {215,255,135},{215,255,175},{215,255,215},{215,255,255},
-    {255,0,0},    {255,0,95},   {255,0,135},  {255,0,175},  
-    {255,0,215},  {255,0,255},  {255,95,0},   {255,95,95},  
-    {255,95,135}, {255,95,175}, {255,95,215}, {255,95,255}, 
-    {255,135,0},  {255,135,95}, {255,135,135},{255,135,175},
-    {255,135,215},{255,135,255},{255,175,0},  {255,175,95}, 
-    {255,175,135},{255,175,175},{255,175,215},{255,175,255},
-    {255,215,0},  {255,215,95}, {255,215,135},{255,215,175},
-    {255,215,215},{255,215,255},{255,255,0},  {255,255,95}, 
-    {255,255,135},{255,255,175},{255,255,215},{255,255,255},
-    {8,8,8},      {18,18,18},   {28,28,28},   {38,38,38},   
-    {48,48,48},   {58,58,58},   {68,68,68},   {78,78,78},   
-    {88,88,88},   {98,98,98},   {108,108,108},{118,118,118},
-    {128,128,128},{138,138,138},{148,148,148},{158,158,158},
-    {168,168,168},{178,178,178},{188,188,188},{198,198,198},
-    {208,208,208},{218,218,218},{228,228,228},{238,238,238},
-};
-
-
-// 三次空間から距離を得る
+void showbmpdata(const bmpimage_t *img);
+// 積分画像の構築・解放 (sat->s は NULL で初期化しておく)
+void buildsat(const bmpimage_t *img, sat_t *sat);
+void freesat(sat_t *sat);
+// 整数比の縮小カーネルを選ぶ (使えなければ NULL)
+boxkernel_t boxkernel(const consolebmp_t *cbmp, uint32_t width, uint32_t height);
+// セルごとの平均色を求める (line0 行目から line1 - 1 行目まで)
+void downsample(const sat_t *sat, const consolebmp_t *cbmp, uint32_t line0, uint32_t line1, pixel_t *cell);
+// 色変換して出力バッファに追加 (line0 行目から line1 - 1 行目まで)
+void outputlines(const pixel_t *cell, const consolebmp_t *cbmp, uint32_t line0, uint32_t line1, outbuf_t *ob);
+// 色変換して i 行目の文字だけを出力バッファに追加 (行末のリセットと改行は付けない)
+void outputrow(const pixel_t *cell, const consolebmp_t *cbmp, uint32_t i, outbuf_t *ob);
+// w x h の画素を sixel・kitty graphics protocol で出力バッファに追加
+void outputsixel(const pixel_t *px, uint32_t w, uint32_t h, const consolebmp_t *cbmp, outbuf_t *ob);
+void outputkitty(const pixel_t *px, uint32_t w, uint32_t h, int mode, uint32_t id, outbuf_t *ob);
+// 出力形式 mode (CIMAGE_SIXEL・CIMAGE_KITTY*) で w x h の画素を出力バッファに追加 (id は kitty の画像番号)
+void outputpixels(const pixel_t *px, uint32_t w, uint32_t h, const consolebmp_t *cbmp, int mode, uint32_t id, outbuf_t *ob);
+// 並列描画の初期化・終了
+void initrenderer(renderer_t *rd, uint32_t nthreads);
+void freerenderer(renderer_t *rd);
+// 1フレームの描画 (縮小・色変換・出力)
+// img が NULL でなければ整数比のカーネルで img から、そうでなければ積分画像 sat から縮小する
+void renderframe(renderer_t *rd, const sat_t *sat, const bmpimage_t *img, consolebmp_t *cbmp, pixel_t *cell, outbuf_t *ob, int fd);
+
+// 出力バッファの初期化・解放
+void obinit(outbuf_t *ob, size_t cap);
+void obfree(outbuf_t *ob);
+// 残り容量が n バイト未満なら広げる
+void obgrow(outbuf_t *ob, size_t n);
+// バッファの内容を fd にまとめて書き出して空にする
+void obflush(outbuf_t *ob, int fd);
+
+// 計測の開始・区切り・集計 (無効なら何もしない)
+void statsstart(stats_t *st);
+// 単調増加の時計 (秒)
+double statsclock(void);
+void statsaddlap(stats_t *st, int stage);
+void statsaddout(stats_t *st, const char *buf, size_t len);
+void statsaddcells(stats_t *st, uint64_t cells, uint64_t colors, const consolebmp_t *cbmp);
+// 1行の JSON を標準エラー出力に書く (frame が負なら静止画)
+void statsprint(const stats_t *st, const char *name, int64_t frame);
+// コンテキストの描画を st に数える (cimage.c、stats_t は公開しないのでコマンドラインから使う)
+void cimagesetstats(cimage_t *ci, stats_t *st);
+
+// 直前の区切りからの時間を段階 stage に足す (st が NULL なら何もしない)
+static inline
+void statslap(stats_t *st, int stage) {
+    if (st != NULL && st->enabled)
+        statsaddlap(st, stage);
+}
+
+// 1行のバイト数 (4byte境界に合わせる)
+static inline
+size_t bmpstride(int32_t width) {
+    return ((size_t)width * 3 + 3) & ~(size_t)3;
+}
+
+// 上から y 行目の先頭
+static inline
+const uint8_t *bmprow(const bmpimage_t *img, uint32_t y) {
+    return img->top + img->pitch * (ptrdiff_t)y;
+}
+
+// 残り容量を n バイト以上にする
+static inline
+void obreserve(outbuf_t *ob, size_t n) {
+    if (ob->cap - ob->len < n)
+        obgrow(ob, n);
+}
+
+// 文字列を追加 (容量は obreserve で確保済みのこと)
+static inline
+void obputs(outbuf_t *ob, const char *s, size_t n) {
+    memcpy(ob->buf + ob->len, s, n);
+    ob->len += n;
+}
+
+// 文字列リテラルを追加
+#define obputlit(ob, s) obputs((ob), (s), sizeof(s) - 1)
+
+// 1文字追加 (容量は obreserve で確保済みのこと)
+static inline
+void obputc(outbuf_t *ob, char c) {
+    ob->buf[ob->len++] = c;
+}
+
+// 符号無し整数を10進で追加 (printf を使わずテーブルで2桁ずつ変換する)
+extern const char dec2[200];
+static inline
+void obputu(outbuf_t *ob, uint32_t v) {
+    char tmp[10];
+    char *p = tmp + sizeof(tmp);
+
+    while (v >= 100) {
+        p -= 2;
+        memcpy(p, dec2 + (v % 100) * 2, 2);
+        v /= 100;
+    }
+    if (v >= 10) {
+        p -= 2;
+        memcpy(p, dec2 + v * 2, 2);
+    } else {
+        *--p = '0' + v;
+    }
+    obputs(ob, p, tmp + sizeof(tmp) - p);
+}
+
+// 1文字あたりの出力の最大バイト数
+// 通常は "\x1b[0;48;2;255:255:255m " の22バイト
+// 半ブロックは前景・背景の "\x1b[38;2;255:255:255m" 19バイトずつと "▀" 3バイト
+#define CELL_MAXBYTES 42
+
+// 1文字あたりの縦のサンプル数 (半ブロックなら2)
 static inline
-uint32_t distance(uint32_t r0, uint32_t g0, uint32_t b0,
-                  uint32_t r1, uint32_t g1, uint32_t b1) {
-    uint32_t r, g, b;
-    r = abs(r0 - r1) ;
-    g = abs(g0 - g1) ;
-    b = abs(b0 - b1) ;
-    return sqrt(r * r + g * g + b * b);
+uint32_t cbmpsub(const consolebmp_t *cbmp) {
+    return cbmp->half ? 2 : 1;
 }
 
+// 拡張パレット - RBGの変換テーブル (palette.c)
+extern const pixel_t pal2rgb[256];
+
+// 近似色探索テーブルの構築 (near() を使う前に呼ぶ、2回目からは何もしない)
+void initpalette(void);
 // RGB から 拡張カラーへの近似色を探す
+uint8_t near(uint32_t r0, uint32_t g0, uint32_t b0);
+
+// セルの色
+// 8色なら RGB 各値を2値化した 0~7、256色ならパレット番号、フルカラーなら 0xRRGGBB
 static inline
-uint8_t near(uint32_t r0, uint32_t g0, uint32_t b0) {
-    uint32_t dmin = (uint32_t)1000 ;// > 441.672
-    uint32_t d[256] = {0};
-    uint32_t i;
-    for (i = 0; i < 256; i++) {
-        d[i] = distance( r0,g0,b0,
-        pal2rgb[i].red,
-        pal2rgb[i].green,
-        pal2rgb[i].blue);
-        if(dmin > d[i]) dmin = d[i];
+uint32_t cellcolor(const pixel_t *cell, const consolebmp_t *cbmp) {
+    uint32_t r = cell->red, g = cell->green, b = cell->blue;
+
+    if (cbmp->color256) {
+        if (cbmp->fullcolor)
+            return (r << 16) | (g << 8) | b;
+        return near(r, g, b);
     }
-    for (i = 0; i < 256; i++) {
-        if(d[i] == dmin) return i;
+    // RGB各値を2bit化して、RGBを3bit(8通り)で表す
+    r = (r < cbmp->threshold_r) ? 0 : 1;
+    g = (g < cbmp->threshold_g) ? 0 : 1;
+    b = (b < cbmp->threshold_b) ? 0 : 1;
+    return (r << 2) + (g << 1) + b;
+}
+
+// 色 clr の SGR を追加
+static inline
+void putcolor(outbuf_t *ob, uint32_t clr, const consolebmp_t *cbmp) {
+    // カラーコード rgb = 000:black 001:blue 010:green 011:cyan 100:red 101:magenta 110:yellow 111:white
+    static const char clrcode[8] = {'0', '4', '2', '6', '1', '5', '3', '7'};
+
+    if (cbmp->color256) {
+        if (cbmp->fullcolor) {
+            // 拡張 2
+            obputlit(ob, "\x1b[0;48;2;");
+            obputu(ob, clr >> 16);
+            obputc(ob, ':');
+            obputu(ob, (clr >> 8) & 0xff);
+            obputc(ob, ':');
+            obputu(ob, clr & 0xff);
+            obputc(ob, 'm');
+        } else {
+            // 拡張 5;
+            obputlit(ob, "\x1b[0;48;5;");
+            obputu(ob, clr);
+            obputc(ob, 'm');
+        }
+    } else {
+        obputlit(ob, "\x1b[3");
+        obputc(ob, clrcode[clr]);
+        obputlit(ob, "m\x1b[4");
+        obputc(ob, clrcode[clr]);
+        obputc(ob, 'm');
     }
-    return 255;
 }
 
+// 色 clr の1文字を追加 (8色のときは前景も同じ色にした色番号の数字)
+static inline
+void putglyph(outbuf_t *ob, uint32_t clr, const consolebmp_t *cbmp) {
+    obputc(ob, cbmp->color256 ? ' ' : '0' + clr);
+}
+
+// 前景 (fg が 1) または背景の色 clr の SGR を追加 (半ブロック用)
+// 前景と背景を別々に切り替えるので "0;" のリセットは付けない
+static inline
+void putsgr(outbuf_t *ob, uint32_t clr, int fg, const consolebmp_t *cbmp) {
+    static const char clrcode[8] = {'0', '4', '2', '6', '1', '5', '3', '7'};
+
+    obputlit(ob, "\x1b[");
+    if (cbmp->color256) {
+        obputc(ob, fg ? '3' : '4');
+        if (cbmp->fullcolor) {
+            obputlit(ob, "8;2;");
+            obputu(ob, clr >> 16);
+            obputc(ob, ':');
+            obputu(ob, (clr >> 8) & 0xff);
+            obputc(ob, ':');
+            obputu(ob, clr & 0xff);
+        } else {
+            obputlit(ob, "8;5;");
+            obputu(ob, clr);
+        }
+    } else {
+        obputc(ob, fg ? '3' : '4');
+        obputc(ob, clrcode[clr]);
+    }
+    obputc(ob, 'm');
+}
+
+// 上半分 top、下半分 bottom の1文字を追加 (半ブロック用)
+// fg / bg は現在の前景・背景の色で、変わるときだけ SGR を出す
+// 上下が同じ色なら空白にして前景は切り替えない
+static inline
+void puthalf(outbuf_t *ob, uint32_t top, uint32_t bottom, uint32_t *fg, uint32_t *bg, const consolebmp_t *cbmp) {
+    if (*bg != bottom) {
+        *bg = bottom;
+        putsgr(ob, bottom, 0, cbmp);
+    }
+    if (top == bottom) {
+        obputc(ob, ' ');
+        return;
+    }
+    if (*fg != top) {
+        *fg = top;
+        putsgr(ob, top, 1, cbmp);
+    }
+    obputlit(ob, "\xe2\x96\x80"); // ▀
+}
 
 #endif
 
@@ -0,0 +1,481 @@
+/**
+ * cimage.c
+ * libcimage の入口 (コンテキスト・エラー・メモリ確保)
+ * 描画は setjmp で入口を記録してから行い、途中のエラー (fail) は longjmp で入口に戻って
+ * エラーコードを返す (libpng と同じ方式)。描画中に xmalloc で確保したメモリは描画ごとの一覧に
+ * つないでおき、失敗したときはまとめて解放する。成功したときは一覧から外すだけで、
+ * 解放は確保した側 (freereducer など) がこれまでどおり行う。
+ * 入口の外 (コマンドラインの動画再生など) で fail した場合はメッセージを表示して終了する。
+ * 一覧表示のワーカーのように画像ごとに失敗を受け止めたいときは tryframe で入口を作る。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cbmpviewer.h"
+
+// 確保したメモリの見出し
+// 描画中に確保したものは描画の一覧 (循環リスト) につなぎ、それ以外は自分自身を指す
+typedef struct TAG_BLOCK {
+    struct TAG_BLOCK *prev;
+    struct TAG_BLOCK *next;
+} block_t;
+
+// 描画1回分の入口
+typedef struct TAG_FRAME {
+    jmp_buf jb;
+    int err;              // エラーコード
+    char msg[128];        // エラーメッセージ
+    block_t blocks;       // 描画中に確保したメモリの一覧 (番兵)
+    FILE *fp;             // 開いている入力
+    renderer_t rd;        // 描画スレッド
+    int rdused;           // 描画スレッドが動いているか
+    bmpimage_t img;       // 画像データ
+    int imgused;          // 画像データを mmap しているか
+    struct TAG_FRAME *prev;
+} frame_t;
+
+// コンテキスト
+struct TAG_CIMAGE {
+    consolebmp_t cbmp;    // 色数・しきい値・半ブロックの設定 (大きさは描画ごとに決める)
+    uint32_t cols;        // 横幅 (文字数)
+    uint32_t maxline;     // 行数の上限 (0 なら無し)
+    uint32_t nthreads;    // 描画スレッド数
+    uint64_t memlimit;    // 積分画像に使うメモリの上限
+    int graphics;         // 出力形式 (CIMAGE_TEXT・CIMAGE_SIXEL・CIMAGE_KITTY*)
+    uint32_t cellw;       // 1文字の画素数 (画像で出力するときの大きさ)
+    uint32_t cellh;
+    outbuf_t ob;          // メモリへの描画結果
+    int tee;              // fd への描画の出力を写す fd (-1 なら無し)
+    int teefailed;        // 直前の描画で tee に書き込めなくなった
+    uint32_t letter;      // 直前に描いた大きさ
+    uint32_t line;
+    char msg[128];        // 直前のエラーメッセージ
+    stats_t *stats;       // 描画の計測 (NULL なら数えない)
+};
+
+// スレッドごとの描画中の入口 (描画中でなければ NULL)
+static __thread frame_t *curframe = NULL;
+// メモリの一覧の排他 (描画スレッドが同じ一覧の出力バッファを広げることがある)
+static pthread_mutex_t blocklock = PTHREAD_MUTEX_INITIALIZER;
+
+// エラー
+// 描画中なら入口に戻ってエラーコード err を返す
+// そうでなければ (コマンドライン) メッセージを表示して終了する
+// 出力先が閉じられた (パイプの先の head など) ときは黙って終わる
+void fail(int err, const char *fmt, ...) {
+    frame_t *fr = curframe;
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (fr != NULL) {
+        fr->err = err;
+        vsnprintf(fr->msg, sizeof(fr->msg), fmt, ap);
+        va_end(ap);
+        longjmp(fr->jb, 1);
+    }
+    if (err == CIMAGE_EPIPE)
+        exit(EXIT_SUCCESS);
+    printf("Error: ");
+    vprintf(fmt, ap);
+    printf("\n");
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+// メモリ確保
+void *xmalloc(size_t n) {
+    block_t *b;
+
+    if (n > SIZE_MAX - sizeof(block_t) || (b = (block_t *)malloc(sizeof(block_t) + n)) == NULL)
+        fail(CIMAGE_ENOMEM, "memory allocate");
+    pthread_mutex_lock(&blocklock);
+    if (curframe != NULL) {
+        b->prev = &curframe->blocks;
+        b->next = curframe->blocks.next;
+        b->next->prev = b;
+        curframe->blocks.next = b;
+    } else {
+        b->prev = b->next = b;
+    }
+    pthread_mutex_unlock(&blocklock);
+    return b + 1;
+}
+
+// 0 で埋めたメモリの確保 (n が 0 でも NULL は返さない)
+void *xcalloc(size_t n, size_t size) {
+    void *p;
+
+    if (size != 0 && n > SIZE_MAX / size)
+        fail(CIMAGE_ENOMEM, "memory allocate");
+    p = xmalloc(n * size);
+    memset(p, 0, n * size);
+    return p;
+}
+
+// メモリの再確保 (一覧につながっているかはそのまま)
+void *xrealloc(void *p, size_t n) {
+    block_t *b, *nb;
+    int listed;
+
+    if (p == NULL)
+        return xmalloc(n);
+    b = (block_t *)p - 1;
+    pthread_mutex_lock(&blocklock);
+    listed = b->next != b;
+    if (n > SIZE_MAX - sizeof(block_t) || (nb = (block_t *)realloc(b, sizeof(block_t) + n)) == NULL) {
+        pthread_mutex_unlock(&blocklock);
+        fail(CIMAGE_ENOMEM, "memory allocate");
+    }
+    if (listed) {
+        nb->prev->next = nb;
+        nb->next->prev = nb;
+    } else {
+        nb->prev = nb->next = nb;
+    }
+    pthread_mutex_unlock(&blocklock);
+    return nb + 1;
+}
+
+// メモリの解放
+void xfree(void *p) {
+    block_t *b;
+
+    if (p == NULL)
+        return;
+    b = (block_t *)p - 1;
+    pthread_mutex_lock(&blocklock);
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+    pthread_mutex_unlock(&blocklock);
+    free(b);
+}
+
+// 描画の入口に入る (この後で setjmp(fr->jb) すること)
+static void enterframe(frame_t *fr) {
+    fr->err = CIMAGE_OK;
+    fr->msg[0] = '\0';
+    fr->blocks.prev = fr->blocks.next = &fr->blocks;
+    fr->fp = NULL;
+    fr->rdused = 0;
+    fr->imgused = 0;
+    fr->prev = curframe;
+    curframe = fr;
+}
+
+// 描画の入口から出てエラーコードを返す
+// 失敗していたら描画スレッドを止め、開いている入力と描画中に確保したメモリを解放する
+static int leaveframe(frame_t *fr, cimage_t *ci) {
+    block_t *b, *next;
+
+    curframe = fr->prev;
+    if (fr->err != CIMAGE_OK) {
+        if (fr->rdused)
+            freerenderer(&fr->rd);
+        if (fr->imgused)
+            freebmpimage(&fr->img);
+        if (fr->fp != NULL)
+            fclose(fr->fp);
+    }
+    pthread_mutex_lock(&blocklock);
+    for (b = fr->blocks.next; b != &fr->blocks; b = next) {
+        next = b->next;
+        if (fr->err != CIMAGE_OK)
+            free(b);
+        else
+            b->prev = b->next = b;
+    }
+    pthread_mutex_unlock(&blocklock);
+    if (ci != NULL)
+        snprintf(ci->msg, sizeof(ci->msg), "%s", fr->msg);
+    return fr->err;
+}
+
+// fn(arg) を描画の入口の中で呼ぶ
+// 失敗したら fn の中で確保したメモリを解放し、fp が NULL でなければ閉じてエラーコードを返す
+// 成功したときは fp は閉じない (確保したメモリも fn の呼び出し元のもの)
+int tryframe(void (*fn)(void *arg), void *arg, FILE *fp) {
+    frame_t fr;
+
+    enterframe(&fr);
+    fr.fp = fp;
+    if (setjmp(fr.jb) == 0)
+        fn(arg);
+    return leaveframe(&fr, NULL);
+}
+
+// 画像1枚の描画
+// fr->fp から読み、完成した行から ob に追加して fd に書き出す (ob->keep ならためておく)
+// data が NULL でなければ fr->fp と同じ内容のメモリで、BMP の画像データはそこを直接参照する
+// 描画スレッドと画像データは失敗したときに入口で後始末できるよう fr に置く
+static void render(cimage_t *ci, frame_t *fr, const uint8_t *data, size_t len, outbuf_t *ob, int fd) {
+    image_t im;
+    consolebmp_t cbmp = ci->cbmp;
+    sat_t sat = {NULL, 0, 0};
+    pixel_t *cell;
+    reducer_t red;
+    int box;
+
+    // 画像形式の判定とヘッダ取得
+    openimage(fr->fp, &im);
+    statslap(ci->stats, STATS_HEADER);
+    debug("[FORMAT: OK]\n");
+
+    // 画像で出力するときは1画素をセル1つとして縮小し、まとめて sixel・kitty に変換する
+    if (ci->graphics != CIMAGE_TEXT) {
+        scalepixels(&im, &cbmp, ci->cols * ci->cellw, ci->maxline * ci->cellh);
+        ci->letter = (cbmp.letter + ci->cellw - 1) / ci->cellw;
+        ci->line = (cbmp.line + ci->cellh - 1) / ci->cellh;
+        statslap(ci->stats, STATS_SCALE);
+        decodeimage(&im, &cbmp, &red, NULL, -1);
+        statslap(ci->stats, STATS_LOAD);
+        outputpixels(red.cell, cbmp.letter, cbmp.line, &cbmp, ci->graphics, 0, ob);
+        freereducer(&red);
+        debugflush();
+        obflush(ob, fd);
+        debug("[RENDER: OK] %ux%u pixels\n", cbmp.letter, cbmp.line);
+        return;
+    }
+
+    // ピクセル比率の決定
+    scaleimage(&im, &cbmp, ci->cols, ci->maxline);
+    obreserve(ob, (size_t)cbmp.letter * CELL_MAXBYTES * 4);
+    ci->letter = cbmp.letter;
+    ci->line = cbmp.line;
+    statslap(ci->stats, STATS_SCALE);
+
+    // BMP は積分画像がメモリの上限に収まり、メモリ上にあるか通常ファイルで mmap できれば
+    // ピクセル行をそのまま参照して積分画像を作る (コピーしない)
+    // そうでなければ (JPEG・PNG も) 1行ずつ読んでセルに足し込み、画像全体はメモリに載せない
+    if (im.format == IMAGE_BMP && satfits(&cbmp, im.width, im.height, ci->memlimit)
+        && (data != NULL ? viewbmpimage(data, len, &im.bf, &fr->img) : loadbmpimage(fr->fp, &im.bf, &fr->img))) {
+        debug("[READDATA: OK] %s\n", data != NULL ? "memory" : "mmap");
+        fr->imgused = 1;
+        // セル1つがちょうど整数の画素数になる小さな比率なら、積分画像を作らずに画像から直接縮小する
+        box = boxkernel(&cbmp, im.width, im.height) != NULL;
+        if (!box) {
+            buildsat(&fr->img, &sat);
+            freebmpimage(&fr->img);
+            fr->imgused = 0;
+            debug("[SAT: OK]\n");
+        }
+        statslap(ci->stats, STATS_LOAD);
+        cell = (pixel_t *)xmalloc(sizeof(pixel_t) * cbmp.letter * cbmp.line * cbmpsub(&cbmp));
+
+        // 縮小・色変換と出力 (行バンドごとに並列)
+        fr->rdused = 1;
+        initrenderer(&fr->rd, ci->nthreads);
+        renderframe(&fr->rd, &sat, box ? &fr->img : NULL, &cbmp, cell, ob, fd);
+        freerenderer(&fr->rd);
+        fr->rdused = 0;
+        xfree(cell);
+        if (box) {
+            freebmpimage(&fr->img);
+            fr->imgused = 0;
+        }
+        freesat(&sat);
+    } else {
+        decodeimage(&im, &cbmp, &red, ob, fd);
+        freereducer(&red);
+        statslap(ci->stats, STATS_LOAD);
+    }
+    debug("[RENDER: OK]\n");
+    if (ci->stats != NULL && ci->stats->enabled)
+        statsaddcells(ci->stats, (uint64_t)cbmp.letter * cbmp.line, (uint64_t)cbmp.letter * cbmp.line * cbmpsub(&cbmp), &cbmp);
+}
+
+// コンテキストの作成
+cimage_t *cimagecreate(void) {
+    frame_t fr;
+    cimage_t *ci = NULL;
+
+    enterframe(&fr);
+    if (setjmp(fr.jb) == 0) {
+        ci = (cimage_t *)xcalloc(1, sizeof(cimage_t));
+        ci->cbmp.threshold_r = ci->cbmp.threshold_g = ci->cbmp.threshold_b = 128;
+        ci->cols = 80;
+        ci->nthreads = 1;
+        ci->memlimit = (uint64_t)512 << 20;
+        ci->cellw = 10;
+        ci->cellh = 20;
+        ci->tee = -1;
+        obinit(&ci->ob, 4096);
+        ci->ob.keep = 1;
+    }
+    // 失敗したときは確保した分は解放済み
+    if (leaveframe(&fr, NULL) != CIMAGE_OK)
+        return NULL;
+    return ci;
+}
+
+// コンテキストの破棄
+void cimagedestroy(cimage_t *ci) {
+    if (ci == NULL)
+        return;
+    obfree(&ci->ob);
+    xfree(ci);
+}
+
+// 色モードの設定 (256色なら近似色探索テーブルを構築する)
+int cimagesetcolor(cimage_t *ci, int mode) {
+    frame_t fr;
+
+    if (mode != CIMAGE_COLOR8 && mode != CIMAGE_COLOR256 && mode != CIMAGE_TRUECOLOR) {
+        snprintf(ci->msg, sizeof(ci->msg), "invalid color mode %d", mode);
+        return CIMAGE_EINVAL;
+    }
+    enterframe(&fr);
+    if (setjmp(fr.jb) == 0) {
+        if (mode == CIMAGE_COLOR256)
+            initpalette();
+        ci->cbmp.color256 = mode != CIMAGE_COLOR8;
+        ci->cbmp.fullcolor = mode == CIMAGE_TRUECOLOR;
+    }
+    return leaveframe(&fr, ci);
+}
+
+// しきい値の設定 (8色のとき)
+void cimagesetthreshold(cimage_t *ci, uint8_t r, uint8_t g, uint8_t b) {
+    ci->cbmp.threshold_r = r;
+    ci->cbmp.threshold_g = g;
+    ci->cbmp.threshold_b = b;
+}
+
+// 横幅 (と行数の上限) の設定
+void cimagesetsize(cimage_t *ci, uint32_t cols, uint32_t maxline) {
+    ci->cols = MAX(cols, 1);
+    ci->maxline = maxline;
+}
+
+// 半ブロックの設定
+void cimagesethalf(cimage_t *ci, int half) {
+    ci->cbmp.half = half != 0;
+}
+
+// 描画スレッド数の設定
+void cimagesetthreads(cimage_t *ci, uint32_t n) {
+    ci->nthreads = MAX(n, 1);
+}
+
+// 積分画像に使うメモリの上限の設定
+void cimagesetmemlimit(cimage_t *ci, uint64_t bytes) {
+    ci->memlimit = bytes;
+}
+
+// 出力形式の設定
+int cimagesetgraphics(cimage_t *ci, int mode) {
+    if (mode < CIMAGE_TEXT || mode > CIMAGE_KITTYSHM) {
+        snprintf(ci->msg, sizeof(ci->msg), "invalid graphics mode %d", mode);
+        return CIMAGE_EINVAL;
+    }
+    ci->graphics = mode;
+    return CIMAGE_OK;
+}
+
+// 1文字の画素数の設定
+void cimagesetcellsize(cimage_t *ci, uint32_t width, uint32_t height) {
+    ci->cellw = MAX(width, 1);
+    ci->cellh = MAX(height, 1);
+}
+
+// fd への描画の出力を写す fd の設定
+void cimagesettee(cimage_t *ci, int fd) {
+    ci->tee = fd < 0 ? -1 : fd;
+}
+
+// 描画の計測の設定 (NULL ならやめる)
+// 段階ごとの時間・描いた文字数と、cimagerenderfd で書き出した量を st に足す
+void cimagesetstats(cimage_t *ci, stats_t *st) {
+    ci->stats = st;
+}
+
+// 直前の描画で tee に書き込めなくなったか
+int cimageteefailed(const cimage_t *ci) {
+    return ci->teefailed;
+}
+
+// fd in から読んで fd out に書き出す
+// in は dup して読むので、呼び出し元の fd はそのまま (読んだ分は進む)
+int cimagerenderfd(cimage_t *ci, int in, int out) {
+    frame_t fr;
+    outbuf_t ob;
+    int fd;
+
+    enterframe(&fr);
+    if (setjmp(fr.jb) == 0) {
+        if ((fd = dup(in)) < 0)
+            fail(CIMAGE_EREAD, "file open");
+        if ((fr.fp = fdopen(fd, "rb")) == NULL) {
+            close(fd);
+            fail(CIMAGE_EREAD, "file open");
+        }
+        obinit(&ob, 0);
+        ob.tee = ci->tee;
+        ob.stats = ci->stats;
+        ci->teefailed = 0;
+        render(ci, &fr, NULL, 0, &ob, out);
+        ci->teefailed = ci->tee >= 0 && ob.tee < 0;
+        obfree(&ob);
+        fclose(fr.fp);
+        fr.fp = NULL;
+    }
+    return leaveframe(&fr, ci);
+}
+
+// メモリ上の画像 data を描画して、結果をコンテキストのバッファに置く
+int cimagerendermem(cimage_t *ci, const void *data, size_t len, const char **out, size_t *outlen) {
+    frame_t fr;
+    int err;
+
+    *out = NULL;
+    *outlen = 0;
+    ci->ob.len = 0;
+    enterframe(&fr);
+    if (setjmp(fr.jb) == 0) {
+        if (len == 0)
+            fail(CIMAGE_EREAD, "file read");
+        if ((fr.fp = fmemopen((void *)data, len, "rb")) == NULL)
+            fail(CIMAGE_ENOMEM, "memory allocate");
+        render(ci, &fr, (const uint8_t *)data, len, &ci->ob, -1);
+        obreserve(&ci->ob, 1);
+        ci->ob.buf[ci->ob.len] = '\0';
+        fclose(fr.fp);
+        fr.fp = NULL;
+    }
+    if ((err = leaveframe(&fr, ci)) != CIMAGE_OK)
+        return err;
+    *out = ci->ob.buf;
+    *outlen = ci->ob.len;
+    return CIMAGE_OK;
+}
+
+// メモリ上の画像 data を描画して、呼び出し元のバッファ buf に書く
+int cimagerenderbuf(cimage_t *ci, const void *data, size_t len, char *buf, size_t cap, size_t *outlen) {
+    const char *p;
+    int err;
+
+    if ((err = cimagerendermem(ci, data, len, &p, outlen)) != CIMAGE_OK)
+        return err;
+    if (*outlen > cap) {
+        snprintf(ci->msg, sizeof(ci->msg), "output buffer too small (%zu bytes needed)", *outlen);
+        return CIMAGE_ESPACE;
+    }
+    memcpy(buf, p, *outlen);
+    return CIMAGE_OK;
+}
+
+// 直前の描画の大きさ
+void cimagegetsize(const cimage_t *ci, uint32_t *letter, uint32_t *line) {
+    *letter = ci->letter;
+    *line = ci->line;
+}
+
+// 直前のエラーのメッセージ
+const char *cimageerror(const cimage_t *ci) {
+    return ci->msg;
+}
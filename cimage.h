@@ -0,0 +1,95 @@
+/**
+ * cimage.h
+ * libcimage: 画像 (BMP・JPEG・PNG) をコンソール用のエスケープシーケンスに変換するライブラリ
+ *
+ * 色数・しきい値・横幅などの設定はコンテキスト (cimage_t) ごとに持つので、
+ * コンテキストを分ければ複数のスレッドから同時に使える (1つのコンテキストを同時に使うのは不可)。
+ * エラーは終了せずに負のエラーコードを返し、cimageerror() でメッセージを取れる。
+ * 途中で失敗したときも、その描画で確保したメモリ・ファイルはすべて解放する。
+ */
+
+#ifndef __CIMAGE_H__
+#define __CIMAGE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 共有ライブラリから公開する関数 (それ以外は -fvisibility=hidden で隠す)
+#define CIMAGE_API __attribute__((visibility("default")))
+
+// エラーコード
+#define CIMAGE_OK            0
+#define CIMAGE_ENOMEM       -1 // メモリが確保できない
+#define CIMAGE_EREAD        -2 // 入力が読めない (途中で終わっている)
+#define CIMAGE_EWRITE       -3 // 出力に書き込めない
+#define CIMAGE_EPIPE        -4 // 出力先が閉じられた
+#define CIMAGE_EFORMAT      -5 // 画像が壊れている
+#define CIMAGE_EUNSUPPORTED -6 // 対応していない画像形式
+#define CIMAGE_ESPACE       -7 // 呼び出し元のバッファが足りない
+#define CIMAGE_ETHREAD      -8 // スレッドが作れない
+#define CIMAGE_EINVAL       -9 // 引数が不正
+
+// 色モード
+#define CIMAGE_COLOR8    0 // 8色 (RGB 各値をしきい値で2値化)
+#define CIMAGE_COLOR256  1 // 256色 (拡張パレットの近似色)
+#define CIMAGE_TRUECOLOR 2 // フルカラー
+
+// 出力形式
+#define CIMAGE_TEXT      0 // 文字の色 (エスケープシーケンス)
+#define CIMAGE_SIXEL     1 // sixel (1画素ずつ、色は色モードのパレット)
+#define CIMAGE_KITTY     2 // kitty graphics protocol (画素を base64 で直接送る)
+#define CIMAGE_KITTYFILE 3 // kitty graphics protocol (一時ファイルで渡す、端末と同じマシンのみ)
+#define CIMAGE_KITTYSHM  4 // kitty graphics protocol (POSIX 共有メモリで渡す、端末と同じマシンのみ)
+
+// コンテキスト
+typedef struct TAG_CIMAGE cimage_t;
+
+// コンテキストの作成 (8色、しきい値 128、横 80 文字、シングルスレッド) と破棄
+// 作れなければ NULL を返す
+CIMAGE_API cimage_t *cimagecreate(void);
+CIMAGE_API void cimagedestroy(cimage_t *ci);
+
+// 設定
+CIMAGE_API int cimagesetcolor(cimage_t *ci, int mode);
+CIMAGE_API void cimagesetthreshold(cimage_t *ci, uint8_t r, uint8_t g, uint8_t b);
+// 横 cols 文字に合わせる (maxline が 0 でなければ行数もそれ以下にする)
+CIMAGE_API void cimagesetsize(cimage_t *ci, uint32_t cols, uint32_t maxline);
+// 1 なら半ブロック(▀)で1文字に縦2ピクセルを描く
+CIMAGE_API void cimagesethalf(cimage_t *ci, int half);
+// 1枚の描画に使うスレッド数 (1 なら呼び出し元のスレッドだけで描く)
+CIMAGE_API void cimagesetthreads(cimage_t *ci, uint32_t n);
+// 積分画像に使うメモリの上限 (超える画像は1行ずつ読んで縮小する)
+CIMAGE_API void cimagesetmemlimit(cimage_t *ci, uint64_t bytes);
+// 出力形式 (CIMAGE_TEXT 以外は横 cols 文字 x 1文字の画素数の大きさの画像にする)
+CIMAGE_API int cimagesetgraphics(cimage_t *ci, int mode);
+// 1文字の画素数 (画像で出力するときの大きさの計算に使う、デフォルト 10x20)
+CIMAGE_API void cimagesetcellsize(cimage_t *ci, uint32_t width, uint32_t height);
+
+// fd in から読んで fd out に書き出す
+// 完成した行から順に書き出すので、大きな画像でも出力はすぐに始まる
+CIMAGE_API int cimagerenderfd(cimage_t *ci, int in, int out);
+// cimagerenderfd の出力を fd にも同じように書き出す (-1 ならやめる、描画結果のキャッシュなどに使う)
+// fd に書き込めなくなっても描画は続け、cimageteefailed() が 1 を返す
+CIMAGE_API void cimagesettee(cimage_t *ci, int fd);
+CIMAGE_API int cimageteefailed(const cimage_t *ci);
+// メモリ上の画像 data を描画して、結果をコンテキストのバッファに置く
+// *out は次の描画かコンテキストの破棄まで有効 ('\0' 終端、*outlen に終端は含まない)
+CIMAGE_API int cimagerendermem(cimage_t *ci, const void *data, size_t len, const char **out, size_t *outlen);
+// メモリ上の画像 data を描画して、呼び出し元のバッファ buf (cap バイト) に書く
+// 足りなければ CIMAGE_ESPACE を返し、*outlen に必要なバイト数を入れる
+CIMAGE_API int cimagerenderbuf(cimage_t *ci, const void *data, size_t len, char *buf, size_t cap, size_t *outlen);
+
+// 直前の描画の大きさ (文字数と行数)
+CIMAGE_API void cimagegetsize(const cimage_t *ci, uint32_t *letter, uint32_t *line);
+// 直前のエラーのメッセージ
+CIMAGE_API const char *cimageerror(const cimage_t *ci);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -50,6 +50,7 @@ int main() {
     int i, r, g, b;
     uint8_t clr;
 
+    initpalette();
     ioctl(STDOUT_FILENO, TIOCGWINSZ, &win);
     printf("col=%u row=%u\n\n", win.ws_col, win.ws_row);
 
@@ -0,0 +1,162 @@
+/**
+ * delta.c
+ * 差分描画 (動画再生用)
+ * 前のフレームで出力したセルの色を覚えておき、色が変わったセルだけを
+ * カーソル移動と SGR で描き直す。一定フレームごとに全体を描き直して同期を取る。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "cbmpviewer.h"
+
+// 1セルあたりのカーソル移動の最大バイト数 ("\x1b[65535;65535H")
+#define CURSOR_MAXBYTES 14
+
+// 差分描画の初期化
+void initdelta(delta_t *dt) {
+    dt->clr = NULL;
+    dt->rgb = NULL;
+    dt->letter = dt->line = 0;
+    dt->half = 0;
+    dt->frame = 0;
+}
+
+// 差分描画の終了
+void freedelta(delta_t *dt) {
+    xfree(dt->clr);
+    xfree(dt->rgb);
+    initdelta(dt);
+}
+
+// 色の差が許容差以内か
+// 緑を重く青を軽く見る重み付きユークリッド距離 (2:4:3) で比べる
+static inline
+int nearcolor(const pixel_t *a, const pixel_t *b, uint32_t tolerance) {
+    int32_t dr = a->red - b->red;
+    int32_t dg = a->green - b->green;
+    int32_t db = a->blue - b->blue;
+
+    return (uint32_t)(2 * dr * dr + 4 * dg * dg + 3 * db * db) <= 9 * tolerance * tolerance;
+}
+
+// カーソル移動 (0 始まりの行・列)
+static inline
+void putcursor(outbuf_t *ob, uint32_t y, uint32_t x) {
+    obputlit(ob, "\x1b[");
+    obputu(ob, y + 1);
+    obputc(ob, ';');
+    obputu(ob, x + 1);
+    obputc(ob, 'H');
+}
+
+// 全体の描画 (キーフレーム)
+// outputlines で描いて、出力した色を覚えておく
+static void renderkey(delta_t *dt, const pixel_t *cell, const consolebmp_t *cbmp, outbuf_t *ob) {
+    size_t k, n = (size_t)cbmp->letter * cbmp->line * cbmpsub(cbmp);
+
+    obreserve(ob, 16);
+    obputlit(ob, "\x1b[H");
+    outputlines(cell, cbmp, 0, cbmp->line, ob);
+    for (k = 0; k < n; k++) {
+        dt->clr[k] = cellcolor(&cell[k], cbmp);
+        dt->rgb[k] = cell[k];
+    }
+    if (stats.enabled)
+        statsaddcells(&stats, (size_t)cbmp->letter * cbmp->line, n * 2, cbmp);
+}
+
+// セル k の色 clr が前回出力したものから変わったか
+// わずかな変化 (ノイズ) は変化なしとみなす
+// 比べるのは最後に出力したときの色なので、少しずつの変化もいずれは描かれる
+static inline
+int changed(const delta_t *dt, const pixel_t *cell, size_t k, uint32_t clr, uint32_t tolerance) {
+    if (clr == dt->clr[k])
+        return 0;
+    return tolerance == 0 || !nearcolor(&cell[k], &dt->rgb[k], tolerance);
+}
+
+// 差分の描画
+// 色が変わった文字だけを描く。直前に描いた文字の右隣ならカーソル移動は省略する
+// 半ブロックでは上下どちらかが変われば1文字分を描き直す
+static void renderdiff(delta_t *dt, const pixel_t *cell, const consolebmp_t *cbmp, outbuf_t *ob, uint32_t tolerance) {
+    uint32_t i, j, top, bottom = 0;
+    uint32_t cx = (uint32_t)-1, cy = (uint32_t)-1; // 現在のカーソル位置
+    uint32_t fg = (uint32_t)-1, bg = (uint32_t)-1;  // 現在の SGR の色
+    size_t k, kb = 0;
+    uint64_t drawn = 0;
+
+    for (i = 0; i < cbmp->line; i++) {
+        obreserve(ob, (size_t)cbmp->letter * (CELL_MAXBYTES + CURSOR_MAXBYTES) + 16);
+        for (j = 0; j < cbmp->letter; j++) {
+            k = (size_t)i * cbmpsub(cbmp) * cbmp->letter + j;
+            top = cellcolor(&cell[k], cbmp);
+            if (cbmp->half) {
+                kb = k + cbmp->letter;
+                bottom = cellcolor(&cell[kb], cbmp);
+                if (!changed(dt, cell, k, top, tolerance) && !changed(dt, cell, kb, bottom, tolerance))
+                    continue;
+            } else if (!changed(dt, cell, k, top, tolerance)) {
+                continue;
+            }
+
+            if (cy != i || cx != j)
+                putcursor(ob, i, j);
+            if (cbmp->half) {
+                puthalf(ob, top, bottom, &fg, &bg, cbmp);
+                dt->clr[kb] = bottom;
+                dt->rgb[kb] = cell[kb];
+            } else {
+                if (bg != top) {
+                    bg = top;
+                    putcolor(ob, top, cbmp);
+                }
+                putglyph(ob, top, cbmp);
+            }
+            dt->clr[k] = top;
+            dt->rgb[k] = cell[k];
+            cy = i;
+            cx = j + 1;
+            drawn++;
+        }
+    }
+    if (stats.enabled)
+        statsaddcells(&stats, drawn, (uint64_t)cbmp->letter * cbmp->line * cbmpsub(cbmp), cbmp);
+    // デフォルトに戻して画像の下にカーソルを置く (キーフレームと同じ位置)
+    if (cy != (uint32_t)-1) {
+        obreserve(ob, 16 + CURSOR_MAXBYTES);
+        obputlit(ob, "\x1b[39m\x1b[49m");
+        putcursor(ob, cbmp->line, 0);
+    }
+}
+
+// 1フレームの差分描画
+// 最初のフレーム、セル数が変わったとき、keyframe フレームごとは全体を描き直す
+void renderdelta(delta_t *dt, const sat_t *sat, const consolebmp_t *cbmp, pixel_t *cell, outbuf_t *ob, const streamopt_t *opt, int fd) {
+    size_t n = (size_t)cbmp->letter * cbmp->line * cbmpsub(cbmp);
+
+    downsample(sat, cbmp, 0, cbmp->line, cell);
+
+    if (dt->letter != cbmp->letter || dt->line != cbmp->line || dt->half != cbmp->half) {
+        xfree(dt->clr);
+        xfree(dt->rgb);
+        dt->clr = (uint32_t *)xmalloc(sizeof(uint32_t) * n);
+        dt->rgb = (pixel_t *)xmalloc(sizeof(pixel_t) * n);
+        dt->letter = cbmp->letter;
+        dt->line = cbmp->line;
+        dt->half = cbmp->half;
+        dt->frame = 0;
+    }
+
+    if (dt->frame == 0 || (opt->keyframe > 0 && dt->frame >= opt->keyframe)) {
+        renderkey(dt, cell, cbmp, ob);
+        dt->frame = 0;
+    } else {
+        renderdiff(dt, cell, cbmp, ob, opt->tolerance);
+    }
+    dt->frame++;
+
+    fflush(stdout);
+    obflush(ob, fd);
+}
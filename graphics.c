@@ -0,0 +1,281 @@
+/**
+ * graphics.c
+ * 画素単位の出力 (sixel・kitty graphics protocol)
+ * 文字のセルの代わりに、1画素をセル1つとして縮小した画像を端末に画像として送る。
+ * sixel は色モードの近似色 (8色ならしきい値、それ以外は拡張パレット) で色を決め、
+ * 使った色だけをレジスタに定義して、6行ずつのバンドを色ごとにランレングスで出力する。
+ * kitty は RGB をそのまま base64 にして分割して送るか、端末と同じマシンなら
+ * 一時ファイル・共有メモリに置いてその名前だけを送る。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "cbmpviewer.h"
+
+// kitty の1つのエスケープシーケンスで送る base64 の長さの上限
+#define KITTY_CHUNK 4096
+// 近似色探索の結果を覚えておく数 (2の累乗)
+#define SIXEL_MEMO_BITS 12
+#define SIXEL_MEMO      (1 << SIXEL_MEMO_BITS)
+// バンド内で使っていない色の印
+#define SIXEL_NOSLOT    0xffff
+
+static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// 画素の色のパレット番号 (8色なら 0~7、それ以外は拡張パレット)
+// 同じ色が続くことが多いので、近似色探索の結果は色のハッシュで覚えておく
+static void quantize(const pixel_t *px, size_t n, const consolebmp_t *cbmp, uint8_t *idx) {
+    uint32_t key[SIXEL_MEMO], rgb, h;
+    uint8_t val[SIXEL_MEMO];
+    size_t i;
+
+    if (!cbmp->color256) {
+        for (i = 0; i < n; i++)
+            idx[i] = cellcolor(&px[i], cbmp);
+        return;
+    }
+    initpalette();
+    memset(key, 0xff, sizeof(key));
+    for (i = 0; i < n; i++) {
+        rgb = ((uint32_t)px[i].red << 16) | ((uint32_t)px[i].green << 8) | px[i].blue;
+        h = (rgb * 2654435761u) >> (32 - SIXEL_MEMO_BITS);
+        if (key[h] != rgb) {
+            key[h] = rgb;
+            val[h] = near(px[i].red, px[i].green, px[i].blue);
+        }
+        idx[i] = val[h];
+    }
+}
+
+// 0~255 を sixel の色の 0~100 (%) に
+static uint32_t percent(uint32_t v) {
+    return (v * 100 + 127) / 255;
+}
+
+// 文字 ch を n 個追加する (4個以上は "!n" の繰り返し指定にする)
+static void putrun(outbuf_t *ob, char ch, uint32_t n) {
+    if (n > 3) {
+        obputc(ob, '!');
+        obputu(ob, n);
+        obputc(ob, ch);
+        return;
+    }
+    while (n-- > 0)
+        obputc(ob, ch);
+}
+
+// w x h の画素を sixel で出力バッファに追加
+// 色は色モードで決めたパレット番号をそのままレジスタ番号にする
+void outputsixel(const pixel_t *px, uint32_t w, uint32_t h, const consolebmp_t *cbmp, outbuf_t *ob) {
+    uint32_t npal = cbmp->color256 ? 256 : 8;
+    uint32_t lo[256], hi[256], x, e, y0, k, i, n, c;
+    uint16_t slot[256];
+    uint8_t used[256], list[256];
+    uint8_t *idx, *bits, *row;
+    const uint8_t *p;
+    pixel_t pal;
+    size_t j;
+
+    idx = (uint8_t *)xmalloc((size_t)w * h);
+    bits = (uint8_t *)xcalloc((size_t)w * npal, 1);
+    quantize(px, (size_t)w * h, cbmp, idx);
+
+    // 縦横比 1:1、背景は塗りつぶさない
+    memset(used, 0, sizeof(used));
+    for (j = 0; j < (size_t)w * h; j++)
+        used[idx[j]] = 1;
+    obreserve(ob, 32 + npal * 20);
+    obputlit(ob, "\x1bP0;1;0q\"1;1;");
+    obputu(ob, w);
+    obputc(ob, ';');
+    obputu(ob, h);
+    for (c = 0; c < npal; c++) {
+        if (!used[c])
+            continue;
+        if (cbmp->color256) {
+            pal = pal2rgb[c];
+        } else {
+            pal.red = (c & 4) ? 255 : 0;
+            pal.green = (c & 2) ? 255 : 0;
+            pal.blue = (c & 1) ? 255 : 0;
+        }
+        obputc(ob, '#');
+        obputu(ob, c);
+        obputlit(ob, ";2;");
+        obputu(ob, percent(pal.red));
+        obputc(ob, ';');
+        obputu(ob, percent(pal.green));
+        obputc(ob, ';');
+        obputu(ob, percent(pal.blue));
+    }
+
+    // 6行ずつのバンド
+    // バンドに出てくる色ごとに作業行 (横 w 個の6bit) を割り当てて、使った範囲 [lo, hi) だけを出力する
+    for (c = 0; c < 256; c++)
+        slot[c] = SIXEL_NOSLOT;
+    for (y0 = 0; y0 < h; y0 += 6) {
+        n = 0;
+        for (k = 0; k < 6 && y0 + k < h; k++) {
+            p = idx + (size_t)(y0 + k) * w;
+            for (x = 0; x < w; x++) {
+                c = p[x];
+                if (slot[c] == SIXEL_NOSLOT) {
+                    slot[c] = n;
+                    list[n++] = c;
+                    lo[c] = x;
+                    hi[c] = x + 1;
+                } else {
+                    lo[c] = MIN(lo[c], x);
+                    hi[c] = MAX(hi[c], x + 1);
+                }
+                bits[(size_t)slot[c] * w + x] |= 1 << k;
+            }
+        }
+        for (i = 0; i < n; i++) {
+            c = list[i];
+            row = bits + (size_t)i * w;
+            obreserve(ob, (size_t)hi[c] + 16);
+            obputc(ob, '#');
+            obputu(ob, c);
+            putrun(ob, '?', lo[c]);
+            for (x = lo[c]; x < hi[c]; x = e) {
+                for (e = x + 1; e < hi[c] && row[e] == row[x]; e++)
+                    ;
+                putrun(ob, '?' + row[x], e - x);
+            }
+            // 作業行は使った範囲だけ戻しておく
+            memset(row + lo[c], 0, hi[c] - lo[c]);
+            slot[c] = SIXEL_NOSLOT;
+            // 同じバンドの次の色は行頭に戻って重ね、バンドの終わりは次のバンドへ
+            if (i + 1 < n)
+                obputc(ob, '$');
+            else if (y0 + 6 < h)
+                obputc(ob, '-');
+        }
+    }
+    obreserve(ob, 4);
+    obputlit(ob, "\x1b\\");
+    xfree(bits);
+    xfree(idx);
+}
+
+// n バイトを base64 で追加 (容量は obreserve で確保済みのこと)
+static void putbase64(outbuf_t *ob, const uint8_t *p, size_t n) {
+    char *q = ob->buf + ob->len;
+    uint32_t v;
+
+    for (; n >= 3; n -= 3, p += 3, q += 4) {
+        v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+        q[0] = b64[v >> 18];
+        q[1] = b64[(v >> 12) & 63];
+        q[2] = b64[(v >> 6) & 63];
+        q[3] = b64[v & 63];
+    }
+    if (n > 0) {
+        v = ((uint32_t)p[0] << 16) | (n > 1 ? (uint32_t)p[1] << 8 : 0);
+        q[0] = b64[v >> 18];
+        q[1] = b64[(v >> 12) & 63];
+        q[2] = n > 1 ? b64[(v >> 6) & 63] : '=';
+        q[3] = '=';
+        q += 4;
+    }
+    ob->len = q - ob->buf;
+}
+
+// 画素を一時ファイル (CIMAGE_KITTYFILE) か共有メモリ (CIMAGE_KITTYSHM) に置き、その名前を name に入れる
+// 名前には端末が読んだ後に消してよい印の "tty-graphics-protocol" を含める
+static void kittystore(int mode, const uint8_t *data, size_t len, char *name, size_t size) {
+    static uint32_t seq = 0;
+    const char *dir;
+    size_t pos = 0;
+    ssize_t n;
+    int fd;
+
+    if (mode == CIMAGE_KITTYFILE) {
+        if ((dir = getenv("TMPDIR")) == NULL || *dir == '\0')
+            dir = "/tmp";
+        snprintf(name, size, "%s/cimage-tty-graphics-protocol-XXXXXX", dir);
+        fd = mkstemp(name);
+    } else {
+        snprintf(name, size, "/cimage-tty-graphics-protocol-%ld-%u", (long)getpid(), __sync_fetch_and_add(&seq, 1));
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+    if (fd < 0)
+        fail(CIMAGE_EWRITE, "%s", mode == CIMAGE_KITTYFILE ? "temp file" : "shared memory");
+    while (pos < len) {
+        if ((n = write(fd, data + pos, len - pos)) < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            if (mode == CIMAGE_KITTYFILE)
+                unlink(name);
+            else
+                shm_unlink(name);
+            fail(CIMAGE_EWRITE, "%s", mode == CIMAGE_KITTYFILE ? "temp file" : "shared memory");
+        }
+        pos += n;
+    }
+    close(fd);
+}
+
+// w x h の画素を kitty graphics protocol で出力バッファに追加 (色は 24bit のまま)
+// id が 0 でなければ画像番号 id・配置番号 1 にして前の同じ番号の画像を置き換え、カーソルは動かさない (動画用)
+void outputkitty(const pixel_t *px, uint32_t w, uint32_t h, int mode, uint32_t id, outbuf_t *ob) {
+    char name[PATH_MAX];
+    const uint8_t *data = (const uint8_t *)px; // pixel_t は R G B の3byte
+    size_t size = (size_t)w * h * 3, len = size, pos = 0, n;
+
+    if (mode == CIMAGE_KITTYFILE || mode == CIMAGE_KITTYSHM) {
+        kittystore(mode, data, size, name, sizeof(name));
+        data = (const uint8_t *)name;
+        len = strlen(name);
+    }
+    // 制御データは最初の分割にだけ付ける
+    do {
+        n = MIN(len - pos, KITTY_CHUNK / 4 * 3);
+        obreserve(ob, KITTY_CHUNK + 96);
+        obputlit(ob, "\x1b_G");
+        if (pos == 0) {
+            obputlit(ob, "a=T,f=24,s=");
+            obputu(ob, w);
+            obputlit(ob, ",v=");
+            obputu(ob, h);
+            if (mode == CIMAGE_KITTYFILE || mode == CIMAGE_KITTYSHM) {
+                obputlit(ob, ",S=");
+                obputu(ob, (uint32_t)size);
+                if (mode == CIMAGE_KITTYFILE)
+                    obputlit(ob, ",t=t");
+                else
+                    obputlit(ob, ",t=s");
+            }
+            if (id != 0) {
+                obputlit(ob, ",i=");
+                obputu(ob, id);
+                obputlit(ob, ",p=1,C=1");
+            }
+            // 端末からの応答は返させない
+            obputlit(ob, ",q=2,");
+        }
+        obputlit(ob, "m=");
+        obputc(ob, pos + n < len ? '1' : '0');
+        obputc(ob, ';');
+        putbase64(ob, data + pos, n);
+        obputlit(ob, "\x1b\\");
+        pos += n;
+    } while (pos < len);
+}
+
+// 出力形式 mode (CIMAGE_SIXEL・CIMAGE_KITTY*) で w x h の画素を出力バッファに追加
+void outputpixels(const pixel_t *px, uint32_t w, uint32_t h, const consolebmp_t *cbmp, int mode, uint32_t id, outbuf_t *ob) {
+    if (mode == CIMAGE_SIXEL)
+        outputsixel(px, w, h, cbmp, ob);
+    else
+        outputkitty(px, w, h, mode, id, ob);
+}
@@ -0,0 +1,276 @@
+/**
+ * grid.c
+ * 一覧表示 (コンタクトシート)
+ * 多数の画像をワークスティーリングのスレッドプールで並列に復号・縮小し、
+ * コンソールの横幅に並べたタイルとして1段ずつ出力する。
+ * 上の段がそろった時点で出力するので、最初の結果はすぐに表示される。
+ * 色数の判定やパレットの構築は最初に一度だけ行う。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cbmpviewer.h"
+
+// タイルの間の空白の文字数
+#define GRID_GAP 1
+
+// タイル (画像1枚分)
+typedef struct TAG_TILE {
+    const char *path;
+    consolebmp_t cbmp;
+    pixel_t *cell;      // 縮小したセル (開けなかったら NULL)
+    int done;           // 復号が終わったか
+} tile_t;
+
+// スレッドごとの仕事の両端キュー
+// 持ち主は先頭 (番号の小さい方) から取り、他のスレッドは末尾から盗む
+typedef struct TAG_WORKQ {
+    uint32_t *idx;
+    uint32_t head, tail;
+    pthread_mutex_t lock;
+} workq_t;
+
+// 一覧表示の状態
+typedef struct TAG_GRID {
+    tile_t *tile;
+    uint32_t ntile;
+    uint32_t width;     // タイルの横幅 (文字数)
+    uint32_t maxline;   // タイルの最大の行数
+    uint8_t threshold_r, threshold_g, threshold_b;
+    workq_t *q;
+    uint32_t nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} grid_t;
+
+// ワーカーの引数
+typedef struct TAG_GRIDWORKER {
+    grid_t *g;
+    uint32_t self;
+} gridworker_t;
+
+// 次の仕事を取る (自分のキューが空なら他のスレッドのキューから盗む)
+static int takework(grid_t *g, uint32_t self, uint32_t *idx) {
+    workq_t *q;
+    uint32_t k;
+
+    for (k = 0; k < g->nthreads; k++) {
+        q = &g->q[(self + k) % g->nthreads];
+        pthread_mutex_lock(&q->lock);
+        if (q->head < q->tail) {
+            *idx = k == 0 ? q->idx[q->head++] : q->idx[--q->tail];
+            pthread_mutex_unlock(&q->lock);
+            return 1;
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+    return 0;
+}
+
+// タイル1枚の復号の引数
+typedef struct TAG_TILEJOB {
+    grid_t *g;
+    tile_t *t;
+    FILE *fp;
+} tilejob_t;
+
+// 画像1枚を復号・縮小してタイルのセルにする (tryframe の入口の中で呼ぶ)
+static void decodetile(void *arg) {
+    tilejob_t *job = (tilejob_t *)arg;
+    tile_t *t = job->t;
+    image_t im;
+    reducer_t rd;
+
+    openimage(job->fp, &im);
+    t->cbmp.half = halfblock;
+    t->cbmp.color256 = color256;
+    t->cbmp.fullcolor = fullcolor;
+    t->cbmp.threshold_r = job->g->threshold_r;
+    t->cbmp.threshold_g = job->g->threshold_g;
+    t->cbmp.threshold_b = job->g->threshold_b;
+    scaleimage(&im, &t->cbmp, job->g->width, job->g->maxline);
+    decodeimage(&im, &t->cbmp, &rd, NULL, -1);
+    // セルはタイルが受け取る
+    t->cell = rd.cell;
+    rd.cell = NULL;
+    freereducer(&rd);
+}
+
+// 画像1枚をタイルにする
+// 開けない・読めない (画像でない・壊れている) ファイルは空白のタイルにして、一覧表示は続ける
+static void rendertile(grid_t *g, tile_t *t) {
+    tilejob_t job;
+
+    t->cell = NULL;
+    if ((job.fp = fopen(t->path, "rb")) == NULL)
+        return;
+    job.g = g;
+    job.t = t;
+    if (tryframe(decodetile, &job, job.fp) != CIMAGE_OK) {
+        // セルと入力は入口で解放済み
+        t->cell = NULL;
+        return;
+    }
+    fclose(job.fp);
+}
+
+// ワーカースレッド
+static void *gridworker(void *arg) {
+    gridworker_t *w = (gridworker_t *)arg;
+    grid_t *g = w->g;
+    uint32_t i;
+
+    while (takework(g, w->self, &i)) {
+        rendertile(g, &g->tile[i]);
+        pthread_mutex_lock(&g->lock);
+        g->tile[i].done = 1;
+        pthread_cond_broadcast(&g->done);
+        pthread_mutex_unlock(&g->lock);
+    }
+    return NULL;
+}
+
+// 空白を n 文字追加
+static void putspaces(outbuf_t *ob, uint32_t n) {
+    obreserve(ob, n);
+    memset(ob->buf + ob->len, ' ', n);
+    ob->len += n;
+}
+
+// タイル1段 (tile[i0] から n 枚) を出力する
+// 段の高さはいちばん高いタイルに合わせ、下に画像のファイル名を付ける
+static void outputtiles(const grid_t *g, const tile_t *tile, uint32_t n, outbuf_t *ob) {
+    uint32_t i, l, lines = 0, len;
+    const char *name;
+
+    for (i = 0; i < n; i++)
+        if (tile[i].cell != NULL)
+            lines = MAX(lines, tile[i].cbmp.line);
+    for (l = 0; l < lines; l++) {
+        for (i = 0; i < n; i++) {
+            if (i > 0)
+                putspaces(ob, GRID_GAP);
+            if (tile[i].cell != NULL && l < tile[i].cbmp.line) {
+                outputrow(tile[i].cell, &tile[i].cbmp, l, ob);
+                obreserve(ob, 16);
+                obputlit(ob, "\x1b[39m\x1b[49m"); // デフォルトに戻す
+                putspaces(ob, g->width - tile[i].cbmp.letter);
+            } else {
+                putspaces(ob, g->width);
+            }
+        }
+        obputc(ob, '\n');
+    }
+    // ファイル名 (ディレクトリは除き、タイルの幅で切る)
+    for (i = 0; i < n; i++) {
+        if (i > 0)
+            putspaces(ob, GRID_GAP);
+        name = strrchr(tile[i].path, '/') ? strrchr(tile[i].path, '/') + 1 : tile[i].path;
+        len = MIN(strlen(name), g->width);
+        obreserve(ob, len);
+        memcpy(ob->buf + ob->len, name, len);
+        ob->len += len;
+        if (i + 1 < n)
+            putspaces(ob, g->width - len);
+    }
+    obputc(ob, '\n');
+}
+
+// 一覧表示プロシージャ
+// files の nfiles 枚を横 width 文字のタイルにしてコンソールの横幅に並べる
+void gridproc(char **files, uint32_t nfiles, uint32_t width, uint8_t threshold_r, uint8_t threshold_g, uint8_t threshold_b) {
+    grid_t g;
+    gridworker_t *w;
+    pthread_t *th;
+    outbuf_t ob;
+    uint32_t i, cols, percol, row;
+
+    // 色数の決定と近似色探索テーブルの構築 (全画像で共通)
+    getcolormode();
+    if (color256 && !fullcolor)
+        initpalette();
+
+    // 1段に並べる枚数
+    cols = getconsolecols();
+    g.width = MAX(MIN(width, cols), 1);
+    percol = MAX((cols + GRID_GAP) / (g.width + GRID_GAP), 1);
+    // 文字は縦長 (1:2) なので、正方形に収まる行数を上限にする
+    g.maxline = MAX(g.width / 2, 1);
+    g.threshold_r = threshold_r;
+    g.threshold_g = threshold_g;
+    g.threshold_b = threshold_b;
+    g.ntile = nfiles;
+    g.nthreads = MAX(MIN(nthreads, nfiles), 1);
+    debug("[GRID: OK] tiles=%u width=%u percol=%u threads=%u\n", nfiles, g.width, percol, g.nthreads);
+
+    if ((g.tile = (tile_t *)calloc(nfiles, sizeof(tile_t))) == NULL
+        || (g.q = (workq_t *)calloc(g.nthreads, sizeof(workq_t))) == NULL
+        || (w = (gridworker_t *)malloc(sizeof(gridworker_t) * g.nthreads)) == NULL
+        || (th = (pthread_t *)malloc(sizeof(pthread_t) * g.nthreads)) == NULL) {
+        printf("Error: memory allocate\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < nfiles; i++)
+        g.tile[i].path = files[i];
+
+    // 仕事は番号順に各スレッドへ配っておく (上の段から先にそろう)
+    for (i = 0; i < g.nthreads; i++) {
+        if ((g.q[i].idx = (uint32_t *)malloc(sizeof(uint32_t) * (nfiles / g.nthreads + 1))) == NULL) {
+            printf("Error: memory allocate\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&g.q[i].lock, NULL);
+    }
+    for (i = 0; i < nfiles; i++) {
+        workq_t *q = &g.q[i % g.nthreads];
+        q->idx[q->tail++] = i;
+    }
+    pthread_mutex_init(&g.lock, NULL);
+    pthread_cond_init(&g.done, NULL);
+    for (i = 0; i < g.nthreads; i++) {
+        w[i].g = &g;
+        w[i].self = i;
+        if (pthread_create(&th[i], NULL, gridworker, &w[i]) != 0) {
+            printf("Error: thread create\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // 1段ずつ、そろったら出力する
+    obinit(&ob, (size_t)cols * CELL_MAXBYTES * 4);
+    for (row = 0; row * percol < nfiles; row++) {
+        uint32_t i0 = row * percol, n = MIN(percol, nfiles - i0);
+
+        pthread_mutex_lock(&g.lock);
+        for (i = i0; i < i0 + n; i++)
+            while (!g.tile[i].done)
+                pthread_cond_wait(&g.done, &g.lock);
+        pthread_mutex_unlock(&g.lock);
+
+        outputtiles(&g, &g.tile[i0], n, &ob);
+        fflush(stdout);
+        obflush(&ob, STDOUT_FILENO);
+        for (i = i0; i < i0 + n; i++) {
+            xfree(g.tile[i].cell);
+            g.tile[i].cell = NULL;
+        }
+    }
+
+    for (i = 0; i < g.nthreads; i++)
+        pthread_join(th[i], NULL);
+    for (i = 0; i < g.nthreads; i++) {
+        pthread_mutex_destroy(&g.q[i].lock);
+        free(g.q[i].idx);
+    }
+    pthread_mutex_destroy(&g.lock);
+    pthread_cond_destroy(&g.done);
+    obfree(&ob);
+    free(g.tile);
+    free(g.q);
+    free(w);
+    free(th);
+}
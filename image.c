@@ -0,0 +1,143 @@
+/**
+ * image.c
+ * 画像形式の判定と縮小の準備
+ * 先頭のバイトで BMP・JPEG・PNG を見分けてヘッダを読み、コンソールの横幅に合わせて
+ * ピクセル比率を決める。復号は形式ごとのデコーダで1行ずつ行う。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "cbmpviewer.h"
+
+// 画像形式の判定とヘッダ取得
+// 先頭が 0xFF なら JPEG、0x89 なら PNG、それ以外は BMP として読む
+void openimage(FILE *fp, image_t *im) {
+    int ch;
+
+    im->fp = fp;
+    im->jd = NULL;
+    im->pd = NULL;
+    im->scale = 1;
+    if ((ch = getc(fp)) == EOF)
+        fail(CIMAGE_EREAD, "file read");
+    ungetc(ch, fp);
+    if (ch == 0xff) {
+        im->format = IMAGE_JPEG;
+        im->jd = openjpeg(fp, &im->width, &im->height);
+    } else if (ch == 0x89) {
+        im->format = IMAGE_PNG;
+        im->pd = openpng(fp, &im->width, &im->height);
+    } else {
+        im->format = IMAGE_BMP;
+        // 画像ヘッダ取得
+        getbmpheader(fp, &im->fh, &im->ih);
+        showbmpheader(&im->fh, &im->ih);
+        // 画像ヘッダの(このプログラムで対応する)フォーマットチェック
+        checkbmpheader(&im->fh, &im->ih);
+        // ビットフィールドとパレット
+        readbmpformat(fp, &im->fh, &im->ih, &im->bf);
+        im->width = im->bf.width;
+        im->height = im->bf.height;
+    }
+}
+
+// 横 cols 文字に収まるようにピクセル比率を決める
+// maxline が 0 でなければ行数もそれ以下になるよう横幅を狭める
+// JPEG は逆DCT で縮小して復号するので、縮小後の大きさで決め直す
+// 縮小後の大きさは端数のまま (width / scale) にし、最後の列・行の画素は端数の分だけ数える
+// (切り上げた大きさにすると、端の画素を丸ごと数えるぶん画像が引き伸ばされる)
+void scaleimage(image_t *im, consolebmp_t *cbmp, uint32_t cols, uint32_t maxline) {
+    cols = fitscale(cbmp, im->width, im->height, cols, maxline);
+    if (im->format == IMAGE_JPEG) {
+        im->scale = jpegscale(cbmp, im->width, im->height);
+        setscale(cbmp, (double)im->width / im->scale, (double)im->height / im->scale, cols);
+    }
+}
+
+// 幅 width・高さ height の画像が横 cols 文字 (maxline が 0 でなければ maxline 行) に収まるように
+// ピクセル比率を決める (使った横幅を返す)
+uint32_t fitscale(consolebmp_t *cbmp, uint32_t width, uint32_t height, uint32_t cols, uint32_t maxline) {
+    setscale(cbmp, width, height, cols);
+    while (maxline > 0 && cbmp->line > maxline && cols > 1) {
+        cols = MIN(cols - 1, MAX(cols * maxline / cbmp->line, 1));
+        setscale(cbmp, width, height, cols);
+    }
+    return cols;
+}
+
+// 幅 width・高さ height の画像を横 maxw 画素 (maxh が 0 でなければ縦 maxh 画素) 以下に縮小するように
+// ピクセル比率を決める (1画素をセル1つとして扱い、縦横比は変えない・拡大はしない)
+void setpixelscale(consolebmp_t *cbmp, uint32_t width, uint32_t height, uint32_t maxw, uint32_t maxh) {
+    uint32_t w = MIN(width, MAX(maxw, 1));
+    uint32_t h = MAX((uint32_t)((double)height * w / width + 0.5), 1);
+
+    if (maxh > 0 && h > maxh) {
+        h = maxh;
+        w = MIN(MAX((uint32_t)((double)width * h / height + 0.5), 1), width);
+    }
+    cbmp->half = 0;
+    cbmp->letter = w;
+    cbmp->line = h;
+    cbmp->bpl_c = (double)width / w;
+    cbmp->bpl_r = (double)height / h;
+    debug("[BMP/PIXEL: OK] bpl_c=%g,bpl_r=%g,width=%u,height=%u\n", cbmp->bpl_c, cbmp->bpl_r, w, h);
+}
+
+// 画像で出力するときのピクセル比率を決める (JPEG は縮小して復号した大きさで決め直す)
+void scalepixels(image_t *im, consolebmp_t *cbmp, uint32_t maxw, uint32_t maxh) {
+    setpixelscale(cbmp, im->width, im->height, maxw, maxh);
+    if (im->format == IMAGE_JPEG) {
+        im->scale = jpegscale(cbmp, im->width, im->height);
+        cbmp->bpl_c = (double)im->width / im->scale / cbmp->letter;
+        cbmp->bpl_r = (double)im->height / im->scale / cbmp->line;
+    }
+}
+
+// 画像を1行ずつ復号して rd に足し込む (rd はここで初期化し、呼び出し側で解放する)
+// 縮小して復号した JPEG は端数を切り上げた画素数が届くが、セルが覆うのは width / scale までで、
+// 最後の列・行は rd がその端数の分だけ数える
+// ob が NULL でなければ完成した行から fd に出力する
+// 行が上から順に届く BMP を出力するときは、累積をセル行2つ分だけ持つ (rd->cell には残らない)
+void decodeimage(image_t *im, const consolebmp_t *cbmp, reducer_t *rd, outbuf_t *ob, int fd) {
+    uint32_t width = (im->width + im->scale - 1) / im->scale, height = (im->height + im->scale - 1) / im->scale;
+
+    if (ob != NULL && im->format == IMAGE_BMP && bmpinorder(im->fp, &im->bf))
+        initringreducer(rd, cbmp, width, height, ob);
+    else
+        initreducer(rd, cbmp, width, height);
+    if (im->format == IMAGE_JPEG)
+        decodejpeg(im->jd, im->scale, rd, ob, fd);
+    else if (im->format == IMAGE_PNG)
+        decodepng(im->pd, rd, ob, fd);
+    else
+        streambmp(im->fp, &im->bf, rd, ob, fd);
+}
+
+// 積分画像を使えるか
+// 積分画像のサイズがメモリの上限 limit 以下で、1セル分の総和が 32bit に収まること
+int satfits(const consolebmp_t *cbmp, int32_t width, int32_t height, uint64_t limit) {
+    double satbytes = ((double)width + 1) * ((double)height + 1) * 3 * sizeof(uint32_t);
+
+    if (satbytes > (double)limit)
+        return 0;
+    return (ceil(cbmp->bpl_c) + 1) * (ceil(cbmp->bpl_r) + 1) * 255 <= (double)UINT32_MAX;
+}
+
+// コンソール文字とピクセル比率の決定
+// ピクセル比率とはbmpでの何ピクセルがコンソールでの1文字になるか
+// 横幅いっぱいに合わせるので比率は整数とは限らない (最小値は1)
+// コンソールでの文字は縦横比が2:1になることも注意
+// 半ブロック (cbmp->half) では1文字を上下に分けるので、縦の比率は半文字分で横と同じになる
+// 行数は四捨五入して、画像の下端まで覆うように縦の比率を合わせ直す
+// 幅・高さは縮小して復号した画像では端数のある大きさになる (横の文字数は幅の整数部分以下)
+// 参照: pixel_letter.example
+void setscale(consolebmp_t *cbmp, double width, double height, uint32_t cols) {
+    cbmp->letter = MIN((uint32_t)width, cols);
+    cbmp->bpl_c = (double)width / cbmp->letter;
+    cbmp->line = MAX((uint32_t)(height / (cbmp->bpl_c * 2) + 0.5), 1);
+    cbmp->bpl_r = (double)height / (cbmp->line * cbmpsub(cbmp));
+    debug("[BMP/LETTER: OK] bpl_c=%g,bpl_r=%g,letter=%u,line=%u\n", cbmp->bpl_c, cbmp->bpl_r, cbmp->letter, cbmp->line);
+}
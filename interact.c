@@ -0,0 +1,405 @@
+/**
+ * interact.c
+ * 対話モード (--interactive) と範囲表示 (--crop)
+ * 通常は最初に1回だけ画像を復号して画像ピラミッド (pyramid.c) を作り、
+ * 端末の大きさが変わったとき (SIGWINCH) やズーム・移動のキーを押したときは
+ * 復号し直さずにピラミッドの近い段から描き直す。
+ * ピラミッドがメモリの上限に収まらない巨大な無圧縮の BMP と --crop の指定があるときは、
+ * 表示する範囲にかかるタイル (tile.c) だけを読んで描く。
+ * キー: + / = 拡大、- 縮小、0 元に戻す、矢印 / h j k l 移動、q / ESC 終了
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "cbmpviewer.h"
+
+// 1回のキーで拡大・縮小する倍率
+#define ZOOM_STEP 1.25
+// 1回のキーで移動する量 (表示している範囲に対する割合)
+#define PAN_STEP 0.25
+
+// 表示の状態
+// ピラミッドなら zoom (画像全体が収まる大きさに対する倍率)、タイルなら scale (1文字の横幅にあたる画素数) で大きさを決める
+typedef struct TAG_VIEW {
+    int tiled;              // タイルで表示する
+    pyramid_t py;
+    tilecache_t tc;
+    uint32_t width;         // 元画像の大きさ
+    uint32_t height;
+    double cx, cy;          // 表示する範囲の中心 (画像の幅・高さに対する割合)
+    double zoom;
+    double scale;
+    double cx0, cy0, zoom0, scale0; // 0 で戻す最初の状態 (scale0 が 0 なら端末に合わせて決め直す)
+    const croprect_t *crop; // --crop の範囲 (NULL なら無し)
+} view_t;
+
+static struct termios savedterm;
+static int rawterm = 0;
+static volatile sig_atomic_t resized = 1;
+
+// 単調増加の時計 (秒)
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 端末の大きさが変わった
+static void onwinch(int sig) {
+    (void)sig;
+    resized = 1;
+}
+
+// 端末の設定を元に戻す (終了するときは必ず通る)
+static void restoreterm(void) {
+    static const char leave[] = "\x1b[0m\x1b[?25h\x1b[?1049l";
+
+    if (!rawterm)
+        return;
+    rawterm = 0;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &savedterm);
+    if (write(STDOUT_FILENO, leave, sizeof(leave) - 1) < 0)
+        return;
+}
+
+// Ctrl-C などで終わるときも端末を元に戻してから終わる
+static void onstop(int sig) {
+    restoreterm();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// キーを1文字ずつ読めるようにして、代替画面に切り替えてカーソルを隠す
+static void rawmode(void) {
+    static const char enter[] = "\x1b[?1049h\x1b[?25l";
+    struct termios t;
+
+    tcgetattr(STDIN_FILENO, &savedterm);
+    t = savedterm;
+    t.c_lflag &= ~(ICANON | ECHO);
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &t);
+    rawterm = 1;
+    atexit(restoreterm);
+    signal(SIGINT, onstop);
+    signal(SIGTERM, onstop);
+    signal(SIGHUP, onstop);
+    if (write(STDOUT_FILENO, enter, sizeof(enter) - 1) < 0)
+        return;
+}
+
+// 端末の文字数と行数 (COLUMNS は大きさが変わっても追従しないので見ない)
+static void termsize(uint32_t *cols, uint32_t *rows) {
+    struct winsize win;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &win) != 0 || win.ws_col == 0 || win.ws_row == 0) {
+        win.ws_col = 80;
+        win.ws_row = 24;
+    }
+    *cols = win.ws_col;
+    *rows = win.ws_row;
+}
+
+// 色数・しきい値の設定 (近似色探索テーブルもここで作る)
+static void initcbmp(consolebmp_t *cbmp, uint8_t threshold_r, uint8_t threshold_g, uint8_t threshold_b) {
+    getcolormode();
+    if (color256 && !fullcolor)
+        initpalette();
+    memset(cbmp, 0, sizeof(*cbmp));
+    cbmp->half = halfblock;
+    cbmp->color256 = color256;
+    cbmp->fullcolor = fullcolor;
+    cbmp->threshold_r = threshold_r;
+    cbmp->threshold_g = threshold_g;
+    cbmp->threshold_b = threshold_b;
+}
+
+// 元画像の中に収まるように範囲の左上を決める
+static uint32_t clampedge(double center, uint32_t size, uint32_t total) {
+    return (uint32_t)MIN(MAX(center * total - size / 2.0, 0.0), (double)(total - size));
+}
+
+// タイルで表示する範囲 (端末の cols x lines 文字分、縦は1文字が横の2倍)
+static void tilerect(const view_t *v, uint32_t cols, uint32_t lines, uint32_t *x0, uint32_t *y0, uint32_t *w, uint32_t *h) {
+    *w = MIN(MAX((uint32_t)(cols * v->scale + 0.5), 1), v->width);
+    *h = MIN(MAX((uint32_t)(lines * 2 * v->scale + 0.5), 1), v->height);
+    *x0 = clampedge(v->cx, *w, v->width);
+    *y0 = clampedge(v->cy, *h, v->height);
+}
+
+// 画像全体が収まる scale
+static double fitscale_tiles(const view_t *v, uint32_t cols, uint32_t lines) {
+    return MAX(MAX((double)v->width / cols, (double)v->height / (lines * 2)), 1.0);
+}
+
+// 1画面分を描く (最後の行は状態の表示)
+static void draw(view_t *v, consolebmp_t *cbmp, outbuf_t *ob) {
+    reducer_t rd;
+    uint32_t cols, rows, lines, x0, y0, w, h, k = 0;
+    double t = now();
+    int n;
+
+    termsize(&cols, &rows);
+    lines = MAX(rows, 2) - 1;
+    if (v->tiled) {
+        // 最初は --crop の範囲か、1文字に1画素の等倍で中心を表示する
+        if (v->scale0 == 0) {
+            v->scale0 = v->crop != NULL ? MAX(MAX((double)v->crop->width / cols, (double)v->crop->height / (lines * 2)), 1.0) : 1.0;
+            v->scale = v->scale0;
+        }
+        v->scale = MIN(v->scale, fitscale_tiles(v, cols, lines));
+        tilerect(v, cols, lines, &x0, &y0, &w, &h);
+        rendertiles(&v->tc, cbmp, x0, y0, w, h, cols, lines, &rd);
+    } else {
+        k = renderpyramid(&v->py, cbmp, v->zoom, v->cx, v->cy, cols, lines, &rd);
+    }
+    obreserve(ob, 16);
+    obputlit(ob, "\x1b[H\x1b[2J");
+    outputlines(rd.cell, cbmp, 0, cbmp->line, ob);
+    freereducer(&rd);
+    obreserve(ob, 200);
+    if (v->tiled)
+        n = snprintf(ob->buf + ob->len, 200, "\x1b[0m%ux%u+%u+%u 1:%.2f tiles %u (hit %llu miss %llu prefetch %llu) %.1fms  +/-: zoom  arrows: pan  0: reset  q: quit",
+                     w, h, x0, y0, v->scale, v->tc.count, (unsigned long long)v->tc.hits, (unsigned long long)v->tc.misses,
+                     (unsigned long long)v->tc.prefetched, (now() - t) * 1e3);
+    else
+        n = snprintf(ob->buf + ob->len, 200, "\x1b[0mx%.2f level %u (%ux%u) %.1fms  +/-: zoom  arrows: pan  0: reset  q: quit",
+                     v->zoom, k, v->py.level[k].width, v->py.level[k].height, (now() - t) * 1e3);
+    ob->len += MIN(n, MIN(199, (int)cols + 4));
+    obflush(ob, STDOUT_FILENO);
+
+    // 周りのタイルを先読みしておく
+    if (v->tiled)
+        prefetchtiles(&v->tc, x0, y0, w, h);
+}
+
+// 拡大 (dir が 1)・縮小 (-1)・元に戻す (0)
+static void zoomview(view_t *v, int dir) {
+    uint32_t cols, rows, lines;
+    double zmax;
+
+    termsize(&cols, &rows);
+    lines = MAX(rows, 2) - 1;
+    if (dir == 0) {
+        v->cx = v->cx0;
+        v->cy = v->cy0;
+        v->zoom = v->zoom0;
+        v->scale = v->scale0;
+    } else if (v->tiled) {
+        // 1文字に1画素より細かくはしない (縮小の重みは1画素以上が前提)
+        v->scale = dir > 0 ? MAX(v->scale / ZOOM_STEP, 1.0) : MIN(v->scale * ZOOM_STEP, fitscale_tiles(v, cols, lines));
+    } else {
+        // 拡大は一番下の段が横に8画素見えるところまで
+        zmax = MAX(1.0, v->py.level[0].width / 8.0);
+        v->zoom = dir > 0 ? MIN(v->zoom * ZOOM_STEP, zmax) : MAX(v->zoom / ZOOM_STEP, 1.0);
+    }
+}
+
+// 表示している範囲の PAN_STEP 分だけ移動する
+static void panview(view_t *v, int dx, int dy) {
+    uint32_t cols, rows, lines, x0, y0, w, h;
+    double fw, fh;
+
+    if (v->tiled) {
+        termsize(&cols, &rows);
+        lines = MAX(rows, 2) - 1;
+        tilerect(v, cols, lines, &x0, &y0, &w, &h);
+        fw = (double)w / v->width;
+        fh = (double)h / v->height;
+        // 端に寄せて表示しているときは中心も範囲の中心に合わせてから動かす
+        v->cx = (x0 + w / 2.0) / v->width;
+        v->cy = (y0 + h / 2.0) / v->height;
+    } else {
+        fw = fh = 1.0 / v->zoom;
+    }
+    v->cx = MIN(MAX(v->cx + dx * PAN_STEP * fw, fw / 2), 1.0 - fw / 2);
+    v->cy = MIN(MAX(v->cy + dy * PAN_STEP * fh, fh / 2), 1.0 - fh / 2);
+}
+
+// 対話モードのプロシージャ
+void interactproc(char *filename, const croprect_t *crop, uint8_t threshold_r, uint8_t threshold_g, uint8_t threshold_b) {
+    FILE *fp;
+    image_t im;
+    view_t v;
+    consolebmp_t cbmp;
+    outbuf_t ob;
+    struct pollfd pfd;
+    char key[32];
+    ssize_t n, i;
+    int quit = 0, redraw;
+
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) {
+        printf("Error: --interactive needs a terminal\n");
+        exit(EXIT_FAILURE);
+    }
+    initcbmp(&cbmp, threshold_r, threshold_g, threshold_b);
+
+    if ((fp = fopen(filename, "rb")) == NULL) {
+        printf("Error: file open\n");
+        exit(EXIT_FAILURE);
+    }
+    openimage(fp, &im);
+    memset(&v, 0, sizeof(v));
+    v.width = im.width;
+    v.height = im.height;
+    v.crop = crop;
+    v.cx = v.cy = 0.5;
+    v.zoom = 1.0;
+    if (crop != NULL) {
+        v.cx = (crop->x + crop->width / 2.0) / im.width;
+        v.cy = (crop->y + crop->height / 2.0) / im.height;
+        v.zoom = MAX(MIN((double)im.width / crop->width, (double)im.height / crop->height), 1.0);
+    }
+    // 無圧縮の BMP は、範囲の指定があるかピラミッドがメモリの上限に収まらなければタイルで表示する
+    // それ以外は1回だけ復号してピラミッドを作る
+    v.tiled = im.format == IMAGE_BMP && im.bf.compression != BI_RLE8 && im.bf.compression != BI_RLE4
+              && (crop != NULL || (double)im.width * im.height * PYRAMID_DECODEBYTES > (double)memlimit);
+    if (v.tiled) {
+        inittilecache(&v.tc, fp, &im.bf, memlimit);
+    } else {
+        initpyramid(&v.py, &im, memlimit);
+        fclose(fp);
+    }
+    v.cx0 = v.cx;
+    v.cy0 = v.cy;
+    v.zoom0 = v.zoom;
+
+    obinit(&ob, 65536);
+    rawmode();
+    signal(SIGWINCH, onwinch);
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+    while (!quit) {
+        if (resized) {
+            resized = 0;
+            draw(&v, &cbmp, &ob);
+        }
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if ((n = read(STDIN_FILENO, key, sizeof(key))) <= 0)
+            break;
+        for (i = 0; i < n; i++) {
+            redraw = 1;
+            switch (key[i]) {
+            case '+':
+            case '=':
+                zoomview(&v, 1);
+                break;
+            case '-':
+            case '_':
+                zoomview(&v, -1);
+                break;
+            case '0':
+                zoomview(&v, 0);
+                break;
+            case 'h':
+                panview(&v, -1, 0);
+                break;
+            case 'l':
+                panview(&v, 1, 0);
+                break;
+            case 'k':
+                panview(&v, 0, -1);
+                break;
+            case 'j':
+                panview(&v, 0, 1);
+                break;
+            case 'q':
+                quit = 1;
+                break;
+            case '\x1b':
+                // ESC だけなら終了、矢印キー (ESC [ A など) は移動、その他のシーケンスは読み飛ばす
+                redraw = 0;
+                if (i + 1 == n) {
+                    quit = 1;
+                } else if (key[i + 1] == '[' || key[i + 1] == 'O') {
+                    for (i += 2; i < n && (key[i] < 0x40 || key[i] > 0x7e); i++)
+                        ;
+                    if (i < n && key[i] >= 'A' && key[i] <= 'D') {
+                        panview(&v, key[i] == 'C' ? 1 : key[i] == 'D' ? -1 : 0, key[i] == 'B' ? 1 : key[i] == 'A' ? -1 : 0);
+                        redraw = 1;
+                    }
+                }
+                break;
+            default:
+                redraw = 0;
+                break;
+            }
+            if (redraw)
+                resized = 1;
+        }
+    }
+
+    restoreterm();
+    obfree(&ob);
+    if (v.tiled) {
+        freetilecache(&v.tc);
+        fclose(fp);
+    } else {
+        freepyramid(&v.py);
+    }
+}
+
+// "WxH+X+Y" 形式の範囲を解析する (+X+Y は省略できる)
+void parsecrop(const char *s, croprect_t *crop) {
+    crop->x = crop->y = 0;
+    if (sscanf(s, "%ux%u+%u+%u", &crop->width, &crop->height, &crop->x, &crop->y) < 2
+        || crop->width == 0 || crop->height == 0) {
+        printf("Error: invalid crop `%s` (WxH+X+Y)\n", s);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// 範囲表示のプロシージャ
+// 無圧縮の BMP の crop の範囲にかかるタイルだけを読み、コンソールの横幅に合わせて出力する
+void cropproc(char *filename, const croprect_t *crop, uint8_t threshold_r, uint8_t threshold_g, uint8_t threshold_b) {
+    FILE *fp;
+    image_t im;
+    tilecache_t tc;
+    consolebmp_t cbmp;
+    reducer_t rd;
+    outbuf_t ob;
+    uint32_t w, h;
+
+    initcbmp(&cbmp, threshold_r, threshold_g, threshold_b);
+    if ((fp = fopen(filename, "rb")) == NULL) {
+        printf("Error: file open\n");
+        exit(EXIT_FAILURE);
+    }
+    openimage(fp, &im);
+    if (im.format != IMAGE_BMP) {
+        printf("Error: --crop needs a bitmap\n");
+        exit(EXIT_FAILURE);
+    }
+    if (crop->x >= im.width || crop->y >= im.height) {
+        printf("Error: crop is outside the image (%ux%u)\n", im.width, im.height);
+        exit(EXIT_FAILURE);
+    }
+    w = MIN(crop->width, im.width - crop->x);
+    h = MIN(crop->height, im.height - crop->y);
+    inittilecache(&tc, fp, &im.bf, memlimit);
+    rendertiles(&tc, &cbmp, crop->x, crop->y, w, h, getconsolecols(), 0, &rd);
+    obinit(&ob, (size_t)cbmp.letter * CELL_MAXBYTES * 4);
+    outputlines(rd.cell, &cbmp, 0, cbmp.line, &ob);
+    fflush(stdout);
+    obflush(&ob, STDOUT_FILENO);
+    debug("[CROP: OK] %ux%u+%u+%u tiles=%llu\n", w, h, crop->x, crop->y, (unsigned long long)tc.misses);
+    obfree(&ob);
+    freereducer(&rd);
+    freetilecache(&tc);
+    fclose(fp);
+}
@@ -0,0 +1,868 @@
+/**
+ * jpeg.c
+ * JPEG デコーダ (ベースライン・プログレッシブ、ハフマン符号のみ)
+ * 逆DCT の段階で 1/2, 1/4, 1/8 に縮小しながら復号し、行ストリーム縮小 (reduce.c) に渡す。
+ * 縮小した逆DCT は元の解像度で復号してから s×s 画素ずつ平均したのと同じ値になるよう、
+ * 基底関数を s 画素ずつ平均した行列を使う。1/8 なら DC 成分だけで決まるので
+ * 係数は DC だけ持ち、プログレッシブの AC スキャンは復号せずに読み飛ばす。
+ * ベースラインの (全成分を1スキャンにまとめた) 画像は MCU 1行ずつ出力するので
+ * 画像全体はメモリに載せない。プログレッシブは全ブロックの係数を持つ。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "cbmpviewer.h"
+
+// マーカー
+#define M_SOF0  0xc0
+#define M_SOF1  0xc1
+#define M_SOF2  0xc2
+#define M_DHT   0xc4
+#define M_RST0  0xd0
+#define M_RST7  0xd7
+#define M_SOI   0xd8
+#define M_EOI   0xd9
+#define M_SOS   0xda
+#define M_DQT   0xdb
+#define M_DRI   0xdd
+#define M_APP14 0xee
+
+// ハフマン符号を一度に引く表のビット数
+#define HUFF_LOOKBITS 9
+
+// ハフマン表
+typedef struct TAG_JHUFF {
+    uint16_t look[1 << HUFF_LOOKBITS]; // 先頭 9bit で引ける符号 (長さ << 8 | 値)、無ければ 0
+    int32_t maxcode[18];               // 長さごとの最大の符号 (無ければ -1)
+    int32_t valoff[17];                // 長さごとの符号から値の添字へのオフセット
+    uint8_t val[256];
+} jhuff_t;
+
+// 色成分
+typedef struct TAG_JCOMP {
+    uint8_t id;
+    uint8_t h, v;       // サンプリング係数
+    uint8_t tq;         // 量子化テーブル番号
+    uint8_t td, ta;     // スキャン中の DC / AC ハフマン表番号
+    uint32_t bw, bh;    // 係数を持つブロック数 (MCU の境界まで切り上げ)
+    uint32_t cw, ch;    // 画像にかかるブロック数 (非インターリーブのスキャンはこれだけ回る)
+    int16_t *coef;      // 全ブロックの係数 (プログレッシブ・複数スキャンのとき)
+    int32_t dcpred;     // DC の予測値
+    uint8_t *plane;     // MCU 1行分の逆DCT の結果
+    uint32_t *xi;       // 出力の列ごとの plane の列 (色差の拡大用)
+} jcomp_t;
+
+// デコーダ
+struct TAG_JPEG {
+    FILE *fp;
+    uint32_t width, height;
+    int progressive;
+    int ncomp;
+    int rgb;            // 成分が RGB (YCbCr でない)
+    int adobe;          // Adobe APP14 の transform (無ければ -1)
+    jcomp_t comp[3];
+    uint8_t hmax, vmax;
+    uint32_t mcux, mcuy;        // MCU の数
+    uint16_t qt[4][64];         // 量子化テーブル (自然順)
+    jhuff_t dc[4], ac[4];
+    uint32_t restart;           // リスタート間隔 (MCU 数)
+    uint32_t bitbuf;            // ビットバッファ (上位から詰める)
+    int nbits;
+    int marker;                 // エントロピー符号化データの途中で見つけたマーカー
+    uint32_t eobrun;            // プログレッシブの EOB ラン
+    int ns, sc[3];              // スキャンの成分
+    int ss, se, ah, al;         // スキャンのスペクトル選択・逐次近似
+    uint32_t n;                 // 1ブロックあたりの出力の画素数 (縦横それぞれ 8 / scale)
+    uint32_t coefn;             // 1ブロックあたりに持つ係数の数 (n が 1 なら DC だけ)
+    float idct[8][8];           // 縮小逆DCT の行列 (出力 i、周波数 u)
+    uint32_t outw, outh;        // 出力の幅・高さ
+};
+
+// ジグザグ順から自然順への変換
+static const uint8_t zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// YCbCr から RGB への変換テーブル (16bit 固定小数点)
+static int32_t cr2r[256], cb2b[256], cr2g[256], cb2g[256];
+static pthread_once_t ycconce = PTHREAD_ONCE_INIT;
+
+static void corrupt(void) {
+    fail(CIMAGE_EFORMAT, "corrupt jpeg");
+}
+
+static void unsupported(void) {
+    fail(CIMAGE_EUNSUPPORTED, "unsupported jpeg");
+}
+
+// 1byte 読む (ヘッダ用、エラー処理付き)
+static int readbyte(jpeg_t *jd) {
+    int c;
+
+    if ((c = getc(jd->fp)) == EOF)
+        fail(CIMAGE_EREAD, "file read");
+    return c;
+}
+
+// 2byte (ビッグエンディアン) 読む
+static uint32_t readword(jpeg_t *jd) {
+    uint32_t c = readbyte(jd);
+
+    return (c << 8) | readbyte(jd);
+}
+
+// n byte 読み飛ばす
+static void skipbytes(jpeg_t *jd, uint32_t n) {
+    while (n-- > 0)
+        readbyte(jd);
+}
+
+// 次のマーカーを読む (マーカーでないバイトは読み飛ばす)
+static int readmarker(jpeg_t *jd) {
+    int c;
+
+    if (jd->marker) {
+        c = jd->marker;
+        jd->marker = 0;
+        return c;
+    }
+    for (;;) {
+        while (readbyte(jd) != 0xff)
+            ;
+        while ((c = readbyte(jd)) == 0xff)
+            ;
+        if (c != 0)
+            return c;
+    }
+}
+
+// ビットバッファを 25bit 以上にする
+// マーカーに当たったらそこで止め、以降は 0 を詰める
+static void fillbits(jpeg_t *jd) {
+    int c, d;
+
+    while (jd->nbits <= 24) {
+        c = 0;
+        if (!jd->marker) {
+            if ((c = getc(jd->fp)) == EOF) {
+                jd->marker = M_EOI;
+                c = 0;
+            } else if (c == 0xff) {
+                while ((d = getc(jd->fp)) == 0xff)
+                    ;
+                if (d != 0) {
+                    jd->marker = d == EOF ? M_EOI : d;
+                    c = 0;
+                }
+            }
+        }
+        jd->bitbuf |= (uint32_t)c << (24 - jd->nbits);
+        jd->nbits += 8;
+    }
+}
+
+// n bit 読む (n は 16 以下)
+static inline uint32_t getbits(jpeg_t *jd, int n) {
+    uint32_t v;
+
+    if (n == 0)
+        return 0;
+    if (jd->nbits < n)
+        fillbits(jd);
+    v = jd->bitbuf >> (32 - n);
+    jd->bitbuf <<= n;
+    jd->nbits -= n;
+    return v;
+}
+
+// n bit の値を符号付きに戻す
+static inline int32_t extend(uint32_t v, int n) {
+    return n == 0 ? 0 : (v < (1u << (n - 1)) ? (int32_t)v - (1 << n) + 1 : (int32_t)v);
+}
+
+// ハフマン符号を1つ読む
+static inline int decodehuff(jpeg_t *jd, const jhuff_t *hf) {
+    uint32_t e, code;
+    int l;
+
+    if (jd->nbits < 16)
+        fillbits(jd);
+    if ((e = hf->look[jd->bitbuf >> (32 - HUFF_LOOKBITS)]) != 0) {
+        jd->bitbuf <<= e >> 8;
+        jd->nbits -= e >> 8;
+        return e & 0xff;
+    }
+    for (l = HUFF_LOOKBITS + 1; l <= 16; l++) {
+        code = jd->bitbuf >> (32 - l);
+        if ((int32_t)code <= hf->maxcode[l]) {
+            jd->bitbuf <<= l;
+            jd->nbits -= l;
+            return hf->val[code + hf->valoff[l]];
+        }
+    }
+    corrupt();
+    return 0;
+}
+
+// DQT: 量子化テーブル
+static void readdqt(jpeg_t *jd) {
+    int32_t len = readword(jd) - 2;
+    int pq, tq, k;
+
+    while (len > 0) {
+        pq = readbyte(jd);
+        tq = pq & 15;
+        pq >>= 4;
+        if (tq > 3 || pq > 1)
+            corrupt();
+        for (k = 0; k < 64; k++)
+            jd->qt[tq][zigzag[k]] = pq ? readword(jd) : readbyte(jd);
+        len -= 1 + 64 * (pq + 1);
+    }
+    if (len != 0)
+        corrupt();
+}
+
+// DHT: ハフマン表
+static void readdht(jpeg_t *jd) {
+    int32_t len = readword(jd) - 2;
+    uint8_t bits[17];
+    jhuff_t *hf;
+    int tc, th, l, i, j, total, k;
+    uint32_t code;
+
+    while (len > 0) {
+        tc = readbyte(jd);
+        th = tc & 15;
+        tc >>= 4;
+        if (th > 3 || tc > 1)
+            corrupt();
+        hf = tc ? &jd->ac[th] : &jd->dc[th];
+        total = 0;
+        for (l = 1; l <= 16; l++)
+            total += bits[l] = readbyte(jd);
+        if (total > 256)
+            corrupt();
+        for (i = 0; i < total; i++)
+            hf->val[i] = readbyte(jd);
+        len -= 17 + total;
+
+        // 符号の割り当て (短い符号から順に連番)
+        memset(hf->look, 0, sizeof(hf->look));
+        code = 0;
+        k = 0;
+        for (l = 1; l <= 16; l++) {
+            hf->valoff[l] = k - (int32_t)code;
+            for (i = 0; i < bits[l]; i++, code++, k++) {
+                if (code >= (1u << l))
+                    corrupt();
+                if (l <= HUFF_LOOKBITS)
+                    for (j = 0; j < (1 << (HUFF_LOOKBITS - l)); j++)
+                        hf->look[(code << (HUFF_LOOKBITS - l)) | j] = (l << 8) | hf->val[k];
+            }
+            hf->maxcode[l] = bits[l] ? (int32_t)code - 1 : -1;
+            code <<= 1;
+        }
+        hf->maxcode[17] = INT32_MAX;
+    }
+    if (len != 0)
+        corrupt();
+}
+
+// APP14: Adobe の色変換の有無
+static void readapp14(jpeg_t *jd) {
+    uint32_t len = readword(jd) - 2;
+    uint8_t b[12];
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        if (i < sizeof(b))
+            b[i] = readbyte(jd);
+        else
+            readbyte(jd);
+    }
+    if (len >= sizeof(b) && memcmp(b, "Adobe", 5) == 0)
+        jd->adobe = b[11];
+}
+
+// SOF: フレームヘッダ
+static void readsof(jpeg_t *jd, int m) {
+    uint32_t len = readword(jd);
+    jcomp_t *c;
+    int i;
+
+    jd->progressive = m == M_SOF2;
+    if (readbyte(jd) != 8)
+        unsupported();
+    jd->height = readword(jd);
+    jd->width = readword(jd);
+    jd->ncomp = readbyte(jd);
+    if (jd->width == 0 || jd->height == 0)
+        unsupported();
+    if ((jd->ncomp != 1 && jd->ncomp != 3) || len != 8 + 3 * (uint32_t)jd->ncomp)
+        unsupported();
+    jd->hmax = jd->vmax = 1;
+    for (i = 0; i < jd->ncomp; i++) {
+        c = &jd->comp[i];
+        c->id = readbyte(jd);
+        c->h = readbyte(jd);
+        c->v = c->h & 15;
+        c->h >>= 4;
+        c->tq = readbyte(jd) & 3;
+        if (c->h < 1 || c->h > 4 || c->v < 1 || c->v > 4)
+            corrupt();
+        // 1成分ならサンプリング係数は関係ない (MCU は 1ブロック)
+        if (jd->ncomp == 1)
+            c->h = c->v = 1;
+        jd->hmax = MAX(jd->hmax, c->h);
+        jd->vmax = MAX(jd->vmax, c->v);
+    }
+    jd->mcux = (jd->width + 8 * jd->hmax - 1) / (8 * jd->hmax);
+    jd->mcuy = (jd->height + 8 * jd->vmax - 1) / (8 * jd->vmax);
+    for (i = 0; i < jd->ncomp; i++) {
+        c = &jd->comp[i];
+        c->bw = jd->mcux * c->h;
+        c->bh = jd->mcuy * c->v;
+        c->cw = ((jd->width * c->h + jd->hmax - 1) / jd->hmax + 7) / 8;
+        c->ch = ((jd->height * c->v + jd->vmax - 1) / jd->vmax + 7) / 8;
+    }
+}
+
+// ヘッダを SOF まで読む (先頭の SOI は呼び出し側で判定済み)
+jpeg_t *openjpeg(FILE *fp, uint32_t *width, uint32_t *height) {
+    jpeg_t *jd;
+    int m;
+
+    jd = (jpeg_t *)xcalloc(1, sizeof(jpeg_t));
+    jd->fp = fp;
+    jd->adobe = -1;
+    if (readbyte(jd) != 0xff || readbyte(jd) != M_SOI)
+        corrupt();
+
+    for (;;) {
+        m = readmarker(jd);
+        if (m == M_SOF0 || m == M_SOF1 || m == M_SOF2) {
+            readsof(jd, m);
+            break;
+        } else if ((m >= 0xc3 && m <= 0xcf && m != M_DHT && m != 0xc8 && m != 0xcc) || m == M_EOI || m == M_SOS) {
+            // 可逆・階層・算術符号は扱わない
+            unsupported();
+        } else if (m == M_DQT) {
+            readdqt(jd);
+        } else if (m == M_DHT) {
+            readdht(jd);
+        } else if (m == M_DRI) {
+            readword(jd);
+            jd->restart = readword(jd);
+        } else if (m == M_APP14) {
+            readapp14(jd);
+        } else if (m != M_SOI && (m < M_RST0 || m > M_RST7)) {
+            skipbytes(jd, readword(jd) - 2);
+        }
+    }
+
+    // 成分の色空間 (JFIF なら YCbCr、Adobe の transform 0 や成分 ID が 'R' 'G' 'B' なら RGB)
+    if (jd->ncomp == 3)
+        jd->rgb = jd->adobe == 0 || (jd->comp[0].id == 'R' && jd->comp[1].id == 'G' && jd->comp[2].id == 'B');
+    debug("[JPEG: OK] %ux%u %s comp=%d sampling=%ux%u\n", jd->width, jd->height,
+          jd->progressive ? "progressive" : "baseline", jd->ncomp, jd->hmax, jd->vmax);
+    *width = jd->width;
+    *height = jd->height;
+    return jd;
+}
+
+// 縮小率 s で1セルの幅 bpl がちょうど割り切れるか
+static int divisible(double bpl, uint32_t s) {
+    return fabs(bpl / s - round(bpl / s)) < 1e-9;
+}
+
+// 復号する縮小率 (1, 2, 4, 8)
+// セルの境界が縮小後の画素の境界に揃うなら、縮小前の画素を平均したのと同じになるので
+// 縮小後の画像がセルの数 (横 letter、縦 line × 縦のサンプル数) を下回らない範囲で最も小さくする
+// 揃わないときは境界の画素が隣のセルと混ざるので、1セルに縦横4画素以上残す
+uint32_t jpegscale(const consolebmp_t *cbmp, uint32_t width, uint32_t height) {
+    uint32_t s, rows = cbmp->line * cbmpsub(cbmp);
+
+    for (s = 8; s > 1; s /= 2) {
+        if (divisible(cbmp->bpl_c, s) && divisible(cbmp->bpl_r, s) && width / s >= cbmp->letter && height / s >= rows)
+            break;
+        if (width / s >= 4 * cbmp->letter && height / s >= 4 * rows)
+            break;
+    }
+    return s;
+}
+
+// 縮小逆DCT の行列
+// 出力 i は元の画素 i*s ~ (i+1)*s - 1 の平均なので、基底関数をその範囲で平均しておく
+static void initidct(jpeg_t *jd) {
+    uint32_t s = 8 / jd->n, i, u, x;
+    double sum;
+
+    for (i = 0; i < jd->n; i++) {
+        for (u = 0; u < 8; u++) {
+            sum = 0;
+            for (x = i * s; x < (i + 1) * s; x++)
+                sum += cos((2 * x + 1) * u * M_PI / 16);
+            jd->idct[i][u] = (float)(sum / s * (u == 0 ? M_SQRT1_2 : 1.0) / 2);
+        }
+    }
+}
+
+// 色変換テーブルの構築
+static void initycc(void) {
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        cr2r[i] = (int32_t)lround(1.402 * 65536) * (i - 128);
+        cb2b[i] = (int32_t)lround(1.772 * 65536) * (i - 128);
+        cr2g[i] = -(int32_t)lround(0.714136 * 65536) * (i - 128);
+        cb2g[i] = -(int32_t)lround(0.344136 * 65536) * (i - 128) + 32768;
+    }
+}
+
+static inline uint8_t clamp255(int32_t v) {
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// 1ブロックを逆DCT して n×n 画素を out に書く
+static void idctblock(const jpeg_t *jd, const int16_t *coef, const uint16_t *q, uint8_t *out, size_t stride) {
+    float tmp[8][8], f[8], sum;
+    uint32_t n = jd->n, row, col, x, y, used = 0;
+    int nz;
+
+    if (jd->coefn == 1) {
+        out[0] = clamp255((int32_t)lroundf(coef[0] * q[0] / 8.0f) + 128);
+        return;
+    }
+    // 横方向 (全部 0 の行は飛ばす)
+    for (row = 0; row < 8; row++) {
+        nz = 0;
+        for (col = 0; col < 8; col++) {
+            f[col] = (float)(coef[row * 8 + col] * q[row * 8 + col]);
+            nz |= coef[row * 8 + col];
+        }
+        if (!nz)
+            continue;
+        used |= 1 << row;
+        for (x = 0; x < n; x++) {
+            sum = 0;
+            for (col = 0; col < 8; col++)
+                sum += jd->idct[x][col] * f[col];
+            tmp[row][x] = sum;
+        }
+    }
+    // 縦方向
+    for (y = 0; y < n; y++) {
+        for (x = 0; x < n; x++) {
+            sum = 128.5f;
+            for (row = 0; row < 8; row++)
+                if (used & (1 << row))
+                    sum += jd->idct[y][row] * tmp[row][x];
+            out[y * stride + x] = clamp255((int32_t)floorf(sum));
+        }
+    }
+}
+
+// ベースライン (逐次) の1ブロックの復号
+static void decodeseq(jpeg_t *jd, jcomp_t *c, int16_t *blk) {
+    int s, r, k;
+    int32_t v;
+
+    memset(blk, 0, sizeof(int16_t) * jd->coefn);
+    s = decodehuff(jd, &jd->dc[c->td]);
+    c->dcpred += extend(getbits(jd, s), s);
+    blk[0] = c->dcpred;
+    for (k = 1; k < 64; ) {
+        s = decodehuff(jd, &jd->ac[c->ta]);
+        r = s >> 4;
+        s &= 15;
+        if (s) {
+            k += r;
+            v = extend(getbits(jd, s), s);
+            if (k > 63)
+                corrupt();
+            if (jd->coefn == 64)
+                blk[zigzag[k]] = v;
+            k++;
+        } else if (r == 15) {
+            k += 16;
+        } else {
+            break;
+        }
+    }
+}
+
+// プログレッシブの DC スキャン
+static void decodedc(jpeg_t *jd, jcomp_t *c, int16_t *blk) {
+    int s;
+
+    if (jd->ah == 0) {
+        s = decodehuff(jd, &jd->dc[c->td]);
+        c->dcpred += extend(getbits(jd, s), s);
+        blk[0] = (int16_t)(c->dcpred * (1 << jd->al));
+    } else if (getbits(jd, 1)) {
+        blk[0] |= 1 << jd->al;
+    }
+}
+
+// プログレッシブの AC スキャン (最初)
+static void decodeacfirst(jpeg_t *jd, jcomp_t *c, int16_t *blk) {
+    int s, r, k;
+
+    if (jd->eobrun > 0) {
+        jd->eobrun--;
+        return;
+    }
+    for (k = jd->ss; k <= jd->se; ) {
+        s = decodehuff(jd, &jd->ac[c->ta]);
+        r = s >> 4;
+        s &= 15;
+        if (s) {
+            k += r;
+            if (k > 63)
+                corrupt();
+            blk[zigzag[k]] = (int16_t)(extend(getbits(jd, s), s) * (1 << jd->al));
+            k++;
+        } else if (r == 15) {
+            k += 16;
+        } else {
+            jd->eobrun = (1u << r) - 1;
+            if (r)
+                jd->eobrun += getbits(jd, r);
+            break;
+        }
+    }
+}
+
+// プログレッシブの AC スキャン (逐次近似)
+static void decodeacrefine(jpeg_t *jd, jcomp_t *c, int16_t *blk) {
+    int p1 = 1 << jd->al, m1 = -1 * (1 << jd->al);
+    int s, r, k = jd->ss;
+    int16_t *coef;
+
+    if (jd->eobrun == 0) {
+        for (; k <= jd->se; k++) {
+            s = decodehuff(jd, &jd->ac[c->ta]);
+            r = s >> 4;
+            s &= 15;
+            if (s) {
+                if (s != 1)
+                    corrupt();
+                s = getbits(jd, 1) ? p1 : m1;
+            } else if (r != 15) {
+                jd->eobrun = 1u << r;
+                if (r)
+                    jd->eobrun += getbits(jd, r);
+                break;
+            }
+            // 0 の係数を r 個飛ばす間に、0 でない係数には補正ビットを足す
+            do {
+                coef = &blk[zigzag[k]];
+                if (*coef != 0) {
+                    if (getbits(jd, 1) && (*coef & p1) == 0)
+                        *coef += *coef >= 0 ? p1 : m1;
+                } else if (--r < 0) {
+                    break;
+                }
+                k++;
+            } while (k <= jd->se);
+            if (s && k <= 63)
+                blk[zigzag[k]] = s;
+        }
+    }
+    if (jd->eobrun > 0) {
+        for (; k <= jd->se; k++) {
+            coef = &blk[zigzag[k]];
+            if (*coef != 0 && getbits(jd, 1) && (*coef & p1) == 0)
+                *coef += *coef >= 0 ? p1 : m1;
+        }
+        jd->eobrun--;
+    }
+}
+
+// 1ブロックの復号 (スキャンの種類で分ける)
+static void decodeblock(jpeg_t *jd, jcomp_t *c, int16_t *blk) {
+    if (!jd->progressive)
+        decodeseq(jd, c, blk);
+    else if (jd->ss == 0)
+        decodedc(jd, c, blk);
+    else if (jd->ah == 0)
+        decodeacfirst(jd, c, blk);
+    else
+        decodeacrefine(jd, c, blk);
+}
+
+// リスタートマーカーの処理
+static void dorestart(jpeg_t *jd) {
+    int i;
+
+    jd->bitbuf = 0;
+    jd->nbits = 0;
+    if (!jd->marker)
+        jd->marker = readmarker(jd);
+    if (jd->marker >= M_RST0 && jd->marker <= M_RST7)
+        jd->marker = 0;
+    for (i = 0; i < jd->ncomp; i++)
+        jd->comp[i].dcpred = 0;
+    jd->eobrun = 0;
+}
+
+// 係数を持たずに読むスキャン (1/8 のときのプログレッシブの AC) を読み飛ばす
+static void skipscan(jpeg_t *jd) {
+    int c;
+
+    for (;;) {
+        if ((c = getc(jd->fp)) == EOF) {
+            jd->marker = M_EOI;
+            return;
+        }
+        if (c != 0xff)
+            continue;
+        while ((c = getc(jd->fp)) == 0xff)
+            ;
+        if (c == EOF) {
+            jd->marker = M_EOI;
+            return;
+        }
+        if (c != 0 && (c < M_RST0 || c > M_RST7)) {
+            jd->marker = c;
+            return;
+        }
+    }
+}
+
+// SOS: スキャンヘッダ
+static void readsos(jpeg_t *jd) {
+    uint32_t len = readword(jd);
+    int i, j, cs, t;
+
+    jd->ns = readbyte(jd);
+    if (jd->ns < 1 || jd->ns > jd->ncomp || len != 6 + 2 * (uint32_t)jd->ns)
+        corrupt();
+    for (i = 0; i < jd->ns; i++) {
+        cs = readbyte(jd);
+        t = readbyte(jd);
+        for (j = 0; j < jd->ncomp && jd->comp[j].id != cs; j++)
+            ;
+        if (j == jd->ncomp)
+            corrupt();
+        jd->sc[i] = j;
+        jd->comp[j].td = (t >> 4) & 3;
+        jd->comp[j].ta = t & 3;
+    }
+    jd->ss = readbyte(jd);
+    jd->se = readbyte(jd);
+    jd->ah = readbyte(jd);
+    jd->al = jd->ah & 15;
+    jd->ah >>= 4;
+    if (jd->progressive) {
+        if (jd->se > 63 || jd->ss > jd->se || (jd->ss == 0 && jd->se != 0) || (jd->ss > 0 && jd->ns != 1))
+            corrupt();
+    } else {
+        jd->ss = 0;
+        jd->se = 63;
+        jd->ah = jd->al = 0;
+    }
+    for (i = 0; i < jd->ncomp; i++)
+        jd->comp[i].dcpred = 0;
+    jd->eobrun = 0;
+    jd->bitbuf = 0;
+    jd->nbits = 0;
+}
+
+// MCU 1行 (r 行目) 分の plane を色変換して縮小に渡す
+static void emitmcurow(jpeg_t *jd, uint32_t r, uint8_t *row, reducer_t *rd, uint32_t *emitted, outbuf_t *ob, int fd) {
+    uint32_t y0 = r * jd->vmax * jd->n, y1 = MIN(y0 + jd->vmax * jd->n, jd->outh);
+    uint32_t y, x;
+    const uint8_t *p0, *p1, *p2;
+    int32_t yy, cb, cr;
+    uint8_t *p;
+
+    for (y = y0; y < y1; y++) {
+        p0 = jd->comp[0].plane + (size_t)((y - y0) * jd->comp[0].v / jd->vmax) * jd->comp[0].bw * jd->n;
+        p = row;
+        if (jd->ncomp == 1) {
+            for (x = 0; x < jd->outw; x++, p += 3)
+                p[0] = p[1] = p[2] = p0[x];
+        } else {
+            p1 = jd->comp[1].plane + (size_t)((y - y0) * jd->comp[1].v / jd->vmax) * jd->comp[1].bw * jd->n;
+            p2 = jd->comp[2].plane + (size_t)((y - y0) * jd->comp[2].v / jd->vmax) * jd->comp[2].bw * jd->n;
+            for (x = 0; x < jd->outw; x++, p += 3) {
+                if (jd->rgb) {
+                    p[2] = p0[jd->comp[0].xi[x]];
+                    p[1] = p1[jd->comp[1].xi[x]];
+                    p[0] = p2[jd->comp[2].xi[x]];
+                } else {
+                    yy = p0[jd->comp[0].xi[x]];
+                    cb = p1[jd->comp[1].xi[x]];
+                    cr = p2[jd->comp[2].xi[x]];
+                    p[2] = clamp255(yy + ((cr2r[cr] + 32768) >> 16));
+                    p[1] = clamp255(yy + ((cb2g[cb] + cr2g[cr]) >> 16));
+                    p[0] = clamp255(yy + ((cb2b[cb] + 32768) >> 16));
+                }
+            }
+        }
+        reducerow(rd, y, row);
+    }
+    flushready(rd, emitted, ob, fd);
+}
+
+// スキャン1つを復号する
+// stream なら MCU 1行ごとに逆DCT して出力し、そうでなければ係数を貯める
+static void decodescan(jpeg_t *jd, int stream, uint8_t *row, reducer_t *rd, uint32_t *emitted, outbuf_t *ob, int fd) {
+    int16_t blk[64], *b;
+    jcomp_t *c;
+    uint32_t mx, my, bx, by, todo = jd->restart;
+    int i, xx, yy;
+
+    if (jd->ns == 1) {
+        // 非インターリーブ: 成分のブロックを1つずつ (MCU は 1ブロック)
+        c = &jd->comp[jd->sc[0]];
+        for (by = 0; by < c->ch; by++) {
+            for (bx = 0; bx < c->cw; bx++) {
+                if (jd->restart && todo-- == 0) {
+                    dorestart(jd);
+                    todo = jd->restart - 1;
+                }
+                b = stream ? blk : c->coef + ((size_t)by * c->bw + bx) * jd->coefn;
+                decodeblock(jd, c, b);
+                if (stream)
+                    idctblock(jd, b, jd->qt[c->tq], c->plane + bx * jd->n, c->bw * jd->n);
+            }
+            if (stream)
+                emitmcurow(jd, by, row, rd, emitted, ob, fd);
+        }
+        return;
+    }
+
+    // インターリーブ: MCU ごとに各成分の h×v ブロック
+    for (my = 0; my < jd->mcuy; my++) {
+        for (mx = 0; mx < jd->mcux; mx++) {
+            if (jd->restart && todo-- == 0) {
+                dorestart(jd);
+                todo = jd->restart - 1;
+            }
+            for (i = 0; i < jd->ns; i++) {
+                c = &jd->comp[jd->sc[i]];
+                for (yy = 0; yy < c->v; yy++) {
+                    for (xx = 0; xx < c->h; xx++) {
+                        bx = mx * c->h + xx;
+                        by = my * c->v + yy;
+                        b = stream ? blk : c->coef + ((size_t)by * c->bw + bx) * jd->coefn;
+                        decodeblock(jd, c, b);
+                        if (stream)
+                            idctblock(jd, b, jd->qt[c->tq], c->plane + (size_t)yy * jd->n * c->bw * jd->n + bx * jd->n, c->bw * jd->n);
+                    }
+                }
+            }
+        }
+        if (stream)
+            emitmcurow(jd, my, row, rd, emitted, ob, fd);
+    }
+}
+
+// 貯めた係数を MCU 1行ずつ逆DCT して出力する
+static void emitcoef(jpeg_t *jd, uint8_t *row, reducer_t *rd, uint32_t *emitted, outbuf_t *ob, int fd) {
+    uint32_t r, bx, by;
+    jcomp_t *c;
+    int i;
+
+    for (r = 0; r < jd->mcuy; r++) {
+        for (i = 0; i < jd->ncomp; i++) {
+            c = &jd->comp[i];
+            for (by = 0; by < c->v; by++)
+                for (bx = 0; bx < c->bw; bx++)
+                    idctblock(jd, c->coef + ((size_t)(r * c->v + by) * c->bw + bx) * jd->coefn, jd->qt[c->tq],
+                              c->plane + (size_t)by * jd->n * c->bw * jd->n + bx * jd->n, c->bw * jd->n);
+        }
+        emitmcurow(jd, r, row, rd, emitted, ob, fd);
+    }
+}
+
+// 1/scale で復号して rd (縮小後の大きさで初期化済み) に足し込み、デコーダを解放する
+// ob が NULL でなければ完成した行から出力する
+void decodejpeg(jpeg_t *jd, uint32_t scale, reducer_t *rd, outbuf_t *ob, int fd) {
+    uint32_t emitted = 0, x;
+    uint8_t *row;
+    jcomp_t *c;
+    int i, m, stream = 0, buffered = 0;
+
+    jd->n = 8 / scale;
+    jd->coefn = jd->n == 1 ? 1 : 64;
+    jd->outw = (jd->width * jd->n + 7) / 8;
+    jd->outh = (jd->height * jd->n + 7) / 8;
+    initidct(jd);
+    pthread_once(&ycconce, initycc);
+    debug("[JPEG: ..] scale=1/%u output=%ux%u\n", scale, jd->outw, jd->outh);
+
+    for (i = 0; i < jd->ncomp; i++) {
+        c = &jd->comp[i];
+        c->plane = (uint8_t *)xmalloc((size_t)c->bw * jd->n * c->v * jd->n);
+        c->xi = (uint32_t *)xmalloc(sizeof(uint32_t) * jd->outw);
+        for (x = 0; x < jd->outw; x++)
+            c->xi[x] = x * c->h / jd->hmax;
+    }
+    row = (uint8_t *)xmalloc((size_t)jd->outw * 3);
+
+    for (;;) {
+        m = readmarker(jd);
+        if (m == M_EOI) {
+            break;
+        } else if (m == M_SOS) {
+            readsos(jd);
+            if (!jd->progressive && !buffered && jd->ns == jd->ncomp) {
+                // 全成分を1スキャンにまとめたベースラインは係数を貯めずに流す
+                decodescan(jd, 1, row, rd, &emitted, ob, fd);
+                stream = 1;
+            } else {
+                if (!buffered) {
+                    for (i = 0; i < jd->ncomp; i++) {
+                        c = &jd->comp[i];
+                        c->coef = (int16_t *)xcalloc((size_t)c->bw * c->bh, sizeof(int16_t) * jd->coefn);
+                    }
+                    buffered = 1;
+                }
+                if (jd->coefn == 1 && jd->ss > 0)
+                    skipscan(jd);
+                else
+                    decodescan(jd, 0, row, rd, &emitted, ob, fd);
+            }
+            if (stream)
+                break;
+        } else if (m == M_DQT) {
+            readdqt(jd);
+        } else if (m == M_DHT) {
+            readdht(jd);
+        } else if (m == M_DRI) {
+            readword(jd);
+            jd->restart = readword(jd);
+        } else if (m >= M_RST0 && m <= M_RST7) {
+            // スキャンの外のリスタートマーカーは無視する
+        } else if (m == M_SOI || (m >= 0xc0 && m <= 0xcf && m != M_DHT && m != 0xc8 && m != 0xcc)) {
+            corrupt();
+        } else {
+            skipbytes(jd, readword(jd) - 2);
+        }
+    }
+    if (buffered && !stream)
+        emitcoef(jd, row, rd, &emitted, ob, fd);
+    debug("[JPEG: OK] %s\n", stream ? "stream" : "buffered");
+
+    xfree(row);
+    for (i = 0; i < jd->ncomp; i++) {
+        xfree(jd->comp[i].plane);
+        xfree(jd->comp[i].xi);
+        xfree(jd->comp[i].coef);
+    }
+    xfree(jd);
+}
@@ -0,0 +1,171 @@
+/**
+ * output.c
+ * 出力バッファ (1フレーム分のエスケープシーケンスをためてまとめて書き出す) と色変換
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "cbmpviewer.h"
+
+// 0~99 の10進2桁 (itoa 用のテーブル)
+const char dec2[200] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// 出力バッファの初期化
+void obinit(outbuf_t *ob, size_t cap) {
+    ob->len = 0;
+    ob->cap = MAX(cap, 64);
+    ob->buf = (char *)xmalloc(ob->cap);
+    ob->keep = 0;
+    ob->tee = -1;
+    ob->stats = NULL;
+}
+
+// 出力バッファの解放
+void obfree(outbuf_t *ob) {
+    xfree(ob->buf);
+    ob->buf = NULL;
+    ob->len = ob->cap = 0;
+}
+
+// 残り容量が n バイト未満なら広げる
+void obgrow(outbuf_t *ob, size_t n) {
+    size_t cap = ob->cap;
+
+    while (cap - ob->len < n)
+        cap *= 2;
+    ob->buf = (char *)xrealloc(ob->buf, cap);
+    ob->cap = cap;
+}
+
+// buf の len バイトをすべて fd に書き出す (書き込めなければ -1 を返し、errno はそのまま)
+static int writeall(int fd, const char *buf, size_t len) {
+    size_t pos = 0;
+    ssize_t n;
+
+    while (pos < len) {
+        n = write(fd, buf + pos, len - pos);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        pos += n;
+    }
+    return 0;
+}
+
+// バッファの内容を fd にまとめて書き出して空にする
+// メモリへの描画 (ob->keep) では書き出さずにそのままためておく
+// ob->tee にも同じ内容を書き出す (キャッシュの一時ファイルなど)。そちらに書き込めなくても描画は続け、以降は書き出さない
+// 計測中は write にかかった時間 (出力先が詰まって待たされた時間) も数える
+void obflush(outbuf_t *ob, int fd) {
+    double t = 0;
+
+    if (ob->keep)
+        return;
+    if (ob->stats != NULL && ob->stats->enabled) {
+        statsaddout(ob->stats, ob->buf, ob->len);
+        t = statsclock();
+    }
+    // 出力先が閉じられた (パイプの先の head など) ときはコマンドラインでは黙って終わる
+    if (writeall(fd, ob->buf, ob->len) != 0)
+        fail(errno == EPIPE ? CIMAGE_EPIPE : CIMAGE_EWRITE, "write");
+    if (ob->tee >= 0 && writeall(ob->tee, ob->buf, ob->len) != 0)
+        ob->tee = -1;
+    if (ob->stats != NULL && ob->stats->enabled)
+        ob->stats->blocked += statsclock() - t;
+    ob->len = 0;
+}
+
+// 1行分の出力関数
+typedef void (*rowfunc_t)(const pixel_t *cell, const consolebmp_t *cbmp, uint32_t i, outbuf_t *ob);
+
+// 色変換して i 行目の文字を出力バッファに追加 (行末の色のリセットと改行は付けない)
+// 色モードは定数で受け取り、色モードごとの版 (rowtext8 など) に putcolor などごと展開して
+// 1文字ごとの色モードの分岐をなくす
+static inline
+void rowbody(const pixel_t *cell, const consolebmp_t *cbmp, uint32_t i, outbuf_t *ob, int c256, int full) {
+    consolebmp_t m = *cbmp;
+    uint32_t j, clr;
+    uint32_t prev; // 直前の文字の色 (行頭では無効値)
+    uint32_t fg;   // 直前の文字の前景の色 (半ブロック用)
+
+    m.color256 = c256;
+    m.fullcolor = full;
+    obreserve(ob, (size_t)m.letter * CELL_MAXBYTES);
+    prev = fg = (uint32_t)-1;
+    if (m.half) {
+        // 半ブロック: 上下2行のセルから1行を作る
+        cell += (size_t)i * 2 * m.letter;
+        for (j = 0; j < m.letter; j++, cell++)
+            puthalf(ob, cellcolor(cell, &m), cellcolor(cell + m.letter, &m), &fg, &prev, &m);
+        return;
+    }
+
+    cell += (size_t)i * m.letter;
+    for (j = 0; j < m.letter; j++, cell++) {
+        // 1文字で表される分のピクセルの平均 (downsample で計算済み) を色に変換
+        clr = cellcolor(cell, &m);
+        if (prev != clr) {
+            prev = clr;
+            putcolor(ob, clr, &m);
+        }
+        putglyph(ob, clr, &m);
+    }
+}
+
+// 8色
+static __attribute__((flatten)) void rowtext8(const pixel_t *cell, const consolebmp_t *cbmp, uint32_t i, outbuf_t *ob) {
+    rowbody(cell, cbmp, i, ob, 0, 0);
+}
+
+// 256色
+static __attribute__((flatten)) void rowtext256(const pixel_t *cell, const consolebmp_t *cbmp, uint32_t i, outbuf_t *ob) {
+    rowbody(cell, cbmp, i, ob, 1, 0);
+}
+
+// フルカラー
+static __attribute__((flatten)) void rowtextfull(const pixel_t *cell, const consolebmp_t *cbmp, uint32_t i, outbuf_t *ob) {
+    rowbody(cell, cbmp, i, ob, 1, 1);
+}
+
+// 色モードに合った行の出力関数
+static rowfunc_t rowfunc(const consolebmp_t *cbmp) {
+    if (!cbmp->color256)
+        return rowtext8;
+    return cbmp->fullcolor ? rowtextfull : rowtext256;
+}
+
+// 色変換して出力バッファに追加
+// 直前の文字と同じ色のときは SGR を省略するので、同じ色が続くところは空白(数字)だけになる
+// 色の状態は行ごとにリセットするので、行ごとに独立して(並列に)生成できる
+// 色モードごとの版は呼び出しごとに1回だけ選ぶ
+void outputlines(const pixel_t *cell, const consolebmp_t *cbmp, uint32_t line0, uint32_t line1, outbuf_t *ob) {
+    rowfunc_t row = rowfunc(cbmp);
+    uint32_t i;
+
+    for (i = line0; i < line1; i++) {
+        row(cell, cbmp, i, ob);
+        obreserve(ob, 16);
+        obputlit(ob, "\x1b[39m\x1b[49m\n"); // デフォルトに戻す
+    }
+}
+
+// 色変換して i 行目の文字を出力バッファに追加 (行末の色のリセットと改行は付けない)
+void outputrow(const pixel_t *cell, const consolebmp_t *cbmp, uint32_t i, outbuf_t *ob) {
+    rowfunc(cbmp)(cell, cbmp, i, ob);
+}
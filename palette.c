@@ -0,0 +1,192 @@
+/**
+ * palette.c
+ * 拡張パレット(256色)への近似色探索
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include "cbmpviewer.h"
+
+// 拡張パレット - RBGの変換テーブル
+const pixel_t pal2rgb[256] = {
+    {0,0,0},      {192,0,0},    {0,192,0},    {192,192,0},  
+    {64,64,192},  {192,0,192},  {0,192,192},  {192,192,192},
+    {64,64,64},   {255,0,0},    {0,255,0},    {255,255,0},  
+    {128,128,255},{255,0,255},  {0,255,255},  {255,255,255},
+    {0,0,0},      {0,0,95},     {0,0,135},    {0,0,175},    
+    {0,0,215},    {0,0,255},    {0,95,0},     {0,95,95},    
+    {0,95,135},   {0,95,175},   {0,95,215},   {0,95,255},   
+    {0,135,0},    {0,135,95},   {0,135,135},  {0,135,175},  
+    {0,135,215},  {0,135,255},  {0,175,0},    {0,175,95},   
+    {0,175,135},  {0,175,175},  {0,175,215},  {0,175,255},  
+    {0,215,0},    {0,215,95},   {0,215,135},  {0,215,175},  
+    {0,215,215},  {0,215,255},  {0,255,0},    {0,255,95},   
+    {0,255,135},  {0,255,175},  {0,255,215},  {0,255,255},  
+    {95,0,0},     {95,0,95},    {95,0,135},   {95,0,175},   
+    {95,0,215},   {95,0,255},   {95,95,0},    {95,95,95},   
+    {95,95,135},  {95,95,175},  {95,95,215},  {95,95,255},  
+    {95,135,0},   {95,135,95},  {95,135,135}, {95,135,175}, 
+    {95,135,215}, {95,135,255}, {95,175,0},   {95,175,95},  
+    {95,175,135}, {95,175,175}, {95,175,215}, {95,175,255}, 
+    {95,215,0},   {95,215,95},  {95,215,135}, {95,215,175}, 
+    {95,215,215}, {95,215,255}, {95,255,0},   {95,255,95},  
+    {95,255,135}, {95,255,175}, {95,255,215}, {95,255,255}, 
+    {135,0,0},    {135,0,95},   {135,0,135},  {135,0,175},  
+    {135,0,215},  {135,0,255},  {135,95,0},   {135,95,95},  
+    {135,95,135}, {135,95,175}, {135,95,215}, {135,95,255}, 
+    {135,135,0},  {135,135,95}, {135,135,135},{135,135,175},
+    {135,135,215},{135,135,255},{135,175,0},  {135,175,95}, 
+    {135,175,135},{135,175,175},{135,175,215},{135,175,255},
+    {135,215,0},  {135,215,95}, {135,215,135},{135,215,175},
+    {135,215,215},{135,215,255},{135,255,0},  {135,255,95}, 
+    {135,255,135},{135,255,175},{135,255,215},{135,255,255},
+    {175,0,0},    {175,0,95},   {175,0,135},  {175,0,175},  
+    {175,0,215},  {175,0,255},  {175,95,0},   {175,95,95},  
+    {175,95,135}, {175,95,175}, {175,95,215}, {175,95,255}, 
+    {175,135,0},  {175,135,95}, {175,135,135},{175,135,175},
+    {175,135,215},{175,135,255},{175,175,0},  {175,175,95}, 
+    {175,175,135},{175,175,175},{175,175,215},{175,175,255},
+    {175,215,0},  {175,215,95}, {175,215,135},{175,215,175},
+    {175,215,215},{175,215,255},{175,255,0},  {175,255,95}, 
+    {175,255,135},{175,255,175},{175,255,215},{175,255,255},
+    {215,0,0},    {215,0,95},   {215,0,135},  {215,0,175},  
+    {215,0,215},  {215,0,255},  {215,95,0},   {215,95,95},  
+    {215,95,135}, {215,95,175}, {215,95,215}, {215,95,255}, 
+    {215,135,0},  {215,135,95}, {215,135,135},{215,135,175},
+    {215,135,215},{215,135,255},{215,175,0},  {215,175,95}, 
+    {215,175,135},{215,175,175},{215,175,215},{215,175,255},
+    {215,215,0},  {215,215,95}, {215,215,135},{215,215,175},
+    {215,215,215},{215,215,255},{215,255,0},  {215,255,95}, 
+    {215,255,135},{215,255,175},{215,255,215},{215,255,255},
+    {255,0,0},    {255,0,95},   {255,0,135},  {255,0,175},  
+    {255,0,215},  {255,0,255},  {255,95,0},   {255,95,95},  
+    {255,95,135}, {255,95,175}, {255,95,215}, {255,95,255}, 
+    {255,135,0},  {255,135,95}, {255,135,135},{255,135,175},
+    {255,135,215},{255,135,255},{255,175,0},  {255,175,95}, 
+    {255,175,135},{255,175,175},{255,175,215},{255,175,255},
+    {255,215,0},  {255,215,95}, {255,215,135},{255,215,175},
+    {255,215,215},{255,215,255},{255,255,0},  {255,255,95}, 
+    {255,255,135},{255,255,175},{255,255,215},{255,255,255},
+    {8,8,8},      {18,18,18},   {28,28,28},   {38,38,38},   
+    {48,48,48},   {58,58,58},   {68,68,68},   {78,78,78},   
+    {88,88,88},   {98,98,98},   {108,108,108},{118,118,118},
+    {128,128,128},{138,138,138},{148,148,148},{158,158,158},
+    {168,168,168},{178,178,178},{188,188,188},{198,198,198},
+    {208,208,208},{218,218,218},{228,228,228},{238,238,238},
+};
+
+// 近似色探索テーブル
+// RGB 空間を 16x16x16 の立方体に区切り、立方体ごとに最近傍になりうるパレットだけを
+// インデックス順に並べておく。探索はその候補だけを見ればよい。
+#define CUBE_BITS  4
+#define CUBE_DIV   (1 << CUBE_BITS)         // 1軸あたりの分割数
+#define CUBE_SHIFT (8 - CUBE_BITS)          // RGB 値から立方体番号へのシフト量
+#define CUBE_NUM   (CUBE_DIV * CUBE_DIV * CUBE_DIV)
+
+static uint32_t candofs[CUBE_NUM + 1]; // 立方体ごとの候補の開始位置
+static uint8_t *cand = NULL;           // 候補のパレット番号
+static pthread_once_t candonce = PTHREAD_ONCE_INIT;
+
+// パレット p と立方体 [lo, hi] 内の点との距離の2乗の最小値 (far が 1 なら最大値)
+static uint32_t boxdist(const pixel_t *p, const int32_t *lo, const int32_t *hi, int far) {
+    int32_t v[3], d, k;
+    uint32_t sum = 0;
+
+    v[0] = p->red;
+    v[1] = p->green;
+    v[2] = p->blue;
+    for (k = 0; k < 3; k++) {
+        if (far)
+            d = MAX(v[k] - lo[k], hi[k] - v[k]);
+        else
+            d = (v[k] < lo[k]) ? lo[k] - v[k] : (v[k] > hi[k]) ? v[k] - hi[k] : 0;
+        sum += d * d;
+    }
+    return sum;
+}
+
+// 立方体 cube の候補を out に書き出して個数を返す (out が NULL なら数えるだけ)
+static uint32_t cubecand(uint32_t cube, uint8_t *out) {
+    int32_t lo[3], hi[3];
+    uint32_t i, k, n, dmax, limit;
+
+    lo[0] = ((cube >> (2 * CUBE_BITS)) & (CUBE_DIV - 1)) << CUBE_SHIFT;
+    lo[1] = ((cube >> CUBE_BITS) & (CUBE_DIV - 1)) << CUBE_SHIFT;
+    lo[2] = (cube & (CUBE_DIV - 1)) << CUBE_SHIFT;
+    for (k = 0; k < 3; k++)
+        hi[k] = lo[k] + (1 << CUBE_SHIFT) - 1;
+
+    // 立方体内のどの点から見ても、最近傍までの距離の2乗は limit 以下
+    limit = (uint32_t)-1;
+    for (i = 0; i < 256; i++) {
+        dmax = boxdist(&pal2rgb[i], lo, hi, 1);
+        if (limit > dmax) limit = dmax;
+    }
+    // near() は sqrt を切り捨てた距離で比較するので、同じ距離とみなされる範囲まで含める
+    limit = ((uint32_t)sqrt(limit) + 1) * ((uint32_t)sqrt(limit) + 1);
+
+    for (i = 0, n = 0; i < 256; i++) {
+        if (boxdist(&pal2rgb[i], lo, hi, 0) < limit) {
+            if (out != NULL) out[n] = i;
+            n++;
+        }
+    }
+    return n;
+}
+
+// 近似色探索テーブルの構築 (確保できなければ cand は NULL のまま)
+// テーブルは全スレッドで共有し、プロセスが終わるまで解放しない
+static void buildpalette(void) {
+    uint32_t c;
+    uint8_t *p;
+
+    candofs[0] = 0;
+    for (c = 0; c < CUBE_NUM; c++)
+        candofs[c + 1] = candofs[c] + cubecand(c, NULL);
+    if ((p = (uint8_t *)malloc(candofs[CUBE_NUM])) == NULL)
+        return;
+    for (c = 0; c < CUBE_NUM; c++)
+        cubecand(c, p + candofs[c]);
+    cand = p;
+    debug("[PALETTE: OK] candidates=%u\n", candofs[CUBE_NUM]);
+}
+
+// 近似色探索テーブルの構築
+// 複数のスレッドから呼ばれても構築は一度だけ行う
+void initpalette(void) {
+    pthread_once(&candonce, buildpalette);
+    if (cand == NULL)
+        fail(CIMAGE_ENOMEM, "memory allocate");
+}
+
+// RGB から 拡張カラーへの近似色を探す
+// 距離は sqrt を切り捨てた値で比べ、同じ距離ならインデックスの小さいほうを返す
+// (全パレットと比較していた以前の結果と同じになる)
+uint8_t near(uint32_t r0, uint32_t g0, uint32_t b0) {
+    uint32_t d[256];
+    uint32_t dmin, limit, cube, i, n, r, g, b;
+    const uint8_t *c;
+
+    cube = ((r0 >> CUBE_SHIFT) << (2 * CUBE_BITS)) | ((g0 >> CUBE_SHIFT) << CUBE_BITS) | (b0 >> CUBE_SHIFT);
+    c = cand + candofs[cube];
+    n = candofs[cube + 1] - candofs[cube];
+
+    // 候補との距離の2乗 (整数演算のみ)
+    dmin = (uint32_t)-1;
+    for (i = 0; i < n; i++) {
+        r = r0 - pal2rgb[c[i]].red;
+        g = g0 - pal2rgb[c[i]].green;
+        b = b0 - pal2rgb[c[i]].blue;
+        d[i] = r * r + g * g + b * b;
+        if (dmin > d[i]) dmin = d[i];
+    }
+    // 切り捨てた距離が最小値と同じになる最初の候補
+    limit = ((uint32_t)sqrt(dmin) + 1) * ((uint32_t)sqrt(dmin) + 1);
+    for (i = 0; i < n; i++) {
+        if (d[i] < limit) return c[i];
+    }
+    return 255;
+}
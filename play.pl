@@ -1,7 +1,7 @@
 #!/usr/bin/perl
 
 # コンソール上で(無理矢理)動画再生する
-#  ffmpeg -ss option で bmp 出力してCBmpViewer
+#  ffmpeg 1回で rawvideo をパイプに出力して cbmpviewer --stream 1プロセスで再生
 
 use strict;
 use warnings;
@@ -9,10 +9,6 @@ use Carp;
 
 my $ffmpeg_exe = 'ffmpeg';
 
-my $TMPDIR = '/tmp/__out/';
-# my $TMPDIR = 'R:\\__out/'              ;
-# my $TMPDIR = '/mnt/hgfs/ramdisk/__out/';
-
 # 動画の長さを採取
 # x y dur[ms]
 sub mpg_info
@@ -54,35 +50,20 @@ sub play
 {
 	my $file = shift;
 #	print "$file\n";
-	my $step = 1;
-	my $scale = 48; # 駒のサイズ SSH越しだと48くらいが限界
-	my $uniqueid = sprintf("%010d",time()).sprintf("%05d",$$);
-	my $tmpdir =  $TMPDIR . '_' . $uniqueid;
-	mkdir $TMPDIR;
-	mkdir $tmpdir;
-	unlink while(<$tmpdir . '/*.bmp'>);
+	my $fps = 10;   # 再生フレームレート (表示が間に合わないフレームは cbmpviewer が捨てる)
+	my $scale = 160; # 駒のサイズ (表示する横幅は --adaptive が回線の速さに合わせて端末の横幅以下で決める)
 	my ($x,  $y,  $d) = &mpg_info($file);
 	return unless($d);
-	for my $index( 0..$d/$step )
-	{
-		my $thumbp =
-		   q#ffmpeg #
-#		 . q# -v quiet #
-		 . q# -ss # . (sprintf "%d", $index * $step)
-		 . q# -skip_frame nokey #
-#		 . q# -skip_frame noref #
-		 . qq# -i "$file" #
-		 . qq# -vf scale=$scale:-1#
-		 . qq# -f image2 "$tmpdir/$index.bmp" #;
-		system($thumbp . ' >/dev/null 2>&1');
-		die if(($? & 256) == 0);
-		print "\x1b[2J"; # 画面クリア
-
-		system(qq#cbmpviewer "$tmpdir/$index.bmp"#);
-	}
-	unlink while(<$tmpdir . '/*.bmp'>);
-	rmdir $tmpdir;
-	rmdir $TMPDIR;
+	return if($x <= 0 || $y <= 0);
+	# 高さは偶数に丸める (ffmpeg の scale=W:-2 と同じ)
+	my $h = int($y * $scale / $x / 2 + 0.5) * 2;
+	my $cmd =
+	   qq#$ffmpeg_exe -v quiet #
+	 . qq# -i "$file" #
+	 . qq# -vf scale=$scale:$h -r $fps #
+	 . q# -f rawvideo -pix_fmt rgb24 - #
+	 . qq# | cbmpviewer --stream ${scale}x$h --fps $fps --delta=4 --keyframe 100 --adaptive -#;
+	system($cmd);
 }
 
 #####################################
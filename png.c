@@ -0,0 +1,305 @@
+/**
+ * png.c
+ * PNG デコーダ (ノンインターレース)
+ * IDAT を少しずつ inflate して1行ずつフィルタを戻し、そのまま行ストリーム縮小 (reduce.c) に渡す。
+ * メモリは前の行と今の行の2行分とセルの累積だけで、画像全体は持たない。
+ * アルファ付きの画像は黒い背景に合成する。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+#include "cbmpviewer.h"
+
+// IDAT を読み込む単位
+#define PNG_CHUNK (1 << 16)
+
+// カラータイプ
+#define PNG_GRAY       0
+#define PNG_RGB        2
+#define PNG_PALETTE    3
+#define PNG_GRAYALPHA  4
+#define PNG_RGBA       6
+
+// デコーダ
+struct TAG_PNG {
+    FILE *fp;
+    uint32_t width, height;
+    uint8_t depth;          // ビット深度 (8 か 16)
+    uint8_t colortype;
+    uint8_t channels;       // 1画素のサンプル数
+    uint32_t bpp;           // 1画素のバイト数 (フィルタの左隣の距離)
+    size_t rowbytes;        // 1行のバイト数 (先頭のフィルタの種類を除く)
+    pixel_t pal[256];       // パレット
+    uint8_t alpha[256];     // パレットの透明度 (tRNS)
+    uint32_t idatleft;      // 読みかけの IDAT の残りのバイト数
+};
+
+static void corrupt(void) {
+    fail(CIMAGE_EFORMAT, "corrupt png");
+}
+
+static void unsupported(void) {
+    fail(CIMAGE_EUNSUPPORTED, "unsupported png");
+}
+
+// zlib のメモリ確保 (途中で失敗したときに解放できるよう xmalloc を使う)
+static voidpf zalloc(voidpf opaque, uInt items, uInt size) {
+    return xcalloc(items, size);
+}
+
+static void zfree(voidpf opaque, voidpf p) {
+    xfree(p);
+}
+
+// 4byte (ビッグエンディアン) 読む
+static uint32_t readu32(FILE *fp) {
+    uint8_t b[4];
+
+    freadwitherror(b, 4, fp);
+    return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+// n byte 読み飛ばす
+static void skipbytes(FILE *fp, uint32_t n) {
+    uint8_t buf[256];
+
+    while (n > 0) {
+        freadwitherror(buf, MIN(n, sizeof(buf)), fp);
+        n -= MIN(n, sizeof(buf));
+    }
+}
+
+// チャンクのヘッダ (長さと種類) を読む
+static uint32_t readchunk(FILE *fp, char type[5]) {
+    uint32_t len = readu32(fp);
+
+    freadwitherror(type, 4, fp);
+    type[4] = '\0';
+    if (len > 0x7fffffff)
+        corrupt();
+    return len;
+}
+
+// ヘッダを最初の IDAT まで読む (先頭のシグネチャは呼び出し側で判定済み)
+png_t *openpng(FILE *fp, uint32_t *width, uint32_t *height) {
+    static const uint8_t sig[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    static const uint8_t channels[7] = {1, 0, 3, 1, 2, 0, 4};
+    uint8_t b[13];
+    char type[5];
+    uint32_t len, i;
+    png_t *pd;
+
+    pd = (png_t *)xcalloc(1, sizeof(png_t));
+    pd->fp = fp;
+    memset(pd->alpha, 255, sizeof(pd->alpha));
+    freadwitherror(b, 8, fp);
+    if (memcmp(b, sig, 8) != 0)
+        corrupt();
+
+    // IHDR
+    if (readchunk(fp, type) != 13 || strcmp(type, "IHDR") != 0)
+        corrupt();
+    freadwitherror(b, 13, fp);
+    skipbytes(fp, 4);
+    pd->width = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+    pd->height = ((uint32_t)b[4] << 24) | ((uint32_t)b[5] << 16) | ((uint32_t)b[6] << 8) | b[7];
+    pd->depth = b[8];
+    pd->colortype = b[9];
+    if (pd->width == 0 || pd->height == 0 || pd->width > 0x7fffffff || pd->height > 0x7fffffff)
+        corrupt();
+    // インターレースと 8bit 未満の深度は扱わない (16bit は上位 8bit だけ使う)
+    if (b[12] != 0 || pd->colortype > PNG_RGBA || channels[pd->colortype] == 0
+        || !(pd->depth == 8 || (pd->depth == 16 && pd->colortype != PNG_PALETTE)))
+        unsupported();
+    pd->channels = channels[pd->colortype];
+    pd->bpp = pd->channels * pd->depth / 8;
+    pd->rowbytes = (size_t)pd->width * pd->bpp;
+
+    // PLTE・tRNS を拾って最初の IDAT まで進む
+    for (;;) {
+        len = readchunk(fp, type);
+        if (strcmp(type, "IDAT") == 0) {
+            pd->idatleft = len;
+            break;
+        } else if (strcmp(type, "IEND") == 0) {
+            corrupt();
+        } else if (strcmp(type, "PLTE") == 0 && len % 3 == 0 && len <= 768) {
+            for (i = 0; i < len / 3; i++) {
+                freadwitherror(b, 3, fp);
+                pd->pal[i].red = b[0];
+                pd->pal[i].green = b[1];
+                pd->pal[i].blue = b[2];
+            }
+            skipbytes(fp, 4);
+        } else if (strcmp(type, "tRNS") == 0 && pd->colortype == PNG_PALETTE && len <= 256) {
+            freadwitherror(pd->alpha, len, fp);
+            skipbytes(fp, 4);
+        } else {
+            skipbytes(fp, len + 4);
+        }
+    }
+    debug("[PNG: OK] %ux%u depth=%u colortype=%u\n", pd->width, pd->height, pd->depth, pd->colortype);
+    *width = pd->width;
+    *height = pd->height;
+    return pd;
+}
+
+// 次の IDAT の中身を buf に読む (IDAT が終わったら 0 を返す)
+static size_t readidat(png_t *pd, uint8_t *buf, size_t cap) {
+    char type[5];
+    uint32_t len;
+    size_t n;
+
+    // 読み終えた IDAT の CRC を飛ばして次のチャンクへ
+    while (pd->idatleft == 0) {
+        skipbytes(pd->fp, 4);
+        len = readchunk(pd->fp, type);
+        if (strcmp(type, "IDAT") != 0)
+            return 0;
+        pd->idatleft = len;
+    }
+    n = MIN(cap, pd->idatleft);
+    freadwitherror(buf, n, pd->fp);
+    pd->idatleft -= n;
+    return n;
+}
+
+// Paeth 予測
+static inline uint8_t paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+// フィルタを戻す (cur[0] はフィルタの種類、prev は前の行で最初の行なら 0 埋め)
+static void unfilter(const png_t *pd, uint8_t *cur, const uint8_t *prev) {
+    uint8_t *p = cur + 1;
+    const uint8_t *q = prev + 1;
+    size_t i, n = pd->rowbytes, bpp = pd->bpp;
+
+    switch (cur[0]) {
+    case 0:
+        break;
+    case 1:
+        for (i = bpp; i < n; i++)
+            p[i] += p[i - bpp];
+        break;
+    case 2:
+        for (i = 0; i < n; i++)
+            p[i] += q[i];
+        break;
+    case 3:
+        for (i = 0; i < bpp; i++)
+            p[i] += q[i] >> 1;
+        for (; i < n; i++)
+            p[i] += (p[i - bpp] + q[i]) >> 1;
+        break;
+    case 4:
+        for (i = 0; i < bpp; i++)
+            p[i] += q[i];
+        for (; i < n; i++)
+            p[i] += paeth(p[i - bpp], q[i], q[i - bpp]);
+        break;
+    default:
+        corrupt();
+    }
+}
+
+// 1行を B G R の並びに変換する (アルファは黒い背景に合成)
+static void convertrow(const png_t *pd, const uint8_t *p, uint8_t *out) {
+    uint32_t x, a;
+    size_t step = pd->depth / 8;
+    const pixel_t *c;
+
+    for (x = 0; x < pd->width; x++, out += 3) {
+        switch (pd->colortype) {
+        case PNG_GRAY:
+            out[0] = out[1] = out[2] = p[0];
+            break;
+        case PNG_GRAYALPHA:
+            out[0] = out[1] = out[2] = (p[0] * p[step] + 127) / 255;
+            break;
+        case PNG_RGB:
+            out[2] = p[0];
+            out[1] = p[step];
+            out[0] = p[2 * step];
+            break;
+        case PNG_RGBA:
+            a = p[3 * step];
+            out[2] = (p[0] * a + 127) / 255;
+            out[1] = (p[step] * a + 127) / 255;
+            out[0] = (p[2 * step] * a + 127) / 255;
+            break;
+        case PNG_PALETTE:
+            c = &pd->pal[p[0]];
+            a = pd->alpha[p[0]];
+            out[2] = (c->red * a + 127) / 255;
+            out[1] = (c->green * a + 127) / 255;
+            out[0] = (c->blue * a + 127) / 255;
+            break;
+        }
+        p += pd->bpp;
+    }
+}
+
+// 1行ずつ inflate・フィルタを戻して rd に足し込み、デコーダを解放する
+// ob が NULL でなければ完成した行から出力する
+void decodepng(png_t *pd, reducer_t *rd, outbuf_t *ob, int fd) {
+    z_stream zs;
+    uint8_t *in, *cur, *prev, *tmp, *bgr;
+    uint32_t y = 0, emitted = 0;
+    int ret = Z_OK;
+
+    in = (uint8_t *)xmalloc(PNG_CHUNK);
+    cur = (uint8_t *)xmalloc(pd->rowbytes + 1);
+    prev = (uint8_t *)xcalloc(pd->rowbytes + 1, 1);
+    bgr = (uint8_t *)xmalloc((size_t)pd->width * 3);
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = zalloc;
+    zs.zfree = zfree;
+    if (inflateInit(&zs) != Z_OK)
+        fail(CIMAGE_ENOMEM, "memory allocate");
+
+    zs.next_out = cur;
+    zs.avail_out = pd->rowbytes + 1;
+    while (y < pd->height) {
+        if (zs.avail_in == 0) {
+            if ((zs.avail_in = readidat(pd, in, PNG_CHUNK)) == 0)
+                break;
+            zs.next_in = in;
+        }
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+            corrupt();
+        // 1行そろったらフィルタを戻して渡す
+        if (zs.avail_out == 0) {
+            unfilter(pd, cur, prev);
+            convertrow(pd, cur + 1, bgr);
+            reducerow(rd, y++, bgr);
+            flushready(rd, &emitted, ob, fd);
+            tmp = prev;
+            prev = cur;
+            cur = tmp;
+            zs.next_out = cur;
+            zs.avail_out = pd->rowbytes + 1;
+        }
+        if (ret == Z_STREAM_END)
+            break;
+    }
+    if (y < pd->height)
+        corrupt();
+    debug("[PNG: OK] %u rows\n", y);
+
+    inflateEnd(&zs);
+    xfree(in);
+    xfree(cur);
+    xfree(prev);
+    xfree(bgr);
+    xfree(pd);
+}
@@ -0,0 +1,158 @@
+/**
+ * pyramid.c
+ * 画像ピラミッド (ミップマップ)
+ * 画像を1回だけ復号して一番下の段を作り、上の段は縦横 1/2 ずつの箱フィルタで縮小したもの。
+ * 描き直すときはセル1つに1画素以上かかる一番粗い段から縮小するので、
+ * 2回目からの描画は元画像の大きさによらずセルの数に比例する時間で済む。
+ * 上の段は必要になったときに作り、一番下の段は復号中の作業領域を含めてメモリの上限に収まる大きさにする
+ * (ただし PYRAMID_MINBASE 画素より小さくはしない)。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "cbmpviewer.h"
+
+// 画像 im を1回だけ復号して一番下の段を作る (上の段は大きさだけ決めておく)
+// 一番下の段は元画像 (JPEG なら縮小して復号した大きさ) 以下で、復号中も limit バイトに収まる大きさにする
+// limit が小さすぎても PYRAMID_MINBASE 画素までは残す (1x1 に潰して拡大しても何も見えなくならないように)
+void initpyramid(pyramid_t *py, image_t *im, uint64_t limit) {
+    consolebmp_t base;
+    reducer_t rd;
+    pixel_t *c;
+    uint32_t w = im->width, h = im->height, k;
+    double f = sqrt(MAX((double)limit / PYRAMID_DECODEBYTES, PYRAMID_MINBASE) / ((double)w * h));
+    size_t i, n;
+    uint8_t t;
+
+    if (f < 1.0) {
+        w = MAX((uint32_t)(w * f), 1);
+        h = MAX((uint32_t)(h * f), 1);
+    }
+    // 一番下の段の1画素をセル1つとして行ストリーム縮小で復号する
+    memset(&base, 0, sizeof(base));
+    base.letter = w;
+    base.line = h;
+    base.bpl_c = (double)im->width / w;
+    base.bpl_r = (double)im->height / h;
+    if (im->format == IMAGE_JPEG) {
+        im->scale = jpegscale(&base, im->width, im->height);
+        base.bpl_c = (double)im->width / im->scale / w;
+        base.bpl_r = (double)im->height / im->scale / h;
+    }
+    debug("[PYRAMID: ..] %ux%u -> %ux%u (jpeg 1/%u)\n", im->width, im->height, w, h, im->scale);
+    decodeimage(im, &base, &rd, NULL, -1);
+
+    // セルは R G B の3byte なので、R と B を入れ替えて B G R の並びの段としてそのまま受け取る
+    c = rd.cell;
+    rd.cell = NULL;
+    freereducer(&rd);
+    for (i = 0, n = (size_t)w * h; i < n; i++) {
+        t = c[i].red;
+        c[i].red = c[i].blue;
+        c[i].blue = t;
+    }
+
+    memset(py, 0, sizeof(*py));
+    py->level[0].bgr = (uint8_t *)c;
+    py->level[0].width = w;
+    py->level[0].height = h;
+    py->bytes = (uint64_t)w * h * 3;
+    for (k = 1; k < PYRAMID_MAXLEVEL && (w > 1 || h > 1); k++) {
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        py->level[k].width = w;
+        py->level[k].height = h;
+    }
+    py->nlevel = k;
+}
+
+// ピラミッドの解放
+void freepyramid(pyramid_t *py) {
+    uint32_t k;
+
+    for (k = 0; k < py->nlevel; k++) {
+        xfree(py->level[k].bgr);
+        py->level[k].bgr = NULL;
+    }
+}
+
+// k 段目を作る
+// 作ってある一番近い下の段 j から 2^(k-j) 四方の箱フィルタで縮小する (間の段は作らない)
+static void buildlevel(pyramid_t *py, uint32_t k) {
+    const pyrlevel_t *s;
+    pyrlevel_t *d = &py->level[k];
+    uint32_t j, f, x, y, sx, sy, x1, y1, n;
+    uint32_t sum[3];
+    const uint8_t *p;
+    uint8_t *q;
+
+    for (j = k - 1; py->level[j].bgr == NULL; j--)
+        ;
+    s = &py->level[j];
+    f = 1u << (k - j);
+    d->bgr = (uint8_t *)xmalloc((size_t)d->width * d->height * 3);
+    py->bytes += (uint64_t)d->width * d->height * 3;
+    q = d->bgr;
+    for (y = 0; y < d->height; y++) {
+        y1 = MIN((y + 1) * f, s->height);
+        for (x = 0; x < d->width; x++, q += 3) {
+            // 右端・下端は元の段にある分だけで平均する
+            x1 = MIN((x + 1) * f, s->width);
+            sum[0] = sum[1] = sum[2] = 0;
+            for (sy = y * f; sy < y1; sy++) {
+                p = s->bgr + ((size_t)sy * s->width + x * f) * 3;
+                for (sx = x * f; sx < x1; sx++, p += 3) {
+                    sum[0] += p[0];
+                    sum[1] += p[1];
+                    sum[2] += p[2];
+                }
+            }
+            n = (y1 - y * f) * (x1 - x * f);
+            q[0] = (sum[0] + n / 2) / n;
+            q[1] = (sum[1] + n / 2) / n;
+            q[2] = (sum[2] + n / 2) / n;
+        }
+    }
+    debug("[PYRAMID: OK] level %u %ux%u from level %u\n", k, d->width, d->height, j);
+}
+
+// k 段目 (まだ作っていなければここで作る)
+const pyrlevel_t *pyramidlevel(pyramid_t *py, uint32_t k) {
+    if (py->level[k].bgr == NULL)
+        buildlevel(py, k);
+    return &py->level[k];
+}
+
+// ピラミッドから縮小して rd->cell に入れる (rd はここで初期化し、呼び出し側で解放する)
+// 画像を zoom 倍に拡大して (cx, cy) (画像の幅・高さに対する割合) を中心にした範囲を、
+// 横 cols 文字 (maxline が 0 でなければ maxline 行) に収まるように縮小する
+// 使う段の番号を返す
+uint32_t renderpyramid(pyramid_t *py, consolebmp_t *cbmp, double zoom, double cx, double cy,
+                       uint32_t cols, uint32_t maxline, reducer_t *rd) {
+    const pyrlevel_t *b = &py->level[0], *lv;
+    double cw = MAX(b->width / zoom, 1.0), ch = MAX(b->height / zoom, 1.0);
+    uint32_t k, w, h, x0, y0, y;
+
+    // 表示する範囲 (一番下の段の座標) で文字数・行数を決め、
+    // セル1つに縦横とも1画素以上かかる一番粗い段を選ぶ
+    fitscale(cbmp, (uint32_t)(cw + 0.5), (uint32_t)(ch + 0.5), cols, maxline);
+    for (k = 0; k + 1 < py->nlevel; k++) {
+        if (cw / (2u << k) < cbmp->letter || ch / (2u << k) < cbmp->line * cbmpsub(cbmp))
+            break;
+    }
+    lv = pyramidlevel(py, k);
+
+    // 選んだ段の座標での範囲 (画像からはみ出さないように寄せる)
+    w = MIN(MAX((uint32_t)(cw * lv->width / b->width + 0.5), 1), lv->width);
+    h = MIN(MAX((uint32_t)(ch * lv->height / b->height + 0.5), 1), lv->height);
+    x0 = (uint32_t)MIN(MAX(cx * lv->width - w / 2.0, 0.0), (double)(lv->width - w));
+    y0 = (uint32_t)MIN(MAX(cy * lv->height - h / 2.0, 0.0), (double)(lv->height - h));
+    fitscale(cbmp, w, h, cols, maxline);
+    initreducer(rd, cbmp, w, h);
+    for (y = 0; y < h; y++)
+        reducerow(rd, y, lv->bgr + ((size_t)(y0 + y) * lv->width + x0) * 3);
+    return k;
+}
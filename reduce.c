@@ -0,0 +1,366 @@
+/**
+ * reduce.c
+ * 行ストリームによる縮小 (画像全体をメモリに載せない)
+ * 元画像を1行ずつ受け取り、セルごとの累積に足し込んだら行は捨てる。
+ * メモリは元画像1行分とセルの累積だけで、画像の高さによらない。
+ * 通常ファイルの BMP を出力しながら読むとき (streambmp の pread) は行が上から順に届くので、
+ * 累積はセル行2つ分の輪にして、コンソールの行ができるたびに出力する (メモリは幅 x セル1行分)。
+ * パイプ (ボトムアップは下の行から届く)・RLE (飛ばした行は後から埋まる) と、
+ * 縮小したセルを後で使う呼び出し側 (sixel・グリッド・ピラミッドなど) はセル全体を持つ。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cbmpviewer.h"
+
+// 一度に読み込む行の目安 (バイト)
+#define CHUNK_BYTES (1 << 20)
+
+// 1軸方向の重みの計算
+// 元画像のピクセル i は区間 [i, min(i + 1, end))、セル k は区間 [k * bpl, (k + 1) * bpl)
+// end は画像の端で、縮小して復号した画像では最後のピクセルの途中になる (最後のピクセルは一部だけ数える)
+// bpl >= 1 なので1ピクセルがかかるセルは最大2つ。*k に最初のセルを入れ、そのセルにかかる割合を返す
+// *next には次のセルにかかる割合を入れる
+static inline double axisweight(uint32_t i, uint32_t ncell, double bpl, double end, uint32_t *k, double *next) {
+    double e = MIN(i + 1.0, end), edge, w;
+
+    *k = MIN((uint32_t)(i / bpl), ncell - 1);
+    edge = (*k + 1) * bpl;
+    if (edge >= e || *k + 1 >= ncell) {
+        *next = 0;
+        return e - i;
+    }
+    w = edge - i;
+    *next = e == i + 1.0 ? 1.0 - w : e - edge;
+    return w;
+}
+
+// n 個のピクセルを ncell 個のセルに分けるときの画像の端 (ncell * bpl、n との差が誤差だけなら n)
+static double axisend(uint32_t n, uint32_t ncell, double bpl) {
+    double end = ncell * bpl;
+
+    return fabs(end - n) < 1e-6 ? n : MIN(end, n);
+}
+
+// セル行 r にかかっている元画像の行数
+// 最後のセル行には画像の下端までの行がすべてかかる
+static uint32_t rowcount(const reducer_t *rd, uint32_t r) {
+    double bpl = rd->cbmp->bpl_r, next;
+    uint32_t y, y1, k, n = 0;
+
+    y = (uint32_t)(r * bpl);
+    y = y > 2 ? y - 2 : 0;
+    y1 = r + 1 < rd->rows ? MIN((uint32_t)((r + 1) * bpl) + 2, rd->height) : rd->height;
+    for (; y < y1; y++) {
+        axisweight(y, rd->rows, bpl, rd->yend, &k, &next);
+        if (k == r || (next > 0 && k + 1 == r))
+            n++;
+    }
+    return n;
+}
+
+// セル行 r の累積・残りの行数の場所 (輪ならセル行2つ分を交互に使う)
+static inline uint32_t rowslot(const reducer_t *rd, uint32_t r) {
+    return rd->ob != NULL ? r & 1 : r;
+}
+
+// 行ストリーム縮小の初期化 (ob が NULL でなければセル行2つ分の輪にする)
+static void setupreducer(reducer_t *rd, const consolebmp_t *cbmp, uint32_t width, uint32_t height, outbuf_t *ob) {
+    uint32_t x, r, nslot;
+
+    rd->cbmp = cbmp;
+    rd->width = width;
+    rd->height = height;
+    rd->rows = cbmp->line * cbmpsub(cbmp);
+    rd->xend = axisend(width, cbmp->letter, cbmp->bpl_c);
+    rd->yend = axisend(height, rd->rows, cbmp->bpl_r);
+    rd->ready = 0;
+    rd->ob = ob;
+    nslot = ob != NULL ? MIN(rd->rows, 2) : rd->rows;
+    rd->cx = (uint32_t *)xcalloc(width, sizeof(uint32_t));
+    rd->wx = (double *)xcalloc(width, sizeof(double));
+    rd->wn = (double *)xcalloc(width, sizeof(double));
+    rd->hsum = (double *)xcalloc((size_t)(cbmp->letter + 1) * 3, sizeof(double));
+    rd->acc = (double *)xcalloc((size_t)cbmp->letter * nslot * 3, sizeof(double));
+    rd->pending = (uint32_t *)xcalloc(nslot, sizeof(uint32_t));
+    rd->cell = (pixel_t *)xcalloc((size_t)cbmp->letter * (ob != NULL ? cbmpsub(cbmp) : rd->rows), sizeof(pixel_t));
+    rd->pal = NULL;
+    rd->npal = 0;
+    rd->hist = NULL;
+    rd->bgr = NULL;
+    for (x = 0; x < width; x++)
+        rd->wx[x] = axisweight(x, cbmp->letter, cbmp->bpl_c, rd->xend, &rd->cx[x], &rd->wn[x]);
+
+    // セル行ごとに、かかっている元画像の行数を数えておく (輪なら最初の2つだけ)
+    for (r = 0; r < nslot; r++)
+        rd->pending[r] = rowcount(rd, r);
+}
+
+// 行ストリーム縮小の初期化
+// 列ごとの重みは1行ごとに使うので表にしておき、行ごとの重みは行を受け取ったときに求める
+// (表にすると元画像の高さに比例するメモリが要る)
+// セルの並びは cbmp の bpl_c・bpl_r で決まる幅 letter * bpl_c・高さ rows * bpl_r の範囲を覆い、
+// width・height がそれより大きい (縮小して復号して端のピクセルが途中まで) ときは、はみ出した分は数えない
+// 行はどの順番で渡してもよく、縮小したセルは rd->cell に残る
+void initreducer(reducer_t *rd, const consolebmp_t *cbmp, uint32_t width, uint32_t height) {
+    setupreducer(rd, cbmp, width, height, NULL);
+}
+
+// 行を上から順に渡すときの行ストリーム縮小の初期化
+// 累積はセル行2つ分の輪にして、コンソールの行ができるたびに ob に追加する (rd->cell には残らない)
+// 1行が3つ以上のセル行にかかる (bpl_r < 1) ときは輪にできないので initreducer と同じにする
+void initringreducer(reducer_t *rd, const consolebmp_t *cbmp, uint32_t width, uint32_t height, outbuf_t *ob) {
+    setupreducer(rd, cbmp, width, height, cbmp->bpl_r >= 1 ? ob : NULL);
+}
+
+// 行ストリーム縮小の終了
+void freereducer(reducer_t *rd) {
+    xfree(rd->cx);
+    xfree(rd->wx);
+    xfree(rd->wn);
+    xfree(rd->hsum);
+    xfree(rd->acc);
+    xfree(rd->pending);
+    xfree(rd->cell);
+    xfree(rd->hist);
+    xfree(rd->bgr);
+}
+
+// セル行 r の累積が終わったので平均を求める
+static void finishrow(reducer_t *rd, uint32_t r) {
+    uint32_t j, letter = rd->cbmp->letter, sub = cbmpsub(rd->cbmp);
+    double area = rd->cbmp->bpl_c * rd->cbmp->bpl_r;
+    double *a = rd->acc + (size_t)rowslot(rd, r) * letter * 3;
+    pixel_t *c = rd->cell + (size_t)(rd->ob != NULL ? r % sub : r) * letter;
+
+    // 平均 (整数比のときは以前の整数除算と同じ値になる)
+    for (j = 0; j < letter; j++, a += 3, c++) {
+        c->red   = (uint8_t)(a[0] / area + 1e-9);
+        c->green = (uint8_t)(a[1] / area + 1e-9);
+        c->blue  = (uint8_t)(a[2] / area + 1e-9);
+        if (rd->ob != NULL)
+            a[0] = a[1] = a[2] = 0;
+    }
+    // 輪: 空けた場所を2つ先のセル行に回し、コンソールの行ができたら出力する
+    // (行は上から順に届くので、2つ先のセル行に足し込むのはセル行 r が完成した後)
+    if (rd->ob != NULL) {
+        if (r + 2 < rd->rows)
+            rd->pending[rowslot(rd, r)] = rowcount(rd, r + 2);
+        if (r % sub == sub - 1) {
+            outputlines(rd->cell, rd->cbmp, 0, 1, rd->ob);
+            rd->ready++;
+        }
+        return;
+    }
+    // 上から続けて完成したコンソールの行数を進める
+    while (rd->ready < rd->cbmp->line) {
+        for (j = 0; j < sub; j++) {
+            if (rd->pending[rd->ready * sub + j] != 0)
+                return;
+        }
+        rd->ready++;
+    }
+}
+
+// セル行 r に横方向の総和を重み w で足し込む
+static void addrow(reducer_t *rd, uint32_t r, double w) {
+    uint32_t j, n = rd->cbmp->letter * 3;
+    double *a = rd->acc + (size_t)rowslot(rd, r) * n;
+
+    for (j = 0; j < n; j++)
+        a[j] += w * rd->hsum[j];
+    if (--rd->pending[rowslot(rd, r)] == 0)
+        finishrow(rd, r);
+}
+
+// 上から y 行目の1行 (B G R の並び) を足し込む
+// 行はどの順番で渡してもよい (initringreducer で初期化したときは上から順に)
+void reducerow(reducer_t *rd, uint32_t y, const uint8_t *p) {
+    uint32_t x, k, r;
+    double w, next, *h = rd->hsum;
+
+    // 横方向: セルごとの総和
+    for (k = 0; k < (rd->cbmp->letter + 1) * 3; k++)
+        h[k] = 0;
+    for (x = 0; x < rd->width; x++, p += 3) {
+        k = rd->cx[x] * 3;
+        w = rd->wx[x];
+        if (w == 1.0) {
+            h[k + 0] += p[2];
+            h[k + 1] += p[1];
+            h[k + 2] += p[0];
+        } else {
+            h[k + 0] += w * p[2];
+            h[k + 1] += w * p[1];
+            h[k + 2] += w * p[0];
+            h[k + 3] += rd->wn[x] * p[2];
+            h[k + 4] += rd->wn[x] * p[1];
+            h[k + 5] += rd->wn[x] * p[0];
+        }
+    }
+
+    // 縦方向: かかっているセル行 (最大2つ) に足し込む
+    w = axisweight(y, rd->rows, rd->cbmp->bpl_r, rd->yend, &r, &next);
+    addrow(rd, r, w);
+    if (next > 0)
+        addrow(rd, r + 1, next);
+}
+
+// セル行 r のヒストグラムに1行分のパレット番号を重み wy で足し込む
+// ヒストグラムはセル行2つ分を交互に使う (1行がかかるセル行は隣り合う最大2つなので、
+// 行を上からか下から順に渡せば、使い終わる前に同じ場所を別のセル行が使うことはない)
+static void addhist(reducer_t *rd, uint32_t r, double wy, const uint8_t *idx) {
+    uint32_t x, j, i, k, letter = rd->cbmp->letter, npal = rd->npal;
+    double w, c, *h = rd->hist + (size_t)(r & 1) * (letter + 1) * npal;
+    double *a;
+
+    for (x = 0; x < rd->width; x++) {
+        k = rd->cx[x] * npal + idx[x];
+        w = rd->wx[x];
+        if (w == 1.0) {
+            h[k] += wy;
+        } else {
+            h[k] += w * wy;
+            h[k + npal] += rd->wn[x] * wy;
+        }
+    }
+    if (--rd->pending[rowslot(rd, r)] != 0)
+        return;
+
+    // セル行が完成したらヒストグラムから色の総和を求めて空にする
+    a = rd->acc + (size_t)rowslot(rd, r) * letter * 3;
+    for (j = 0; j < letter; j++, h += npal, a += 3) {
+        for (i = 0; i < npal; i++) {
+            if ((c = h[i]) == 0)
+                continue;
+            a[0] += c * rd->pal[i].red;
+            a[1] += c * rd->pal[i].green;
+            a[2] += c * rd->pal[i].blue;
+            h[i] = 0;
+        }
+    }
+    finishrow(rd, r);
+}
+
+// 上から y 行目の1行 (npal 色のパレットの番号の並び) を足し込む
+// 1セルの画素数がパレットの色数以上なら、画素ごとに色を展開せずパレット番号のヒストグラムを数え、
+// セルの平均はセル行が完成したときにヒストグラムから求める。そうでなければ B G R に展開して足し込む
+// 行は上からか下から順に渡すこと
+void reduceindexrow(reducer_t *rd, uint32_t y, const uint8_t *idx, const pixel_t *pal, uint32_t npal) {
+    uint32_t x, r;
+    double w, next;
+    uint8_t *p;
+
+    if (rd->pal == NULL) {
+        rd->pal = pal;
+        rd->npal = npal;
+        if (rd->cbmp->bpl_c * rd->cbmp->bpl_r >= npal)
+            rd->hist = (double *)xcalloc((size_t)2 * (rd->cbmp->letter + 1) * npal, sizeof(double));
+        else
+            rd->bgr = (uint8_t *)xcalloc(rd->width, 3);
+    }
+    if (rd->hist == NULL) {
+        for (x = 0, p = rd->bgr; x < rd->width; x++, p += 3) {
+            p[0] = pal[idx[x]].blue;
+            p[1] = pal[idx[x]].green;
+            p[2] = pal[idx[x]].red;
+        }
+        reducerow(rd, y, rd->bgr);
+        return;
+    }
+
+    w = axisweight(y, rd->rows, rd->cbmp->bpl_r, rd->yend, &r, &next);
+    addhist(rd, r, w, idx);
+    if (next > 0)
+        addhist(rd, r + 1, next, idx);
+}
+
+// 完成した行を書き出す (ob が NULL なら何もしない)
+// 輪のときは完成したときに ob に追加してあるので書き出すだけ
+void flushready(reducer_t *rd, uint32_t *emitted, outbuf_t *ob, int fd) {
+    if (ob == NULL || *emitted == rd->ready)
+        return;
+    if (rd->ob == NULL)
+        outputlines(rd->cell, rd->cbmp, *emitted, rd->ready, ob);
+    *emitted = rd->ready;
+    debugflush();
+    obflush(ob, fd);
+}
+
+// streambmp が行を上から順に足し込むか (RLE でない通常ファイルは pread で上の行から読む)
+int bmpinorder(FILE *fp, const bmpformat_t *bf) {
+    struct stat st;
+
+    if (bf->compression == BI_RLE8 || bf->compression == BI_RLE4)
+        return 0;
+    return fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// 画像全体をメモリに載せずに rd に足し込む
+// ob が NULL でなければ完成した行から出力する
+// 通常ファイルなら pread で上の行から順に読み (ボトムアップならファイルの後ろから)、
+// セルの行ができるたびに書き出す (rd は initringreducer で初期化してよい)。
+// パイプはファイルの順に読んで最後にまとめて書き出す
+// 1行ずつ画素形式に合わせて展開して足し込む。RLE はファイルの順に展開する
+// ヘッダ・パレットは fp から読み込み済みであること
+void streambmp(FILE *fp, const bmpformat_t *bf, reducer_t *rd, outbuf_t *ob, int fd) {
+    uint64_t stride = bf->stride;
+    uint64_t off;
+    uint32_t y, k, r, chunk, emitted = 0;
+    uint8_t *buf, *tmp, *row;
+    ssize_t n;
+    size_t got;
+
+    if (bf->compression == BI_RLE8 || bf->compression == BI_RLE4) {
+        streamrle(fp, bf, rd, ob, fd);
+        return;
+    }
+    chunk = MAX(CHUNK_BYTES / stride, 1);
+    chunk = MIN(chunk, bf->height);
+    buf = (uint8_t *)xcalloc(chunk, stride);
+    tmp = (uint8_t *)xcalloc(bf->width, 3);
+
+    if (bmpinorder(fp, bf)) {
+        debug("[STREAMDECODE: ..] pread chunk=%u rows\n", chunk);
+        for (y = 0; y < bf->height; y += k) {
+            // 上から y 行目から k 行分はファイル上では連続している (ボトムアップなら順番は逆)
+            k = MIN(chunk, bf->height - y);
+            off = bf->offbits + (bf->topdown ? (uint64_t)y : (uint64_t)bf->height - y - k) * stride;
+            for (got = 0; got < k * stride; got += n) {
+                n = pread(fileno(fp), buf + got, k * stride - got, off + got);
+                if (n < 0 && errno == EINTR) {
+                    n = 0;
+                    continue;
+                }
+                if (n <= 0)
+                    fail(CIMAGE_EREAD, "file read");
+            }
+            for (r = 0; r < k; r++) {
+                row = buf + (bf->topdown ? r : k - 1 - r) * stride;
+                reducebmprow(rd, bf, y + r, row, tmp);
+            }
+            flushready(rd, &emitted, ob, fd);
+        }
+    } else {
+        debug("[STREAMDECODE: ..] fread chunk=%u rows\n", chunk);
+        skiptobits(fp, bf);
+        // ボトムアップならファイル上の先頭は一番下の行
+        for (y = 0; y < bf->height; y += k) {
+            k = MIN(chunk, bf->height - y);
+            if (fread(buf, stride, k, fp) != k)
+                fail(CIMAGE_EREAD, "file read");
+            for (r = 0; r < k; r++)
+                reducebmprow(rd, bf, bf->topdown ? y + r : bf->height - 1 - (y + r), buf + r * stride, tmp);
+            flushready(rd, &emitted, ob, fd);
+        }
+    }
+    debug("[STREAMDECODE: OK]\n");
+
+    xfree(buf);
+    xfree(tmp);
+}
@@ -0,0 +1,185 @@
+/**
+ * render.c
+ * 行バンド単位の並列描画
+ * セルの行をいくつかのバンドに分け、縮小・色変換・エスケープシーケンス生成を
+ * ワーカースレッドで並列に行う。出力はバンドごとのバッファにためて上から順に書き出す。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cbmpviewer.h"
+
+// 1スレッドあたりのバンド数 (処理時間のばらつきをならすため少し細かく分ける)
+#define BANDS_PER_THREAD 4
+
+// バンド1つ分の処理
+static void renderband(renderer_t *rd, uint32_t band) {
+    uint32_t l0 = band * rd->bandlines;
+    uint32_t l1 = MIN(l0 + rd->bandlines, rd->cbmp->line);
+
+    rd->band[band].len = 0;
+    if (rd->box != NULL)
+        rd->box(rd->img, rd->cbmp, l0, l1, rd->cell);
+    else
+        downsample(rd->sat, rd->cbmp, l0, l1, rd->cell);
+    outputlines(rd->cell, rd->cbmp, l0, l1, &rd->band[band]);
+}
+
+// ワーカースレッド
+// 新しいフレームが来るまで待ち、未処理のバンドを1つずつ取って処理する
+static void *renderworker(void *arg) {
+    renderer_t *rd = (renderer_t *)arg;
+    uint32_t band, gen = 0;
+
+    pthread_mutex_lock(&rd->lock);
+    for (;;) {
+        while (!rd->quit && (rd->gen == gen || rd->next >= rd->nband))
+            pthread_cond_wait(&rd->wake, &rd->lock);
+        if (rd->quit)
+            break;
+        band = rd->next++;
+        if (rd->next >= rd->nband)
+            gen = rd->gen;
+        pthread_mutex_unlock(&rd->lock);
+
+        renderband(rd, band);
+
+        pthread_mutex_lock(&rd->lock);
+        rd->bdone[band] = 1;
+        pthread_cond_broadcast(&rd->done);
+    }
+    pthread_mutex_unlock(&rd->lock);
+    return NULL;
+}
+
+// 並列描画の初期化
+// nthreads が1以下ならスレッドは作らず呼び出し元で描画する
+void initrenderer(renderer_t *rd, uint32_t nthreads) {
+    uint32_t i;
+
+    rd->nthreads = MAX(nthreads, 1);
+    rd->th = NULL;
+    rd->band = NULL;
+    rd->bdone = NULL;
+    rd->nbandbuf = 0;
+    rd->nband = rd->next = 0;
+    rd->gen = 0;
+    rd->quit = 0;
+    if (rd->nthreads == 1)
+        return;
+
+    pthread_mutex_init(&rd->lock, NULL);
+    pthread_cond_init(&rd->wake, NULL);
+    pthread_cond_init(&rd->done, NULL);
+    rd->th = (pthread_t *)xmalloc(sizeof(pthread_t) * rd->nthreads);
+    for (i = 0; i < rd->nthreads; i++) {
+        if (pthread_create(&rd->th[i], NULL, renderworker, rd) != 0) {
+            // 作れた分だけを freerenderer で終了させる
+            rd->nthreads = i;
+            fail(CIMAGE_ETHREAD, "thread create");
+        }
+    }
+    debug("[RENDERER: OK] threads=%u\n", rd->nthreads);
+}
+
+// 並列描画の終了
+void freerenderer(renderer_t *rd) {
+    uint32_t i;
+
+    if (rd->th != NULL) {
+        pthread_mutex_lock(&rd->lock);
+        rd->quit = 1;
+        pthread_cond_broadcast(&rd->wake);
+        pthread_mutex_unlock(&rd->lock);
+        for (i = 0; i < rd->nthreads; i++)
+            pthread_join(rd->th[i], NULL);
+        xfree(rd->th);
+        rd->th = NULL;
+        pthread_mutex_destroy(&rd->lock);
+        pthread_cond_destroy(&rd->wake);
+        pthread_cond_destroy(&rd->done);
+    }
+    for (i = 0; i < rd->nbandbuf; i++)
+        obfree(&rd->band[i]);
+    xfree(rd->band);
+    xfree(rd->bdone);
+    rd->band = NULL;
+    rd->bdone = NULL;
+    rd->nbandbuf = 0;
+}
+
+// 1フレームの描画
+// cell は letter x line 個のセルの作業領域。出力は上のバンドから順に fd へ書き出す
+// ob にすでに入っている内容 (カーソル移動など) はフレームの前に書き出す
+// 出力内容はスレッド数によらず同じになる
+// img が NULL でなければ整数比のカーネルで縮小する (カーネルはフレームごとに1回だけ選ぶ)
+// img はカーネルがある大きさのときだけ渡し、そうでなければ積分画像を作って sat に渡すこと
+void renderframe(renderer_t *rd, const sat_t *sat, const bmpimage_t *img, consolebmp_t *cbmp, pixel_t *cell, outbuf_t *ob, int fd) {
+    boxkernel_t box = img != NULL ? boxkernel(cbmp, img->width, img->height) : NULL;
+    uint32_t i, nband, bandlines;
+
+    // シングルスレッド
+    if (rd->th == NULL || cbmp->line < 2) {
+        if (box != NULL)
+            box(img, cbmp, 0, cbmp->line, cell);
+        else
+            downsample(sat, cbmp, 0, cbmp->line, cell);
+        outputlines(cell, cbmp, 0, cbmp->line, ob);
+        debugflush();
+        obflush(ob, fd);
+        return;
+    }
+
+    // バンドの分割とバンドごとの出力バッファの用意
+    // ワーカースレッドでは fail() で呼び出し元に戻れないので、広げずに済む最大の大きさで確保しておく
+    nband = MIN(rd->nthreads * BANDS_PER_THREAD, cbmp->line);
+    bandlines = (cbmp->line + nband - 1) / nband;
+    if (nband > rd->nbandbuf) {
+        rd->band = (outbuf_t *)xrealloc(rd->band, sizeof(outbuf_t) * nband);
+        rd->bdone = (uint8_t *)xrealloc(rd->bdone, nband);
+        for (i = rd->nbandbuf; i < nband; i++)
+            obinit(&rd->band[i], 0);
+        rd->nbandbuf = nband;
+    }
+    for (i = 0; i < nband; i++)
+        obreserve(&rd->band[i], ((size_t)cbmp->letter * CELL_MAXBYTES + 16) * bandlines);
+
+    pthread_mutex_lock(&rd->lock);
+    rd->sat = sat;
+    rd->img = img;
+    rd->box = box;
+    rd->cbmp = cbmp;
+    rd->cell = cell;
+    rd->bandlines = bandlines;
+    rd->nband = (cbmp->line + rd->bandlines - 1) / rd->bandlines;
+    for (i = 0; i < rd->nband; i++)
+        rd->bdone[i] = 0;
+    rd->next = 0;
+    rd->gen++;
+    pthread_cond_broadcast(&rd->wake);
+    pthread_mutex_unlock(&rd->lock);
+
+    // 終わったバンドから上から順に書き出す
+    debugflush();
+    obflush(ob, fd);
+    for (i = 0; i < rd->nband; i++) {
+        pthread_mutex_lock(&rd->lock);
+        while (!rd->bdone[i])
+            pthread_cond_wait(&rd->done, &rd->lock);
+        pthread_mutex_unlock(&rd->lock);
+        if (ob->keep) {
+            // メモリへの描画ではバンドの内容を ob の後ろにつなげる
+            obreserve(ob, rd->band[i].len);
+            obputs(ob, rd->band[i].buf, rd->band[i].len);
+            rd->band[i].len = 0;
+        } else {
+            rd->band[i].tee = ob->tee;
+            rd->band[i].stats = ob->stats;
+            obflush(&rd->band[i], fd);
+            ob->tee = rd->band[i].tee;
+        }
+    }
+}
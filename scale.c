@@ -0,0 +1,204 @@
+/**
+ * scale.c
+ * 積分画像(summed-area table)による縮小
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "cbmpviewer.h"
+
+// 1軸方向の重み付き区間 (ピクセル [lo, hi) を重み w で足す)
+typedef struct TAG_SPAN {
+    uint32_t lo;
+    uint32_t hi;
+    double w;
+} span_t;
+
+// 実数区間 [a, b) を、両端の端数ピクセルと中の整数区間に分ける
+// 返り値は区間の数 (最大3)
+static int spans(double a, double b, uint32_t limit, span_t *sp) {
+    uint32_t ia, ib;
+    int n = 0;
+
+    if (b > limit) b = limit;
+    ia = (uint32_t)ceil(a);
+    ib = (uint32_t)floor(b);
+    if (ia > ib) {
+        // 1ピクセルの中に収まっている
+        sp[n].lo = (uint32_t)floor(a);
+        sp[n].hi = sp[n].lo + 1;
+        sp[n++].w = b - a;
+        return n;
+    }
+    if ((double)ia > a) {
+        sp[n].lo = ia - 1;
+        sp[n].hi = ia;
+        sp[n++].w = ia - a;
+    }
+    if (ib > ia) {
+        sp[n].lo = ia;
+        sp[n].hi = ib;
+        sp[n++].w = 1.0;
+    }
+    if (b > (double)ib && ib < limit) {
+        sp[n].lo = ib;
+        sp[n].hi = ib + 1;
+        sp[n++].w = b - ib;
+    }
+    return n;
+}
+
+// 積分画像の構築
+// s[y][x] は上 y 行・左 x 列の RGB それぞれの総和
+// 32bit で桁あふれするが、セル1つ分の総和が 32bit に収まれば差分は正しく求まる
+// sat->s が NULL でなければ確保済みの領域を使い回す (動画のフレームごとに呼ぶため)
+void buildsat(const bmpimage_t *img, sat_t *sat) {
+    uint32_t x, y, r, g, b;
+    size_t w1 = (size_t)img->width + 1;
+    uint32_t *s, *up;
+    const uint8_t *p;
+
+    if (sat->s == NULL || sat->width != (uint32_t)img->width || sat->height != (uint32_t)img->height) {
+        xfree(sat->s);
+        sat->s = NULL;
+        sat->s = (uint32_t *)xcalloc(w1 * (img->height + 1) * 3, sizeof(uint32_t));
+        sat->width = img->width;
+        sat->height = img->height;
+    }
+    for (y = 0; y < (uint32_t)img->height; y++) {
+        up = sat->s + w1 * y * 3;
+        s = up + w1 * 3;
+        p = bmprow(img, y);
+        r = g = b = 0;
+        for (x = 0; x < (uint32_t)img->width; x++, p += 3) {
+            b += p[0];
+            g += p[1];
+            r += p[2];
+            s[(x + 1) * 3 + 0] = up[(x + 1) * 3 + 0] + r;
+            s[(x + 1) * 3 + 1] = up[(x + 1) * 3 + 1] + g;
+            s[(x + 1) * 3 + 2] = up[(x + 1) * 3 + 2] + b;
+        }
+    }
+}
+
+// 積分画像の解放
+void freesat(sat_t *sat) {
+    xfree(sat->s);
+    sat->s = NULL;
+}
+
+// セルごとの平均色を求める (line0 行目から line1 - 1 行目まで)
+// セル (i, j) はピクセル [j * bpl_c, (j + 1) * bpl_c) x [i * bpl_r, (i + 1) * bpl_r) の範囲
+// 端数ピクセルは覆っている面積の割合で重み付けする
+// 半ブロックのときは1行に上下2つのセルがあり、i はその半行単位で数える
+void downsample(const sat_t *sat, const consolebmp_t *cbmp, uint32_t line0, uint32_t line1, pixel_t *cell) {
+    uint32_t i, j, k, l, c;
+    size_t w1 = (size_t)sat->width + 1;
+    span_t sx[3], sy[3];
+    int nx, ny;
+    double sum[3], area, w;
+    uint32_t part[3];
+    const uint32_t *s00, *s01, *s10, *s11;
+
+    line0 *= cbmpsub(cbmp);
+    line1 *= cbmpsub(cbmp);
+    cell += (size_t)line0 * cbmp->letter;
+    for (i = line0; i < line1; i++) {
+        ny = spans(i * cbmp->bpl_r, (i + 1) * cbmp->bpl_r, sat->height, sy);
+        for (j = 0; j < cbmp->letter; j++) {
+            nx = spans(j * cbmp->bpl_c, (j + 1) * cbmp->bpl_c, sat->width, sx);
+            sum[0] = sum[1] = sum[2] = 0;
+            area = 0;
+            for (k = 0; k < ny; k++) {
+                for (l = 0; l < nx; l++) {
+                    w = sy[k].w * sx[l].w;
+                    s00 = sat->s + (w1 * sy[k].lo + sx[l].lo) * 3;
+                    s01 = sat->s + (w1 * sy[k].lo + sx[l].hi) * 3;
+                    s10 = sat->s + (w1 * sy[k].hi + sx[l].lo) * 3;
+                    s11 = sat->s + (w1 * sy[k].hi + sx[l].hi) * 3;
+                    for (c = 0; c < 3; c++) {
+                        part[c] = s11[c] - s10[c] - s01[c] + s00[c];
+                        sum[c] += w * part[c];
+                    }
+                    area += w * (sy[k].hi - sy[k].lo) * (sx[l].hi - sx[l].lo);
+                }
+            }
+            // 平均 (整数比のときは以前の整数除算と同じ値になる)
+            cell->red   = (uint8_t)(sum[0] / area + 1e-9);
+            cell->green = (uint8_t)(sum[1] / area + 1e-9);
+            cell->blue  = (uint8_t)(sum[2] / area + 1e-9);
+            cell++;
+        }
+    }
+}
+
+// 整数比の縮小カーネル
+// セル1つが元画像のちょうど CW x CH 画素 (文字なら縦は横の2倍、半ブロックなら半文字で同じ) のときは
+// 積分画像を作らずに画像の行から直接平均を求める。ループの回数は定数で、行は左から連続して読み、
+// セル BOX_CHUNK 個分の総和をまとめて足してから、平均は画素数の逆数の掛け算で求める
+// (総和は最大 255 x 32 なので、BOX_SHIFT ビットの逆数で floor(総和 / 画素数) と同じ値になる)
+#define BOX_SHIFT 20
+#define BOX_CHUNK 256
+#define BOXKERNEL(CW, CH) \
+static void box##CW##x##CH(const bmpimage_t *img, const consolebmp_t *cbmp, uint32_t line0, uint32_t line1, pixel_t *cell) { \
+    const uint32_t recip = ((1u << BOX_SHIFT) + CW * CH - 1) / (CW * CH); \
+    uint32_t acc[BOX_CHUNK * 3]; \
+    uint32_t i, j, j0, n, k, l; \
+    const uint8_t *p; \
+\
+    line0 *= cbmpsub(cbmp); \
+    line1 *= cbmpsub(cbmp); \
+    cell += (size_t)line0 * cbmp->letter; \
+    for (i = line0; i < line1; i++) { \
+        for (j0 = 0; j0 < cbmp->letter; j0 += n) { \
+            n = MIN(BOX_CHUNK, cbmp->letter - j0); \
+            memset(acc, 0, sizeof(uint32_t) * n * 3); \
+            for (k = 0; k < CH; k++) { \
+                p = bmprow(img, i * CH + k) + (size_t)j0 * CW * 3; \
+                for (j = 0; j < n; j++) { \
+                    for (l = 0; l < CW; l++, p += 3) { \
+                        acc[j * 3 + 0] += p[2]; \
+                        acc[j * 3 + 1] += p[1]; \
+                        acc[j * 3 + 2] += p[0]; \
+                    } \
+                } \
+            } \
+            for (j = 0; j < n; j++, cell++) { \
+                cell->red   = (acc[j * 3 + 0] * recip) >> BOX_SHIFT; \
+                cell->green = (acc[j * 3 + 1] * recip) >> BOX_SHIFT; \
+                cell->blue  = (acc[j * 3 + 2] * recip) >> BOX_SHIFT; \
+            } \
+        } \
+    } \
+}
+
+// 文字 (縦は横の2倍)
+BOXKERNEL(1, 2)
+BOXKERNEL(2, 4)
+BOXKERNEL(3, 6)
+BOXKERNEL(4, 8)
+// 半ブロック
+BOXKERNEL(1, 1)
+BOXKERNEL(2, 2)
+BOXKERNEL(3, 3)
+BOXKERNEL(4, 4)
+
+// 整数比の縮小カーネルを選ぶ (使えなければ NULL を返し、積分画像の downsample で縮小する)
+// 幅 width・高さ height の画像のセル1つがちょうど CW x CH 画素になる組み合わせだけを用意している
+boxkernel_t boxkernel(const consolebmp_t *cbmp, uint32_t width, uint32_t height) {
+    static const boxkernel_t text[4] = {box1x2, box2x4, box3x6, box4x8};
+    static const boxkernel_t half[4] = {box1x1, box2x2, box3x3, box4x4};
+    uint32_t cw, ch, rows = cbmp->line * cbmpsub(cbmp);
+
+    if (cbmp->letter == 0 || rows == 0 || width % cbmp->letter != 0 || height % rows != 0)
+        return NULL;
+    cw = width / cbmp->letter;
+    ch = height / rows;
+    if (cw < 1 || cw > 4 || ch != (cbmp->half ? cw : cw * 2))
+        return NULL;
+    debug("[BOXKERNEL: OK] %ux%u\n", cw, ch);
+    return cbmp->half ? half[cw - 1] : text[cw - 1];
+}
@@ -0,0 +1,613 @@
+/**
+ * serve.c
+ * 描画デーモン (--serve) とそのクライアント (--client)
+ * Unix ドメインソケットで要求 (画像のパスか画像そのものと、横幅・色数・しきい値) を受け、
+ * 描画結果のエスケープシーケンスを返す。近似色探索テーブルと描画用のバッファは
+ * ワーカーごとのコンテキストに残るので、2回目以降の要求は起動もテーブルの構築もしない。
+ * 接続の読み書きは1スレッドのイベントループ (poll) で行い、描画はワーカーのスレッドプールで行う。
+ * 待ち行列が一杯のときは要求を読まず、接続数が上限のときは受け付けないので、
+ * 溜まった分は送り手 (クライアント) の側で待たされる。
+ *
+ * 要求は1行のヘッダ (空白区切りの key=value) で、path= は行末までをパスとする
+ *   cols=80 color=256 threshold=128,128,128 half=0 path=/path/to/image.png\n
+ *   cols=80 color=truecolor size=12345\n に続けて画像 12345 byte
+ * 応答は "OK 長さ\n" に続けて描画結果か、"ERR エラーコード メッセージ\n"
+ * 1つの接続で続けて何度でも要求できる。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "cbmpviewer.h"
+
+// 同時に扱う接続数の上限 (超えたら accept しない)
+#define SERVE_MAXCLIENTS 256
+// 描画待ちの要求の数の上限 (ワーカー1つあたり)
+#define SERVE_QUEUE 4
+// ヘッダ1行の長さの上限
+#define SERVE_MAXHEADER (PATH_MAX + 256)
+// ソケットで送る画像の大きさの上限 (大きな画像はパスで渡す)
+#define SERVE_MAXBODY ((size_t)64 << 20)
+// 1回に読む量
+#define SERVE_READ 65536
+
+// 接続の状態
+enum {
+    CLIENT_READ,    // 要求を読んでいる
+    CLIENT_WAIT,    // 要求がそろって待ち行列の空きを待っている
+    CLIENT_RENDER,  // ワーカーが描画している (ワーカーのもの)
+    CLIENT_WRITE,   // 応答を書いている
+};
+
+// 要求
+typedef struct TAG_REQUEST {
+    uint32_t cols, maxline;
+    int mode, half;
+    uint8_t threshold_r, threshold_g, threshold_b;
+    const char *path;   // 画像のパス (NULL ならヘッダに続く size byte が画像)
+    size_t size;
+} request_t;
+
+// 接続
+typedef struct TAG_CLIENT {
+    int fd;
+    int state;
+    char *in;           // 受け取った要求 (ヘッダと画像、続けて送られた次の要求の途中まで)
+    size_t inlen, incap;
+    size_t hdrlen;      // ヘッダの長さ (解析するまで 0)
+    size_t reqlen;      // 要求1つ分の長さ (そろうまで 0)
+    request_t req;
+    char *out;          // 応答 (接続が続く間は確保したまま使い回す)
+    size_t outlen, outoff, outcap;
+    int closing;        // 応答を書いたら閉じる
+    struct TAG_CLIENT *next; // 描画の終わった接続のリスト
+} client_t;
+
+// デーモンの状態
+typedef struct TAG_SERVER {
+    client_t **queue;   // 描画待ちの接続 (リングバッファ)
+    uint32_t qhead, qlen, qcap;
+    client_t *done;     // 描画の終わった接続
+    int wake[2];        // 描画が終わったらイベントループを起こすパイプ
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} server_t;
+
+static volatile sig_atomic_t stopping = 0;
+
+// 終了のシグナル (poll を抜けてソケットを消してから終わる)
+static void onstop(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+// 応答に n byte 追加できるようにする
+static void outreserve(client_t *c, size_t n) {
+    if (c->outlen + n <= c->outcap)
+        return;
+    c->outcap = MAX(c->outcap * 2, c->outlen + n);
+    c->out = (char *)xrealloc(c->out, c->outcap);
+}
+
+// エラーの応答を作る
+static void replyerror(client_t *c, int err, const char *msg) {
+    outreserve(c, strlen(msg) + 32);
+    c->outlen = snprintf(c->out, c->outcap, "ERR %d %s\n", err, msg);
+    c->outoff = 0;
+}
+
+// ヘッダ1行 (line は '\0' 終端にしてある) を解析する
+// 不正なら 0 を返して msg に理由を書く
+static int parserequest(char *line, request_t *req, const char **msg) {
+    char *p = line, *key, *val;
+    unsigned r, g, b;
+
+    memset(req, 0, sizeof(*req));
+    req->cols = 80;
+    req->mode = CIMAGE_COLOR8;
+    req->threshold_r = req->threshold_g = req->threshold_b = 128;
+    while (*p != '\0') {
+        while (*p == ' ')
+            p++;
+        if (*p == '\0')
+            break;
+        key = p;
+        if ((val = strchr(p, '=')) == NULL) {
+            *msg = "malformed request";
+            return 0;
+        }
+        *val++ = '\0';
+        // パスは空白を含めて行末まで (画像は続かないのでヘッダだけで要求がそろう)
+        if (strcmp(key, "path") == 0) {
+            req->path = val;
+            req->size = 0;
+            break;
+        }
+        for (p = val; *p != '\0' && *p != ' '; p++)
+            ;
+        if (*p == ' ')
+            *p++ = '\0';
+        if (strcmp(key, "cols") == 0) {
+            req->cols = MAX(atoi(val), 1);
+        } else if (strcmp(key, "lines") == 0) {
+            req->maxline = atoi(val);
+        } else if (strcmp(key, "color") == 0) {
+            if (strcmp(val, "8") == 0)
+                req->mode = CIMAGE_COLOR8;
+            else if (strcmp(val, "256") == 0)
+                req->mode = CIMAGE_COLOR256;
+            else if (strcmp(val, "truecolor") == 0)
+                req->mode = CIMAGE_TRUECOLOR;
+            else {
+                *msg = "unknown color mode";
+                return 0;
+            }
+        } else if (strcmp(key, "threshold") == 0) {
+            if (sscanf(val, "%u,%u,%u", &r, &g, &b) != 3) {
+                *msg = "malformed threshold";
+                return 0;
+            }
+            req->threshold_r = r;
+            req->threshold_g = g;
+            req->threshold_b = b;
+        } else if (strcmp(key, "half") == 0) {
+            req->half = atoi(val) != 0;
+        } else if (strcmp(key, "size") == 0 && req->path == NULL) {
+            req->size = strtoull(val, NULL, 10);
+        }
+        // 知らないキーは無視する (クライアントが新しくても古いデーモンで使えるように)
+    }
+    if (req->path == NULL && req->size == 0) {
+        *msg = "no image (path or size)";
+        return 0;
+    }
+    if (req->size > SERVE_MAXBODY) {
+        *msg = "image too large (send the path instead)";
+        return 0;
+    }
+    return 1;
+}
+
+// 受け取った分から要求1つがそろったか調べる
+// そろったら reqlen を設定して 1 を返す (不正な要求ならエラーの応答を作って閉じる)
+static int checkrequest(client_t *c) {
+    char *nl;
+    const char *msg;
+
+    // ヘッダは画像の到着を待つ間に何度も解析しないよう、そろった時に1回だけ解析する
+    if (c->hdrlen == 0) {
+        if ((nl = memchr(c->in, '\n', c->inlen)) == NULL) {
+            if (c->inlen < SERVE_MAXHEADER)
+                return 0;
+            replyerror(c, CIMAGE_EINVAL, "request header too long");
+            c->closing = 1;
+            return 1;
+        }
+        *nl = '\0';
+        c->hdrlen = nl - c->in + 1;
+        if (!parserequest(c->in, &c->req, &msg)) {
+            replyerror(c, CIMAGE_EINVAL, msg);
+            c->closing = 1;
+            return 1;
+        }
+    }
+    if (c->inlen < c->hdrlen + c->req.size)
+        return 0;
+    c->reqlen = c->hdrlen + c->req.size;
+    return 1;
+}
+
+// 要求1つを描画して応答を作る (ワーカースレッド)
+static void renderrequest(cimage_t *ci, client_t *c) {
+    const request_t *req = &c->req;
+    const void *data;
+    const char *res;
+    size_t len, reslen;
+    struct stat st;
+    void *map = NULL;
+    int fd = -1, err;
+
+    if ((err = cimagesetcolor(ci, req->mode)) != CIMAGE_OK) {
+        replyerror(c, err, cimageerror(ci));
+        return;
+    }
+    cimagesetthreshold(ci, req->threshold_r, req->threshold_g, req->threshold_b);
+    cimagesetsize(ci, req->cols, req->maxline);
+    cimagesethalf(ci, req->half);
+
+    // パスなら mmap して (コピーせずに) メモリ上の画像として描画する
+    if (req->path != NULL) {
+        if ((fd = open(req->path, O_RDONLY)) < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            if (fd >= 0)
+                close(fd);
+            replyerror(c, CIMAGE_EREAD, "file open");
+            return;
+        }
+        len = st.st_size;
+        if (len > 0 && (map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+            close(fd);
+            replyerror(c, CIMAGE_EREAD, "file read");
+            return;
+        }
+        data = map;
+    } else {
+        data = c->in + c->reqlen - req->size;
+        len = req->size;
+    }
+
+    err = cimagerendermem(ci, data, len, &res, &reslen);
+    if (map != NULL)
+        munmap(map, len);
+    if (fd >= 0)
+        close(fd);
+    if (err != CIMAGE_OK) {
+        replyerror(c, err, cimageerror(ci));
+        return;
+    }
+    outreserve(c, reslen + 32);
+    c->outlen = snprintf(c->out, c->outcap, "OK %zu\n", reslen);
+    memcpy(c->out + c->outlen, res, reslen);
+    c->outlen += reslen;
+    c->outoff = 0;
+}
+
+// ワーカースレッド
+// 近似色探索テーブルと出力バッファはコンテキストに残して要求をまたいで使い回す
+static void *serveworker(void *arg) {
+    server_t *sv = (server_t *)arg;
+    cimage_t *ci;
+    client_t *c;
+    char b = 0;
+
+    if ((ci = cimagecreate()) == NULL) {
+        printf("Error: memory allocate\n");
+        exit(EXIT_FAILURE);
+    }
+    cimagesetmemlimit(ci, memlimit);
+    for (;;) {
+        pthread_mutex_lock(&sv->lock);
+        while (sv->qlen == 0)
+            pthread_cond_wait(&sv->ready, &sv->lock);
+        c = sv->queue[sv->qhead];
+        sv->qhead = (sv->qhead + 1) % sv->qcap;
+        sv->qlen--;
+        pthread_mutex_unlock(&sv->lock);
+
+        renderrequest(ci, c);
+
+        pthread_mutex_lock(&sv->lock);
+        c->next = sv->done;
+        sv->done = c;
+        pthread_mutex_unlock(&sv->lock);
+        while (write(sv->wake[1], &b, 1) < 0 && errno == EINTR)
+            ;
+    }
+    return NULL;
+}
+
+// 接続を閉じる
+static void closeclient(client_t *c) {
+    close(c->fd);
+    xfree(c->in);
+    xfree(c->out);
+    xfree(c);
+}
+
+// 受け取った分に要求がそろっていれば描画待ちにする
+static void nextrequest(client_t *c) {
+    if (checkrequest(c))
+        c->state = c->outlen > 0 ? CLIENT_WRITE : CLIENT_WAIT;
+}
+
+// 接続から読む (閉じられたら 0 を返す)
+static int readclient(client_t *c) {
+    ssize_t n;
+
+    if (c->incap - c->inlen < SERVE_READ) {
+        c->incap = MAX(c->incap * 2, c->inlen + SERVE_READ);
+        c->in = (char *)xrealloc(c->in, c->incap);
+    }
+    if ((n = read(c->fd, c->in + c->inlen, c->incap - c->inlen)) < 0)
+        return errno == EAGAIN || errno == EINTR;
+    if (n == 0)
+        return 0;
+    c->inlen += n;
+    nextrequest(c);
+    return 1;
+}
+
+// 接続に書く (書き終わったら次の要求へ、閉じるなら 0 を返す)
+static int writeclient(client_t *c) {
+    ssize_t n;
+
+    if ((n = write(c->fd, c->out + c->outoff, c->outlen - c->outoff)) < 0)
+        return errno == EAGAIN || errno == EINTR;
+    c->outoff += n;
+    if (c->outoff < c->outlen)
+        return 1;
+    if (c->closing)
+        return 0;
+    // 応答した要求を捨て、続けて送られていた分から次の要求を探す
+    memmove(c->in, c->in + c->reqlen, c->inlen - c->reqlen);
+    c->inlen -= c->reqlen;
+    c->hdrlen = c->reqlen = 0;
+    c->outlen = c->outoff = 0;
+    c->state = CLIENT_READ;
+    nextrequest(c);
+    return 1;
+}
+
+// 待ち受けソケットを作る (残っている古いソケットは消す)
+static int listensocket(const char *path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Error: socket path too long\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0
+        || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(fd, SOMAXCONN) != 0) {
+        printf("Error: socket `%s`: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// 描画デーモンのプロシージャ
+// ソケット path で要求を待ち、nthreads 個のワーカーで描画する (SIGINT・SIGTERM で終わる)
+void serveproc(const char *path) {
+    server_t sv;
+    client_t *cl[SERVE_MAXCLIENTS], *c, *done;
+    struct pollfd pfd[SERVE_MAXCLIENTS + 2];
+    struct sigaction sa;
+    sigset_t mask, old;
+    pthread_t th;
+    uint32_t i, n, ncl = 0;
+    int lfd, fd, ok;
+    char buf[64];
+
+    signal(SIGPIPE, SIG_IGN);
+    lfd = listensocket(path);
+
+    sv.qcap = nthreads * SERVE_QUEUE;
+    sv.queue = (client_t **)xmalloc(sizeof(client_t *) * sv.qcap);
+    sv.qhead = sv.qlen = 0;
+    sv.done = NULL;
+    if (pipe(sv.wake) != 0) {
+        printf("Error: pipe\n");
+        exit(EXIT_FAILURE);
+    }
+    fcntl(sv.wake[0], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&sv.lock, NULL);
+    pthread_cond_init(&sv.ready, NULL);
+
+    // 終了のシグナルはイベントループのスレッドだけが受ける
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&th, NULL, serveworker, &sv) != 0) {
+            printf("Error: thread create\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(th);
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onstop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    debug("[SERVE: OK] %s threads=%u\n", path, nthreads);
+
+    while (!stopping) {
+        // 描画待ちの要求を空いている分だけ待ち行列に入れる
+        pthread_mutex_lock(&sv.lock);
+        for (i = 0; i < ncl && sv.qlen < sv.qcap; i++) {
+            if (cl[i]->state != CLIENT_WAIT)
+                continue;
+            cl[i]->state = CLIENT_RENDER;
+            sv.queue[(sv.qhead + sv.qlen++) % sv.qcap] = cl[i];
+            pthread_cond_signal(&sv.ready);
+        }
+        pthread_mutex_unlock(&sv.lock);
+
+        // 読むのは要求を読んでいる接続だけ、受け付けるのは接続数が上限未満のときだけ
+        pfd[0].fd = sv.wake[0];
+        pfd[0].events = POLLIN;
+        pfd[1].fd = ncl < SERVE_MAXCLIENTS ? lfd : -1;
+        pfd[1].events = POLLIN;
+        // 描画中に切れた接続は描画が終わるまで見ない (poll が返り続けないように)
+        for (i = 0; i < ncl; i++) {
+            pfd[i + 2].fd = cl[i]->state == CLIENT_RENDER && cl[i]->closing ? -1 : cl[i]->fd;
+            pfd[i + 2].events = cl[i]->state == CLIENT_READ ? POLLIN : cl[i]->state == CLIENT_WRITE ? POLLOUT : 0;
+        }
+        if (poll(pfd, ncl + 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("Error: poll\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // 描画の終わった接続は応答を書く
+        if (pfd[0].revents & POLLIN) {
+            while (read(sv.wake[0], buf, sizeof(buf)) > 0)
+                ;
+            pthread_mutex_lock(&sv.lock);
+            done = sv.done;
+            sv.done = NULL;
+            pthread_mutex_unlock(&sv.lock);
+            for (c = done; c != NULL; c = c->next)
+                c->state = CLIENT_WRITE;
+        }
+
+        // 接続の読み書き (閉じた接続は詰める)
+        // 描画中の接続はワーカーが使っているので、切れても閉じるのは描画が終わってから (応答の書き込みで失敗する)
+        for (i = n = 0; i < ncl; i++) {
+            c = cl[i];
+            ok = 1;
+            if (c->state == CLIENT_RENDER) {
+                if (pfd[i + 2].revents & (POLLERR | POLLHUP | POLLNVAL))
+                    c->closing = 1;
+            } else if (pfd[i + 2].revents & (POLLERR | POLLNVAL))
+                ok = 0;
+            else if (c->state == CLIENT_READ && (pfd[i + 2].revents & (POLLIN | POLLHUP)))
+                ok = readclient(c);
+            else if (c->state == CLIENT_WRITE && (pfd[i + 2].revents & POLLOUT))
+                ok = writeclient(c);
+            else if (pfd[i + 2].revents & POLLHUP)
+                ok = 0;
+            if (ok)
+                cl[n++] = c;
+            else
+                closeclient(c);
+        }
+        ncl = n;
+
+        // 新しい接続
+        if (pfd[1].revents & POLLIN) {
+            while (ncl < SERVE_MAXCLIENTS && (fd = accept(lfd, NULL, NULL)) >= 0) {
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+                c = (client_t *)xcalloc(1, sizeof(client_t));
+                c->fd = fd;
+                c->state = CLIENT_READ;
+                cl[ncl++] = c;
+            }
+        }
+    }
+
+    // ワーカーは描画の途中でもそのまま終わる
+    close(lfd);
+    unlink(path);
+    debug("[SERVE: STOP]\n");
+}
+
+// すべて書く
+static void writeall(int fd, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            // 出力先が閉じられた (パイプの先の head など) ときは黙って終わる
+            if (errno == EPIPE)
+                exit(EXIT_SUCCESS);
+            printf("Error: write\n");
+            exit(EXIT_FAILURE);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// クライアントのプロシージャ
+// 描画をデーモン (ソケット path) に頼み、結果を標準出力に書く
+// 色数・横幅は viewproc と同じく TERM・t_Co・COLUMNS とコンソールから決める
+void clientproc(const char *path, char *filename, uint8_t threshold_r, uint8_t threshold_g, uint8_t threshold_b) {
+    struct sockaddr_un addr;
+    char head[SERVE_MAXHEADER + 64], real[PATH_MAX], *body = NULL, *p;
+    size_t len = 0, cap = 0, size;
+    ssize_t n;
+    int fd, hl;
+
+    getcolormode();
+    hl = snprintf(head, sizeof(head), "cols=%u color=%s threshold=%u,%u,%u half=%d ", getconsolecols(),
+                  !color256 ? "8" : fullcolor ? "truecolor" : "256", threshold_r, threshold_g, threshold_b, halfblock);
+
+    // "-" は標準入力を全部読んで送る、ファイルはパスを送る (デーモンの作業ディレクトリは違うので絶対パスにする)
+    if (strcmp(filename, "-") == 0) {
+        do {
+            if (cap - len < SERVE_READ) {
+                cap = MAX(cap * 2, len + SERVE_READ);
+                body = (char *)xrealloc(body, cap);
+            }
+            if ((n = read(STDIN_FILENO, body + len, cap - len)) < 0 && errno != EINTR) {
+                printf("Error: file read\n");
+                exit(EXIT_FAILURE);
+            }
+            len += MAX(n, 0);
+        } while (n != 0);
+        hl += snprintf(head + hl, sizeof(head) - hl, "size=%zu\n", len);
+    } else {
+        if (realpath(filename, real) == NULL) {
+            printf("Error: file open\n");
+            exit(EXIT_FAILURE);
+        }
+        hl += snprintf(head + hl, sizeof(head) - hl, "path=%s\n", real);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0
+        || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        printf("Error: connect `%s`: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    writeall(fd, head, hl);
+    writeall(fd, body, len);
+    xfree(body);
+
+    // 応答のヘッダ (1行) を読む
+    for (hl = 0; hl < (int)sizeof(head) - 1; hl++) {
+        if ((n = read(fd, &head[hl], 1)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                hl--;
+                continue;
+            }
+            printf("Error: connection closed\n");
+            exit(EXIT_FAILURE);
+        }
+        if (head[hl] == '\n')
+            break;
+    }
+    head[hl] = '\0';
+    if (strncmp(head, "OK ", 3) != 0) {
+        // "ERR エラーコード メッセージ" のメッセージだけを表示する
+        p = head;
+        if (strncmp(head, "ERR ", 4) == 0) {
+            strtol(head + 4, &p, 10);
+            while (*p == ' ')
+                p++;
+        }
+        printf("Error: %s\n", p);
+        exit(EXIT_FAILURE);
+    }
+
+    // 描画結果をそのまま標準出力へ
+    size = strtoull(head + 3, NULL, 10);
+    while (size > 0) {
+        if ((n = read(fd, real, MIN(size, sizeof(real)))) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            printf("Error: connection closed\n");
+            exit(EXIT_FAILURE);
+        }
+        writeall(STDOUT_FILENO, real, n);
+        size -= n;
+    }
+    close(fd);
+}
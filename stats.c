@@ -0,0 +1,114 @@
+/**
+ * stats.c
+ * 実行時の計測 (--stats)
+ * 段階ごとの時間を単調増加の時計で測り、出力バイト数・エスケープシーケンス数・
+ * 描いた文字数・近似色探索の回数・キャッシュの当たり外れと合わせて、
+ * 画像 (動画ならフレーム) ごとに1行の JSON を標準エラー出力に書く。
+ * 動画で出力の速さに追従しているときは、その判断 (横幅・色モード・出力の速さ) も書く。
+ * 無効のときは statslap などのフラグの確認だけで何もしない。
+ * 計測の状態 (stats_t) は呼び出し側 (コマンドライン) が持ち、ライブラリには
+ * コンテキスト (cimagesetstats) と出力バッファ (outbuf_t の stats) で渡す。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "cbmpviewer.h"
+
+// 段階の名前 (STATS_* の順)
+static const char *stagename[STATS_NSTAGE] = {
+    "setup", "cache", "open", "header", "scale", "load", "wait", "output",
+};
+
+// 色モードの名前 (adapt_t の level の順)
+static const char *colorname[3] = {"8", "256", "truecolor"};
+
+// 単調増加の時計 (秒)
+double statsclock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 計測の開始 (画像・フレームごとに呼ぶ)
+void statsstart(stats_t *st) {
+    int enabled = st->enabled, quiet = st->quiet;
+
+    if (!enabled)
+        return;
+    memset(st, 0, sizeof(*st));
+    st->enabled = enabled;
+    st->quiet = quiet;
+    st->cache = -1;
+    st->t0 = st->last = statsclock();
+}
+
+// 直前の区切りからの時間を段階 stage に足す
+void statsaddlap(stats_t *st, int stage) {
+    double t = statsclock();
+
+    st->stage[stage] += t - st->last;
+    st->last = t;
+}
+
+// 書き出す出力バッファの内容を数える
+void statsaddout(stats_t *st, const char *buf, size_t len) {
+    const char *p = buf, *end = buf + len;
+
+    st->bytes += len;
+    while ((p = memchr(p, '\x1b', end - p)) != NULL) {
+        st->escapes++;
+        p++;
+    }
+}
+
+// 描いた文字数 cells と色変換したセル数 colors を足す
+// 近似色探索 (near) を使うのは 256 色のときだけ
+void statsaddcells(stats_t *st, uint64_t cells, uint64_t colors, const consolebmp_t *cbmp) {
+    st->cells += cells;
+    if (cbmp->color256 && !cbmp->fullcolor)
+        st->lookups += colors;
+}
+
+// JSON の文字列を書く
+static void putjsonstr(const char *s) {
+    fputc('"', stderr);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(stderr, "\\%c", *s);
+        else if ((uint8_t)*s < 0x20)
+            fprintf(stderr, "\\u%04x", (uint8_t)*s);
+        else
+            fputc(*s, stderr);
+    }
+    fputc('"', stderr);
+}
+
+// 1行の JSON を標準エラー出力に書く (frame が負なら静止画)
+void statsprint(const stats_t *st, const char *name, int64_t frame) {
+    int i;
+
+    if (!st->enabled || st->quiet)
+        return;
+    fprintf(stderr, "{\"file\":");
+    putjsonstr(name);
+    if (frame >= 0)
+        fprintf(stderr, ",\"frame\":%lld", (long long)frame);
+    fprintf(stderr, ",\"total_us\":%.1f", (statsclock() - st->t0) * 1e6);
+    for (i = 0; i < STATS_NSTAGE; i++)
+        fprintf(stderr, ",\"%s_us\":%.1f", stagename[i], st->stage[i] * 1e6);
+    fprintf(stderr, ",\"bytes\":%llu,\"escapes\":%llu,\"cells\":%llu,\"lookups\":%llu",
+            (unsigned long long)st->bytes, (unsigned long long)st->escapes,
+            (unsigned long long)st->cells, (unsigned long long)st->lookups);
+    fprintf(stderr, ",\"blocked_us\":%.1f", st->blocked * 1e6);
+    if (st->cache >= 0)
+        fprintf(stderr, ",\"cache\":\"%s\"", st->cache ? "hit" : "miss");
+    if (st->adapt != NULL)
+        fprintf(stderr, ",\"adapt\":\"%s\",\"cols\":%u,\"color\":\"%s\",\"rate_Bps\":%.0f,\"load\":%.2f",
+                st->adapt->decision, st->adapt->cols, colorname[st->adapt->level],
+                st->adapt->rate, st->adapt->load);
+    fprintf(stderr, "}\n");
+}
@@ -0,0 +1,401 @@
+/**
+ * stream.c
+ * 動画のストリーム再生
+ * 標準入力などから連続したフレーム (rawvideo の rgb24/bgr24 または連結した BMP) を読み、
+ * 1つのプロセスで再生する。読み込みスレッドと描画の間は固定長のリングバッファでつなぎ、
+ * 描画が間に合わないときは古いフレームを捨てて遅延がたまらないようにする。
+ * --adaptive では出力の速さを測り、フレームレートを保てるように横幅と色モードを変える (adapt.c)。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cbmpviewer.h"
+
+// リングバッファのフレーム数
+#define RING_SLOTS 4
+
+// リングバッファの1フレーム
+typedef struct TAG_SLOT {
+    bmpimage_t img; // フレーム (img.buf に実体)
+    size_t cap;     // img.buf の確保済みサイズ
+} slot_t;
+
+// リングバッファ
+typedef struct TAG_RING {
+    slot_t slot[RING_SLOTS];
+    uint64_t head;  // 次に書き込むフレーム番号
+    uint64_t tail;  // 次に読み出すフレーム番号
+    int eof;        // 入力の終わり
+    pthread_mutex_t lock;
+    pthread_cond_t notfull;
+    pthread_cond_t notempty;
+    FILE *fp;               // 入力
+    const streamopt_t *opt; // フレーム形式
+} ring_t;
+
+// スロットのバッファを len バイト以上にする
+static uint8_t *slotbuf(slot_t *sl, size_t len) {
+    if (sl->cap < len) {
+        xfree(sl->img.buf);
+        sl->img.buf = (uint8_t *)xmalloc(len);
+        sl->cap = len;
+    }
+    return sl->img.buf;
+}
+
+// rawvideo のフレームを1つ読む (入力の終わりなら 0 を返す)
+static int readrawframe(ring_t *rg, slot_t *sl) {
+    size_t len = (size_t)rg->opt->width * rg->opt->height * 3;
+    uint8_t *p = slotbuf(sl, len);
+    uint8_t t;
+    size_t i;
+
+    if (fread(p, 1, len, rg->fp) != len)
+        return 0;
+    // rgb24 は B G R の並びに入れ替える
+    if (!rg->opt->bgr) {
+        for (i = 0; i < len; i += 3) {
+            t = p[i];
+            p[i] = p[i + 2];
+            p[i + 2] = t;
+        }
+    }
+    sl->img.width = rg->opt->width;
+    sl->img.height = rg->opt->height;
+    sl->img.top = p;
+    sl->img.pitch = (ptrdiff_t)rg->opt->width * 3;
+    return 1;
+}
+
+// 連結した BMP のフレームを1つ読む (入力の終わりなら 0 を返す)
+static int readbmpframe(ring_t *rg, slot_t *sl) {
+    bmpfileheader_t fh;
+    bmpinfoheader_t ih;
+    bmpformat_t bf;
+    size_t len;
+    int c;
+
+    if ((c = fgetc(rg->fp)) == EOF)
+        return 0;
+    ungetc(c, rg->fp);
+    getbmpheader(rg->fp, &fh, &ih);
+    checkbmpheader(&fh, &ih);
+    readbmpformat(rg->fp, &fh, &ih, &bf);
+    // フレームは積分画像にそのまま使うので無圧縮 24bit だけ
+    if (bf.bitcount != 24 || bf.compression != BI_RGB) {
+        printf("Error: --stream bmp supports only uncompressed 24-bit frames\n");
+        exit(EXIT_FAILURE);
+    }
+    skiptobits(rg->fp, &bf);
+    len = bf.stride * bf.height;
+    if (fread(slotbuf(sl, len), 1, len, rg->fp) != len)
+        return 0;
+    sl->img.width = bf.width;
+    sl->img.height = bf.height;
+    if (bf.topdown) {
+        sl->img.top = sl->img.buf;
+        sl->img.pitch = (ptrdiff_t)bf.stride;
+    } else {
+        sl->img.top = sl->img.buf + bf.stride * (bf.height - 1);
+        sl->img.pitch = -(ptrdiff_t)bf.stride;
+    }
+    return 1;
+}
+
+// 読み込みスレッド
+// 空きスロットができるまで待ってからフレームを読む
+static void *readerthread(void *arg) {
+    ring_t *rg = (ring_t *)arg;
+    slot_t *sl;
+    int ok;
+
+    for (;;) {
+        pthread_mutex_lock(&rg->lock);
+        while (rg->head - rg->tail >= RING_SLOTS)
+            pthread_cond_wait(&rg->notfull, &rg->lock);
+        sl = &rg->slot[rg->head % RING_SLOTS];
+        pthread_mutex_unlock(&rg->lock);
+
+        // 書き込み中のスロットは描画側からは見えないのでロックは不要
+        ok = (rg->opt->width != 0) ? readrawframe(rg, sl) : readbmpframe(rg, sl);
+
+        pthread_mutex_lock(&rg->lock);
+        if (ok)
+            rg->head++;
+        else
+            rg->eof = 1;
+        pthread_cond_signal(&rg->notempty);
+        pthread_mutex_unlock(&rg->lock);
+        if (!ok)
+            break;
+    }
+    return NULL;
+}
+
+// 描き終わったスロットを読み込みスレッドに返す
+static void releaseslot(ring_t *rg) {
+    pthread_mutex_lock(&rg->lock);
+    rg->tail++;
+    pthread_cond_signal(&rg->notfull);
+    pthread_mutex_unlock(&rg->lock);
+}
+
+// 現在時刻 (秒)
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 指定時刻まで待つ
+static void sleepuntil(double t) {
+    struct timespec ts;
+    double d;
+
+    while ((d = t - now()) > 0) {
+        ts.tv_sec = (time_t)d;
+        ts.tv_nsec = (long)((d - ts.tv_sec) * 1e9);
+        if (nanosleep(&ts, NULL) == 0)
+            break;
+    }
+}
+
+// カーソルを隠しているか
+static volatile sig_atomic_t hidden = 0;
+
+// 色を戻してカーソルを表示する (終了するときは必ず通る)
+static void showcursor(void) {
+    static const char leave[] = "\x1b[0m\x1b[?25h";
+
+    if (!hidden)
+        return;
+    hidden = 0;
+    if (write(STDOUT_FILENO, leave, sizeof(leave) - 1) < 0)
+        return;
+}
+
+// Ctrl-C などで終わるときもカーソルを戻してから終わる
+static void onstop(int sig) {
+    showcursor();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// 画面をクリアしてカーソルを隠す (ob の先頭に追加し、最初のフレームと一緒に書き出す)
+static void hidecursor(outbuf_t *ob) {
+    hidden = 1;
+    atexit(showcursor);
+    signal(SIGINT, onstop);
+    signal(SIGTERM, onstop);
+    signal(SIGHUP, onstop);
+    obreserve(ob, 16);
+    obputlit(ob, "\x1b[2J\x1b[?25l");
+}
+
+// "WxH" 形式のフレームサイズを解析する ("bmp" なら連結した BMP)
+void parsestreamsize(const char *s, streamopt_t *opt) {
+    char *e;
+
+    opt->width = opt->height = 0;
+    if (strcmp(s, "bmp") == 0)
+        return;
+    opt->width = strtoul(s, &e, 10);
+    if (*e == 'x' || *e == 'X')
+        opt->height = strtoul(e + 1, &e, 10);
+    if (*e != '\0' || opt->width == 0 || opt->height == 0) {
+        printf("Error: invalid stream size `%s` (WxH or bmp)\n", s);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// ストリーム再生プロシージャ
+// フレーム n は再生開始から n / fps 秒後に表示する
+// 次のフレームの表示時刻を過ぎていて、次のフレームがもう届いていれば、そのフレームは描画せずに捨てる
+void streamproc(char *filename, const streamopt_t *opt, uint8_t threshold_r, uint8_t threshold_g, uint8_t threshold_b) {
+    ring_t rg;
+    pthread_t th;
+    slot_t *sl;
+    consolebmp_t cbmp;
+    sat_t sat = {NULL, 0, 0};
+    pixel_t *cell = NULL;
+    size_t ncell = 0;
+    outbuf_t ob;
+    renderer_t rd;
+    delta_t dt;
+    adapt_t ad;
+    int32_t w = 0, h = 0;
+    uint32_t cols, cellw, cellh, i;
+    int usebox = 0;
+    uint64_t seq, shown = 0, dropped = 0;
+    double t0 = 0, interval;
+
+    // 色数の決定と近似色探索テーブルの構築
+    getcolormode();
+    if (color256 && !fullcolor)
+        initpalette();
+    cols = getconsolecols();
+    getcellsize(&cellw, &cellh);
+    cbmp.threshold_r = threshold_r;
+    cbmp.threshold_g = threshold_g;
+    cbmp.threshold_b = threshold_b;
+    cbmp.half = halfblock;
+    cbmp.color256 = color256;
+    cbmp.fullcolor = fullcolor;
+
+    // 入力オープン ("-" は標準入力)
+    memset(&rg, 0, sizeof(rg));
+    if (strcmp(filename, "-") == 0) {
+        rg.fp = stdin;
+    } else if ((rg.fp = fopen(filename, "rb")) == NULL) {
+        printf("Error: file open\n");
+        exit(EXIT_FAILURE);
+    }
+    rg.opt = opt;
+    pthread_mutex_init(&rg.lock, NULL);
+    pthread_cond_init(&rg.notfull, NULL);
+    pthread_cond_init(&rg.notempty, NULL);
+    if (pthread_create(&th, NULL, readerthread, &rg) != 0) {
+        printf("Error: thread create\n");
+        exit(EXIT_FAILURE);
+    }
+
+    obinit(&ob, 4096);
+    ob.stats = &stats;
+    initrenderer(&rd, nthreads);
+    initdelta(&dt);
+    interval = (opt->fps > 0) ? 1.0 / opt->fps : 0;
+    // 出力の速さへの追従は端末の横幅と色数から始める
+    // 出力バイト数と時間は計測 (stats) で数えるので、--stats がなければ JSON を書かずに数えるだけにする
+    if (opt->adaptive) {
+        initadapt(&ad, cols, color256 ? (fullcolor ? 2 : 1) : 0, opt->fps);
+        if (!stats.enabled) {
+            stats.enabled = 1;
+            stats.quiet = 1;
+        }
+    }
+
+    // 画面クリアとカーソルを隠す
+    hidecursor(&ob);
+
+    for (;;) {
+        // 次のフレームを待つ
+        pthread_mutex_lock(&rg.lock);
+        while (rg.head == rg.tail && !rg.eof)
+            pthread_cond_wait(&rg.notempty, &rg.lock);
+        if (rg.head == rg.tail) {
+            pthread_mutex_unlock(&rg.lock);
+            break;
+        }
+        seq = rg.tail;
+        sl = &rg.slot[seq % RING_SLOTS];
+        if (shown + dropped == 0)
+            t0 = now();
+        // 遅れているフレームは捨てる
+        if (interval > 0 && rg.head - rg.tail > 1 && now() > t0 + (seq + 1) * interval) {
+            rg.tail++;
+            dropped++;
+            pthread_cond_signal(&rg.notfull);
+            pthread_mutex_unlock(&rg.lock);
+            continue;
+        }
+        pthread_mutex_unlock(&rg.lock);
+        statsstart(&stats);
+
+        // フレームサイズが変わったらピクセル比率を決め直す
+        if (sl->img.width != w || sl->img.height != h) {
+            w = sl->img.width;
+            h = sl->img.height;
+            // 画像で出力するときは1画素をセル1つとして縮小する
+            if (graphics != CIMAGE_TEXT)
+                setpixelscale(&cbmp, w, h, cols * cellw, 0);
+            else
+                setscale(&cbmp, w, h, cols);
+            if ((size_t)cbmp.letter * cbmp.line * cbmpsub(&cbmp) > ncell) {
+                ncell = (size_t)cbmp.letter * cbmp.line * cbmpsub(&cbmp);
+                xfree(cell);
+                cell = (pixel_t *)xmalloc(sizeof(pixel_t) * ncell);
+            }
+            // 差分描画でない文字出力で、セル1つがちょうど整数の画素数なら積分画像を作らずにスロットから直接縮小する
+            usebox = !opt->delta && graphics == CIMAGE_TEXT && boxkernel(&cbmp, w, h) != NULL;
+            obreserve(&ob, 16);
+            obputlit(&ob, "\x1b[2J");
+        }
+
+        // 積分画像を作ったらスロットは読み込みスレッドに返す (直接縮小するときは描画の後で返す)
+        if (!usebox) {
+            buildsat(&sl->img, &sat);
+            releaseslot(&rg);
+        }
+        statslap(&stats, STATS_LOAD);
+
+        // 表示時刻まで待って描画
+        // 差分描画でなければカーソルを左上に戻して全体を描く
+        if (interval > 0)
+            sleepuntil(t0 + seq * interval);
+        statslap(&stats, STATS_WAIT);
+        if (graphics != CIMAGE_TEXT) {
+            // 画像はカーソルを左上に戻して毎回全体を送る (kitty は同じ画像番号で置き換える)
+            downsample(&sat, &cbmp, 0, cbmp.line, cell);
+            obreserve(&ob, 16);
+            obputlit(&ob, "\x1b[H");
+            outputpixels(cell, cbmp.letter, cbmp.line, &cbmp, graphics, 1, &ob);
+            fflush(stdout);
+            obflush(&ob, STDOUT_FILENO);
+        } else if (opt->delta) {
+            renderdelta(&dt, &sat, &cbmp, cell, &ob, opt, STDOUT_FILENO);
+        } else {
+            obreserve(&ob, 16);
+            obputlit(&ob, "\x1b[H");
+            fflush(stdout);
+            renderframe(&rd, &sat, usebox ? &sl->img : NULL, &cbmp, cell, &ob, STDOUT_FILENO);
+            if (usebox)
+                releaseslot(&rg);
+            if (stats.enabled)
+                statsaddcells(&stats, (uint64_t)cbmp.letter * cbmp.line, (uint64_t)cbmp.letter * cbmp.line * cbmpsub(&cbmp), &cbmp);
+        }
+        statslap(&stats, STATS_OUTPUT);
+
+        // 出力の速さに合わせて次のフレームからの横幅・色モードを決め直す
+        // 変えたらピクセル比率を決め直して画面をクリアし、差分描画は全体から描き直す
+        if (opt->adaptive) {
+            if (adaptframe(&ad, stats.bytes, (uint64_t)cbmp.letter * cbmp.line, stats.stage[STATS_OUTPUT])) {
+                cols = ad.cols;
+                cbmp.color256 = ad.level >= 1;
+                cbmp.fullcolor = ad.level == 2;
+                if (ad.level == 1)
+                    initpalette();
+                freedelta(&dt);
+                w = h = 0;
+            }
+            stats.adapt = &ad;
+        }
+        statsprint(&stats, filename, seq);
+        shown++;
+    }
+
+    // カーソルを戻す
+    showcursor();
+    debug("[STREAM: OK] shown=%llu,dropped=%llu\n", (unsigned long long)shown, (unsigned long long)dropped);
+
+    pthread_join(th, NULL);
+    if (rg.fp != stdin)
+        fclose(rg.fp);
+    for (i = 0; i < RING_SLOTS; i++)
+        xfree(rg.slot[i].img.buf);
+    pthread_mutex_destroy(&rg.lock);
+    pthread_cond_destroy(&rg.notfull);
+    pthread_cond_destroy(&rg.notempty);
+    freerenderer(&rd);
+    freedelta(&dt);
+    obfree(&ob);
+    xfree(cell);
+    freesat(&sat);
+}
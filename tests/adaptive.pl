@@ -0,0 +1,99 @@
+#!/usr/bin/perl
+
+# --stream --adaptive が出力の速さに追従することを確かめる
+# 合成した rawvideo を再生し、標準出力を最初の $slow 秒だけ $rate byte/秒に絞って読み、その後は絞らずに読む
+# --stats の JSON の adapt・cols・color から、絞っている間に横幅か色モードを下げ (down)、
+# 絞るのをやめた後で上げ直す (up) ことを見る
+
+use strict;
+use warnings;
+use Carp;
+use Cwd qw(abs_path);
+use POSIX qw(_exit);
+use Time::HiRes qw(time sleep);
+
+my $viewer = abs_path( shift // './cbmpviewer' );
+my ( $w, $h, $fps, $seconds ) = ( 160, 90, 30, 9 );
+my ( $rate, $slow ) = ( 100_000, 4 );
+my $err = "/tmp/cimage-test-adaptive.$$";
+END { unlink $err if defined $err }
+
+# 色モードごとの見た目の点数 (adapt.c の quality と同じ)
+my %quality = ( '8' => 0.5, '256' => 0.9, 'truecolor' => 1.0 );
+
+# フレームは横に流れる乱数の模様 (色がセルごとに変わるので出力が多い)
+srand 1;
+my @rows = map {
+    my $r = pack 'C*', map { int rand 256 } 1 .. $w * 3;
+    $r x 2;
+} 1 .. $h;
+
+pipe my $frames, my $feed or croak "pipe: $!";
+my $writer = fork // croak "fork: $!";
+if ( $writer == 0 ) {
+    close $frames;
+    binmode $feed;
+    for my $f ( 0 .. $fps * $seconds - 1 ) {
+        my $off = ( $f * 3 ) % ( $w * 3 );
+        print $feed map { substr $_, $off, $w * 3 } @rows or last;
+    }
+    close $feed;
+    _exit 0;
+}
+close $feed;
+
+local $ENV{TERM}    = 'xterm';
+local $ENV{t_Co}    = '16777216';
+local $ENV{COLUMNS} = '80';
+my $pid = open( my $out, '-|' ) // croak "fork: $!";
+if ( $pid == 0 ) {
+    open STDIN,  '<&', $frames or croak "stdin: $!";
+    open STDERR, '>',  $err    or croak "$err: $!";
+    { exec $viewer, '--stream', "${w}x$h", '--fps', $fps, '--adaptive', '--stats', '-' }
+    _exit 127;
+}
+close $frames;
+
+# 読む速さを絞る
+binmode $out;
+my ( $t0, $n, $buf ) = ( time, 0 );
+while ( sysread $out, $buf, 4096 ) {
+    $n += length $buf;
+    my $t = time - $t0;
+    next if $t >= $slow;
+    my $d = $n / $rate - $t;
+    sleep MIN( $d, $slow - $t ) if $d > 0;
+}
+close $out;
+waitpid $writer, 0;
+
+sub MIN { $_[0] < $_[1] ? $_[0] : $_[1] }
+
+# フレームごとの判断
+open my $in, '<', $err or croak "$err: $!";
+my @log;
+while (<$in>) {
+    next unless /"frame":(\d+).*"adapt":"(\w+)","cols":(\d+),"color":"(\w+)"/;
+    push @log, { frame => $1, adapt => $2, cols => $3, color => $4, score => $3 * $quality{$4} };
+}
+close $in;
+
+my $failed = 0;
+sub check
+{
+    my ( $ok, $what ) = @_;
+    print( ( $ok ? 'ok' : 'NG' ), " - $what\n" );
+    $failed = 1 unless $ok;
+}
+
+check( @log > 0, scalar(@log) . ' frames shown' );
+exit 1 unless @log;
+my $lift = $slow * $fps;
+my @before = grep { $_->{frame} < $lift } @log;
+my @after  = grep { $_->{frame} >= $lift } @log;
+my ($low) = sort { $a->{score} <=> $b->{score} } @before;
+check( ( grep { $_->{adapt} eq 'down' } @before ) && $low->{score} < $log[0]{score},
+    "steps down while throttled (from $log[0]{cols} cols $log[0]{color} to $low->{cols} cols $low->{color})" );
+check( ( grep { $_->{adapt} eq 'up' } @after ) && $log[-1]{score} > $low->{score},
+    "steps back up after the limit is lifted (to $log[-1]{cols} cols $log[-1]{color})" );
+exit $failed;
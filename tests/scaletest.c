@@ -0,0 +1,101 @@
+/**
+ * scaletest.c
+ * 縮小して復号した JPEG (1/2, 1/4, 1/8) のセルの色を、縮小せずに復号したものと比べる (make test)
+ * 幅・高さが縮小率で割り切れない画像では、最後の列・行の画素を端数の分だけ数えないと
+ * 画像が引き伸ばされて右端・下端のセルほど色がずれる。
+ * 縮小率は jpegscale が選ぶもの以下だけを試し、セルの RGB の差の平均と最大がしきい値以下なら成功。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "cbmpviewer.h"
+
+// 差の平均・最大のしきい値 (縮小しない復号との差は逆DCT の近似と丸めの分だけ)
+#define SCALETEST_MEAN 2.0
+#define SCALETEST_MAX 12
+
+// 試す大きさ (横の文字数と半ブロック)
+static const struct {
+    uint32_t cols;
+    int half;
+} cases[] = {
+    {8, 0}, {20, 0}, {20, 1}, {41, 0}, {41, 1},
+};
+
+// path を 1/scale で復号して、横 cols 文字のセルの平均色を返す (cbmp に大きさを入れる)
+static pixel_t *decodecells(const char *path, uint32_t scale, uint32_t cols, int half, consolebmp_t *cbmp, uint32_t *maxscale) {
+    image_t im;
+    reducer_t rd;
+    pixel_t *cell;
+    FILE *fp;
+
+    if ((fp = fopen(path, "rb")) == NULL) {
+        printf("Error: file open `%s`\n", path);
+        exit(EXIT_FAILURE);
+    }
+    openimage(fp, &im);
+    if (im.format != IMAGE_JPEG) {
+        printf("Error: `%s` is not a JPEG\n", path);
+        exit(EXIT_FAILURE);
+    }
+    memset(cbmp, 0, sizeof(*cbmp));
+    cbmp->half = half;
+    setscale(cbmp, im.width, im.height, cols);
+    *maxscale = jpegscale(cbmp, im.width, im.height);
+    im.scale = scale;
+    setscale(cbmp, (double)im.width / scale, (double)im.height / scale, cols);
+    decodeimage(&im, cbmp, &rd, NULL, -1);
+    cell = rd.cell;
+    rd.cell = NULL;
+    freereducer(&rd);
+    fclose(fp);
+    return cell;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "testdata/scale.jpg";
+    consolebmp_t ref, c;
+    pixel_t *full, *part;
+    uint32_t i, s, maxscale, d, dmax;
+    size_t j, n;
+    double sum;
+    int failed = 0;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        full = decodecells(path, 1, cases[i].cols, cases[i].half, &ref, &maxscale);
+        n = (size_t)ref.letter * ref.line * cbmpsub(&ref);
+        for (s = 2; s <= maxscale; s *= 2) {
+            part = decodecells(path, s, cases[i].cols, cases[i].half, &c, &maxscale);
+            if (c.letter != ref.letter || c.line != ref.line) {
+                printf("NG - 1/%u at %u cols%s: %ux%u cells, full decode %ux%u\n", s, cases[i].cols,
+                       cases[i].half ? " half" : "", c.letter, c.line, ref.letter, ref.line);
+                failed = 1;
+                xfree(part);
+                continue;
+            }
+            sum = 0;
+            dmax = 0;
+            for (j = 0; j < n; j++) {
+                d = abs(part[j].red - full[j].red);
+                sum += d;
+                dmax = MAX(dmax, d);
+                d = abs(part[j].green - full[j].green);
+                sum += d;
+                dmax = MAX(dmax, d);
+                d = abs(part[j].blue - full[j].blue);
+                sum += d;
+                dmax = MAX(dmax, d);
+            }
+            sum /= n * 3;
+            if (sum > SCALETEST_MEAN || dmax > SCALETEST_MAX)
+                failed = 1;
+            printf("%s - 1/%u at %u cols%s: mean %.2f max %u\n", sum > SCALETEST_MEAN || dmax > SCALETEST_MAX ? "NG" : "ok",
+                   s, cases[i].cols, cases[i].half ? " half" : "", sum, dmax);
+            xfree(part);
+        }
+        xfree(full);
+    }
+    return failed;
+}
@@ -0,0 +1,83 @@
+#!/usr/bin/perl
+
+# --serve のデーモンが、描画中に切れた接続で落ちないことを確かめる
+# 要求を続けて 3 つ送り、応答を読まずに描画の途中で閉じるのを繰り返してから、
+# デーモンがまだ要求に答えられること・SIGTERM で普通に終わることを見る
+# (解放済みの接続への書き込みは make test CFLAGS='-g -fsanitize=address' で確実に見つかる)
+
+use strict;
+use warnings;
+use Carp;
+use Cwd qw(abs_path);
+use IO::Socket::UNIX;
+use POSIX qw(:sys_wait_h);
+use Time::HiRes qw(sleep);
+
+my $viewer = abs_path( shift // './cbmpviewer' );
+my $dir    = "/tmp/cimage-test-serve.$$";
+my $sock   = "$dir/sock";
+my $image  = "$dir/big.bmp";
+mkdir $dir or croak "$dir: $!";
+my $pid;
+END {
+    local $?;
+    kill 'KILL', $pid if $pid && waitpid( $pid, WNOHANG ) == 0;
+    unlink $image, $sock;
+    rmdir $dir;
+}
+
+# 描画に時間がかかるよう、大きめの BMP を作って -m 0 (1行ずつ読む) で描かせる
+my ( $w, $h ) = ( 3000, 2000 );
+my $stride = $w * 3;
+open my $out, '>', $image or croak "$image: $!";
+binmode $out;
+print $out pack( 'A2 V v v V V l l v v V V l l V V',
+    'BM', 54 + $stride * $h, 0, 0, 54, 40, $w, $h, 1, 24, 0, $stride * $h, 2835, 2835, 0, 0 );
+print $out pack( 'C*', map { ( $_ * 7 ) & 255 } 0 .. $stride - 1 ) x $h;
+close $out;
+
+# 終わるときに描画中のワーカーと接続はそのまま残すので、AddressSanitizer のリーク検出は使わない
+$ENV{ASAN_OPTIONS} = join ':', grep { defined } $ENV{ASAN_OPTIONS}, 'detect_leaks=0';
+
+$pid = fork // croak "fork: $!";
+if ( $pid == 0 ) {
+    open STDOUT, '>', '/dev/null';
+    exec $viewer, '--serve', $sock, '-t', '2', '-m', '0';
+    exit 127;
+}
+for ( 1 .. 100 ) {
+    last if -S $sock;
+    sleep 0.05;
+}
+croak 'daemon did not start' unless -S $sock;
+
+my $failed = 0;
+sub check
+{
+    my ( $ok, $what ) = @_;
+    print( ( $ok ? 'ok' : 'NG' ), " - $what\n" );
+    $failed = 1 unless $ok;
+}
+
+# 応答を読まずに描画の途中で閉じる
+for my $i ( 0 .. 19 ) {
+    my $c = IO::Socket::UNIX->new( Peer => $sock ) or croak "connect: $!";
+    print $c "cols=8 color=256 path=$image\n" x 3;
+    sleep 0.005 * $i;
+    close $c;
+}
+
+# まだ答えられるか
+my $c = IO::Socket::UNIX->new( Peer => $sock ) or croak "connect: $!";
+print $c "cols=8 color=256 path=$image\n";
+my $line = <$c>;
+close $c;
+check( defined $line && $line =~ /^OK \d+$/, 'daemon answers after clients closed while rendering' );
+check( waitpid( $pid, WNOHANG ) == 0, 'daemon is still running' );
+
+kill 'TERM', $pid;
+waitpid $pid, 0;
+check( $? == 0, 'daemon exits cleanly on SIGTERM' );
+$pid = undef;
+
+exit $failed;
@@ -0,0 +1,337 @@
+/**
+ * tile.c
+ * 巨大な BMP の一部分だけを読む表示 (ビューポート)
+ * 画像を TILE_SIZE 四方のタイルに分け、表示する範囲にかかるタイルだけを
+ * offbits と行のバイト数 (4byte 境界) から求めたファイル上の位置から pread で読む。
+ * 読んだタイルは B G R に展開して LRU で追い出すキャッシュに置き、
+ * 表示した範囲の周りのタイルは別のスレッドで先読みしておく。
+ * 最初の表示にかかる時間はファイルの大きさではなく表示する範囲の大きさで決まる。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "cbmpviewer.h"
+
+// タイルを探す
+static bmptile_t *findtile(tilecache_t *tc, uint32_t tx, uint32_t ty) {
+    bmptile_t *t;
+
+    for (t = tc->hash[((uint64_t)ty * tc->ntx + tx) % tc->nhash]; t != NULL; t = t->hnext) {
+        if (t->tx == tx && t->ty == ty)
+            return t;
+    }
+    return NULL;
+}
+
+// LRU リストから外す
+static void unlinklru(bmptile_t *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+}
+
+// LRU リストの先頭 (最近使ったもの) に入れる
+static void pushlru(tilecache_t *tc, bmptile_t *t) {
+    t->prev = &tc->lru;
+    t->next = tc->lru.next;
+    tc->lru.next->prev = t;
+    tc->lru.next = t;
+}
+
+// タイルをキャッシュから外して解放する (lock を持って呼ぶ)
+static void droptile(tilecache_t *tc, bmptile_t *t) {
+    bmptile_t **pp;
+
+    for (pp = &tc->hash[((uint64_t)t->ty * tc->ntx + t->tx) % tc->nhash]; *pp != t; pp = &(*pp)->hnext)
+        ;
+    *pp = t->hnext;
+    unlinklru(t);
+    xfree(t->bgr);
+    xfree(t);
+    tc->count--;
+}
+
+// 上限を超えた分を最近使っていない方から追い出す (描画中・読み込み中のタイルは残す)
+static void evicttiles(tilecache_t *tc) {
+    bmptile_t *t, *prev;
+
+    for (t = tc->lru.prev; t != &tc->lru && tc->count > tc->cap; t = prev) {
+        prev = t->prev;
+        if (t->pin > 0 || t->loading)
+            continue;
+        droptile(tc, t);
+    }
+}
+
+// 読み込み中のタイルを作ってキャッシュに入れる (lock を持って呼ぶ)
+static bmptile_t *newtile(tilecache_t *tc, uint32_t tx, uint32_t ty) {
+    bmptile_t *t = (bmptile_t *)xcalloc(1, sizeof(bmptile_t));
+    uint64_t h = ((uint64_t)ty * tc->ntx + tx) % tc->nhash;
+
+    t->tx = tx;
+    t->ty = ty;
+    t->width = MIN(TILE_SIZE, tc->bf.width - tx * TILE_SIZE);
+    t->height = MIN(TILE_SIZE, tc->bf.height - ty * TILE_SIZE);
+    t->loading = 1;
+    t->hnext = tc->hash[h];
+    tc->hash[h] = t;
+    pushlru(tc, t);
+    tc->count++;
+    evicttiles(tc);
+    return t;
+}
+
+// タイルをファイルから読んで B G R に展開する (lock を持たずに呼ぶ)
+// 上から y 行目はファイル上では offbits + (ボトムアップなら height - 1 - y) * stride から始まる
+static void loadtile(tilecache_t *tc, bmptile_t *t) {
+    const bmpformat_t *bf = &tc->bf;
+    uint32_t x0 = t->tx * TILE_SIZE, y, r;
+    uint64_t b0 = (uint64_t)x0 * bf->bitcount / 8;
+    size_t len = ((uint64_t)(x0 + t->width) * bf->bitcount + 7) / 8 - b0, got;
+    uint8_t *raw = (uint8_t *)xmalloc(len);
+    uint64_t off;
+    ssize_t n;
+
+    t->bgr = (uint8_t *)xmalloc((size_t)t->width * t->height * 3);
+    for (r = 0; r < t->height; r++) {
+        y = t->ty * TILE_SIZE + r;
+        off = bf->offbits + (bf->topdown ? (uint64_t)y : (uint64_t)bf->height - 1 - y) * bf->stride + b0;
+        for (got = 0; got < len; got += n) {
+            n = pread(tc->fd, raw + got, len - got, off + got);
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            if (n <= 0)
+                fail(CIMAGE_EREAD, "file read");
+        }
+        expandbmppixels(bf, raw, x0, t->width, t->bgr + (size_t)r * t->width * 3);
+    }
+    xfree(raw);
+}
+
+// タイルの読み込み (tryframe に渡す)
+typedef struct TAG_LOADJOB {
+    tilecache_t *tc;
+    bmptile_t *t;
+} loadjob_t;
+
+static void loadjob(void *arg) {
+    loadjob_t *job = (loadjob_t *)arg;
+
+    loadtile(job->tc, job->t);
+}
+
+// タイルを読んで、待っているスレッドに知らせる (lock を持たずに呼ぶ)
+// 先読みのスレッドからも呼ぶので、失敗しても終了せずに入口で受け止めてエラーコードを返す
+// 失敗したタイルはキャッシュから外すので、待っていたスレッドは自分で読み直す
+static int trytile(tilecache_t *tc, bmptile_t *t) {
+    loadjob_t job = {tc, t};
+    int err = tryframe(loadjob, &job, NULL);
+
+    pthread_mutex_lock(&tc->lock);
+    if (err != CIMAGE_OK) {
+        // 読みかけの画素は入口で解放済み
+        t->bgr = NULL;
+        droptile(tc, t);
+    } else {
+        t->loading = 0;
+    }
+    pthread_cond_broadcast(&tc->loaded);
+    pthread_mutex_unlock(&tc->lock);
+    return err;
+}
+
+// タイル (tx, ty) を取る (無ければ読む)
+// 描画が終わるまで追い出さないよう pin を増やすので、使い終わったら unpintile() すること
+// 読めなければ fail() する (先読みで読めなかったタイルもここで読み直して知らせる)
+static bmptile_t *gettile(tilecache_t *tc, uint32_t tx, uint32_t ty) {
+    bmptile_t *t;
+    int err;
+
+    pthread_mutex_lock(&tc->lock);
+    // 先読みのスレッドが読んでいるところなら終わるのを待つ
+    // 待っている間に追い出されることもあるので探し直す
+    while ((t = findtile(tc, tx, ty)) != NULL && t->loading)
+        pthread_cond_wait(&tc->loaded, &tc->lock);
+    if (t != NULL) {
+        t->pin++;
+        unlinklru(t);
+        pushlru(tc, t);
+        tc->hits++;
+        pthread_mutex_unlock(&tc->lock);
+        return t;
+    }
+    t = newtile(tc, tx, ty);
+    t->pin++;
+    tc->misses++;
+    pthread_mutex_unlock(&tc->lock);
+    if ((err = trytile(tc, t)) != CIMAGE_OK)
+        fail(err, err == CIMAGE_ENOMEM ? "memory allocate" : "file read");
+    return t;
+}
+
+// 描画に使い終わったタイル
+static void unpintile(tilecache_t *tc, bmptile_t *t) {
+    pthread_mutex_lock(&tc->lock);
+    t->pin--;
+    evicttiles(tc);
+    pthread_mutex_unlock(&tc->lock);
+}
+
+// 先読みのスレッド
+// 要求されたタイルのうちキャッシュに無いものを読む
+static void *prefetcher(void *arg) {
+    tilecache_t *tc = (tilecache_t *)arg;
+    bmptile_t *t;
+    uint32_t k;
+
+    pthread_mutex_lock(&tc->lock);
+    for (;;) {
+        while (tc->nwant == 0 && !tc->quit)
+            pthread_cond_wait(&tc->wake, &tc->lock);
+        if (tc->quit)
+            break;
+        k = tc->want[tc->nwant - 1];
+        tc->nwant--;
+        if (findtile(tc, k % tc->ntx, k / tc->ntx) != NULL)
+            continue;
+        t = newtile(tc, k % tc->ntx, k / tc->ntx);
+        tc->prefetched++;
+        pthread_mutex_unlock(&tc->lock);
+        // 読めなくても知らせない (表示するときに読み直して知らせる)
+        trytile(tc, t);
+        pthread_mutex_lock(&tc->lock);
+    }
+    pthread_mutex_unlock(&tc->lock);
+    return NULL;
+}
+
+// タイルキャッシュの初期化
+// fp は無圧縮の BMP の通常ファイルで、ヘッダ・パレットまで読み込み済みのこと (解放するまで開いておく)
+// キャッシュするタイルは limit バイトまで (描画中のタイルはそれを超えても残す)
+void inittilecache(tilecache_t *tc, FILE *fp, const bmpformat_t *bf, uint64_t limit) {
+    struct stat st;
+
+    if (bf->compression == BI_RLE8 || bf->compression == BI_RLE4)
+        fail(CIMAGE_EUNSUPPORTED, "viewport needs an uncompressed bitmap");
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode))
+        fail(CIMAGE_EUNSUPPORTED, "viewport needs a regular file");
+    if ((uint64_t)st.st_size < (uint64_t)bf->offbits + (uint64_t)bf->stride * bf->height)
+        fail(CIMAGE_EREAD, "file read");
+
+    memset(tc, 0, sizeof(*tc));
+    tc->fd = fileno(fp);
+    tc->bf = *bf;
+    tc->ntx = (bf->width + TILE_SIZE - 1) / TILE_SIZE;
+    tc->nty = (bf->height + TILE_SIZE - 1) / TILE_SIZE;
+    tc->cap = MAX(limit / ((uint64_t)TILE_SIZE * TILE_SIZE * 3), 16);
+    tc->nhash = tc->cap * 2 + 1;
+    tc->hash = (bmptile_t **)xcalloc(tc->nhash, sizeof(bmptile_t *));
+    tc->lru.prev = tc->lru.next = &tc->lru;
+    pthread_mutex_init(&tc->lock, NULL);
+    pthread_cond_init(&tc->loaded, NULL);
+    pthread_cond_init(&tc->wake, NULL);
+}
+
+// タイルキャッシュの解放 (先読みのスレッドを止める)
+void freetilecache(tilecache_t *tc) {
+    bmptile_t *t, *next;
+
+    if (tc->started) {
+        pthread_mutex_lock(&tc->lock);
+        tc->quit = 1;
+        pthread_cond_signal(&tc->wake);
+        pthread_mutex_unlock(&tc->lock);
+        pthread_join(tc->th, NULL);
+    }
+    for (t = tc->lru.next; t != &tc->lru; t = next) {
+        next = t->next;
+        xfree(t->bgr);
+        xfree(t);
+    }
+    xfree(tc->hash);
+    xfree(tc->want);
+    pthread_mutex_destroy(&tc->lock);
+    pthread_cond_destroy(&tc->loaded);
+    pthread_cond_destroy(&tc->wake);
+}
+
+// 元画像の範囲 (x0, y0) から w x h を横 cols 文字 (maxline が 0 でなければ maxline 行) に縮小して
+// rd->cell に入れる (rd はここで初期化し、呼び出し側で解放する)
+// タイル1段分を取ってから1行ずつつなげて縮小するので、読むのは範囲にかかるタイルだけ
+void rendertiles(tilecache_t *tc, consolebmp_t *cbmp, uint32_t x0, uint32_t y0, uint32_t w, uint32_t h,
+                 uint32_t cols, uint32_t maxline, reducer_t *rd) {
+    uint32_t tx0 = x0 / TILE_SIZE, tx1 = (x0 + w - 1) / TILE_SIZE, ty, tx, y, y1, a, b;
+    bmptile_t **band = (bmptile_t **)xmalloc(sizeof(bmptile_t *) * (tx1 - tx0 + 1));
+    uint8_t *row = (uint8_t *)xmalloc((size_t)w * 3);
+    const bmptile_t *t;
+
+    fitscale(cbmp, w, h, cols, maxline);
+    initreducer(rd, cbmp, w, h);
+    for (ty = y0 / TILE_SIZE; ty * TILE_SIZE < y0 + h; ty++) {
+        for (tx = tx0; tx <= tx1; tx++)
+            band[tx - tx0] = gettile(tc, tx, ty);
+        y1 = MIN((ty + 1) * TILE_SIZE, y0 + h);
+        for (y = MAX(ty * TILE_SIZE, y0); y < y1; y++) {
+            // 範囲にかかる各タイルの y 行目の部分をつなげる
+            for (tx = tx0; tx <= tx1; tx++) {
+                t = band[tx - tx0];
+                a = MAX(tx * TILE_SIZE, x0);
+                b = MIN(tx * TILE_SIZE + t->width, x0 + w);
+                memcpy(row + (size_t)(a - x0) * 3,
+                       t->bgr + ((size_t)(y - ty * TILE_SIZE) * t->width + (a - tx * TILE_SIZE)) * 3,
+                       (size_t)(b - a) * 3);
+            }
+            reducerow(rd, y - y0, row);
+        }
+        for (tx = tx0; tx <= tx1; tx++)
+            unpintile(tc, band[tx - tx0]);
+    }
+    xfree(row);
+    xfree(band);
+}
+
+// 範囲 (x0, y0) から w x h の周り (タイル1つ分) のタイルを先読みさせる
+// 前の先読みの要求で残っている分は捨てる
+void prefetchtiles(tilecache_t *tc, uint32_t x0, uint32_t y0, uint32_t w, uint32_t h) {
+    uint32_t tx0 = x0 / TILE_SIZE, ty0 = y0 / TILE_SIZE;
+    uint32_t tx1 = (x0 + w - 1) / TILE_SIZE, ty1 = (y0 + h - 1) / TILE_SIZE, tx, ty, n;
+
+    tx0 = tx0 > 0 ? tx0 - 1 : 0;
+    ty0 = ty0 > 0 ? ty0 - 1 : 0;
+    tx1 = MIN(tx1 + 1, tc->ntx - 1);
+    ty1 = MIN(ty1 + 1, tc->nty - 1);
+    n = (tx1 - tx0 + 1) * (ty1 - ty0 + 1);
+    // 周りのタイルの数がキャッシュの上限を超えるなら先読みしない (読んだそばから追い出される)
+    if (n > tc->cap / 2)
+        return;
+
+    pthread_mutex_lock(&tc->lock);
+    if (n > tc->wantcap) {
+        tc->wantcap = n;
+        tc->want = (uint32_t *)xrealloc(tc->want, sizeof(uint32_t) * n);
+    }
+    tc->nwant = 0;
+    for (ty = ty0; ty <= ty1; ty++) {
+        for (tx = tx0; tx <= tx1; tx++) {
+            if (findtile(tc, tx, ty) == NULL)
+                tc->want[tc->nwant++] = ty * tc->ntx + tx;
+        }
+    }
+    if (tc->nwant > 0 && !tc->started) {
+        if (pthread_create(&tc->th, NULL, prefetcher, tc) != 0) {
+            // 先読みできなくても表示はできる
+            tc->nwant = 0;
+        } else {
+            tc->started = 1;
+        }
+    }
+    pthread_cond_signal(&tc->wake);
+    pthread_mutex_unlock(&tc->lock);
+}